@@ -34,17 +34,44 @@
 #endif
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 
-#define MAX_VA_STR_LEN 1024 * 8
+#define VA_STR_BUF_LEN 256
 #define VA_START va_list args; va_start(args, fmt)
 
 static dhdb_t* _add_to_array(dhdb_t *, dhdb_t *, dhdb_t *);
 static dhdb_t* _add_to_object(dhdb_t *, const char *, bool, dhdb_t *);
+static dhdb_t* _add_named(dhdb_t *, char *, uint8_t, dhdb_t *);
 static void _free(dhdb_t *, int);
-static const char* _va_str(const char *, va_list);
+static char* _va_str(char *, int, int *, const char *, va_list);
+static void _reserve(dhdb_t *, int);
 static bool _set_type(dhdb_t *, uint8_t);
+static void _changed(dhdb_t *);
 static void _remove_item(dhdb_t *, dhdb_t *);
 static dhdb_t* _find_object(dhdb_t *, const char *);
+static inline dhdb_t* _load(dhdb_t *);
+static inline dhdb_t* _materialize(dhdb_t *);
+static void _pack(dhdb_t *, const double *, int);
+static void _unpack(dhdb_t *);
+static bool _equal_packed(dhdb_t *, dhdb_t *);
+static inline double _num(dhdb_t *);
+static void _free_str(dhdb_t *);
+static void _free_name(dhdb_t *);
+static void _drop_shape(dhdb_t *);
+static void _release_shape(dhdb_t *);
+static int _shape_pos(struct dhdbShape *, const char *);
+static dhdb_t* _nth(dhdb_t *, int);
+static dhdb_t* _clone(dhdb_t *, dhdb_t *, dhdb_t **, char **);
+static void _copy_children(dhdb_t *, dhdb_t *);
+static inline dhdb_t* _resolve(dhdb_t *);
+static dhdb_t* _share(dhdb_t *);
+static void _unshare(dhdb_t *, bool);
+static void _release(dhdb_t *);
+static dhdb_t* _owner(dhdb_t *);
+static dhdb_t* _by(dhdb_t *, const char *);
+static dhdb_t* _at(dhdb_t *, int);
+
+void (*dhdb_internal_materialize)(dhdb_t *) = NULL;
 
 uint8_t
 dhdb_type(dhdb_t *s)
@@ -61,6 +88,8 @@ dhdb_len(dhdb_t *s)
 	if (s == NULL)
 		return 0;
 
+	s = _resolve(s);
+	_load(s);
 	return s->array_len;
 }
 
@@ -81,16 +110,12 @@ dhdb_size(dhdb_t *s)
 {
 	int bytes;
 	dhdb_t *n;
-	int i;
 
-	bytes = sizeof(dhdb_t);
-	if (s->name)
-		bytes += strlen(s->name) + 1;
-	if (s->str)
-		bytes += strlen(s->str) + 1;
+	bytes = dhdb_internal_node_size(s);
+	if (s->flags & DHDB_FLAG_SHARED)
+		return bytes;
 
 	n = s->first_child;
-	i = 0;
 	while (n) {
 		bytes += dhdb_size(n);
 		n = n->next;
@@ -98,6 +123,77 @@ dhdb_size(dhdb_t *s)
 	return bytes;
 }
 
+/* Size of the node itself, a proxy does not count what it reads through */
+uint32_t
+dhdb_internal_node_size(dhdb_t *s)
+{
+	int bytes;
+
+	bytes = sizeof(dhdb_t);
+	if (s->name)
+		bytes += strlen(s->name) + 1;
+	if (s->flags & DHDB_FLAG_SHARED)
+		return bytes;
+	if (s->flags & DHDB_FLAG_PACKED)
+		bytes += s->array_len * sizeof(double);
+	else if (s->str)
+		bytes += s->str_len + 1;
+	return bytes;
+}
+
+uint32_t
+dhdb_generation(dhdb_t *s)
+{
+	return s->gen;
+}
+
+/*
+ * Members of objects are matched by name, in any order. Numbers from
+ * raw text compare by value, so 1.0 equals 1, and packed arrays equal
+ * arrays of the same numbers.
+ */
+bool
+dhdb_equal(dhdb_t *a, dhdb_t *b)
+{
+	dhdb_t *n, *m;
+
+	a = _resolve(a);
+	b = _resolve(b);
+	if (a == b)
+		return true;
+	if (a == NULL || b == NULL || a->type != b->type)
+		return false;
+
+	switch (a->type) {
+	case DHDB_VALUE_NUMBER:
+	case DHDB_VALUE_BOOL:
+		return _num(a) == _num(b);
+	case DHDB_VALUE_STRING:
+		return a->str_len == b->str_len &&
+		    !memcmp(a->str, b->str, a->str_len);
+	case DHDB_VALUE_ARRAY:
+	case DHDB_VALUE_OBJECT:
+		break;
+	default:
+		return true;
+	}
+
+	if (dhdb_len(a) != dhdb_len(b))
+		return false;
+	if ((a->flags | b->flags) & DHDB_FLAG_PACKED)
+		return _equal_packed(a, b);
+	m = b->first_child;
+	for (n = a->first_child; n; n = n->next) {
+		if (a->type == DHDB_VALUE_OBJECT &&
+		    (m == NULL || strcasecmp(n->name, m->name)))
+			m = _by(b, n->name);
+		if (m == NULL || !dhdb_equal(n, m))
+			return false;
+		m = m->next;
+	}
+	return true;
+}
+
 void
 dhdb_free(dhdb_t *s)
 {
@@ -106,12 +202,30 @@ dhdb_free(dhdb_t *s)
 	if (s == NULL)
 		return;
 
-	if (s->str)
-		free(s->str);
-	if (s->name)
-		free(s->name);
+	/*
+	 * Still read by proxies, the last one to go frees it. Only the links
+	 * change, readers of a published version may be reading the rest.
+	 */
+	if (__atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) > 0) {
+		if (s->parent)
+			_remove_item(s->parent, s);
+		s->parent = NULL;
+		s->next = NULL;
+		s->prev = NULL;
+		/* The last proxy may have gone meanwhile */
+		if (__atomic_fetch_or(&s->refs, DHDB_REFS_RELEASED,
+		    __ATOMIC_ACQ_REL) > 0)
+			return;
+		s->refs = 0;
+	}
+	if (s->flags & DHDB_FLAG_SHARED)
+		_release(s->shared);
+
+	_free_str(s);
+	_free_name(s);
 	if (s->parent)
 		_remove_item(s->parent, s);
+	_release_shape(s);
 
 	n = s->first_child;
 	while (n) {
@@ -120,7 +234,8 @@ dhdb_free(dhdb_t *s)
 		n = next;
 	}
 
-	free(s);
+	if (!(s->flags & DHDB_FLAG_IN_BLOCK))
+		free(s);
 }
 
 dhdb_t*
@@ -129,10 +244,7 @@ dhdb_detach(dhdb_t *s)
 	if (s->parent)
 		_remove_item(s->parent, s);
 	s->parent = NULL;
-	if (s->name) {
-		free(s->name);
-		s->name = NULL;
-	}
+	_free_name(s);
 	s->next = NULL;
 	s->prev = NULL;
 	return s;
@@ -145,6 +257,8 @@ dhdb_set_str_len(dhdb_t *s, int len, const char *str)
 		return;
 
 	s->str = strndup(str, len);
+	s->str_len = strlen(s->str);
+	s->str_cap = s->str_len + 1;
 }
 
 void
@@ -156,31 +270,84 @@ dhdb_set_str(dhdb_t *s, const char *str)
 	if (!_set_type(s, DHDB_VALUE_STRING))
 		return;
 
+	s->str_len = strlen(str);
+	s->str_cap = s->str_len + 1;
 	s->str = strdup(str);
 }
 
+void
+dhdb_set_str_take(dhdb_t *s, char *str)
+{
+	assert(str);
+
+	dhdb_set_str_take_len(s, strlen(str), str);
+}
+
+void
+dhdb_set_str_take_len(dhdb_t *s, int len, char *str)
+{
+	assert(s);
+	assert(str);
+
+	if (!_set_type(s, DHDB_VALUE_STRING)) {
+		free(str);
+		return;
+	}
+
+	s->str = str;
+	s->str_len = len;
+	s->str_cap = len + 1;
+}
+
 void
 dhdb_set_str_va(dhdb_t *s, const char *fmt, ...)
 {
+	char buf[VA_STR_BUF_LEN], *str;
+	int len;
+
 	VA_START;
-	return dhdb_set_str(s, _va_str(fmt, args));
+	str = _va_str(buf, sizeof(buf), &len, fmt, args);
+	dhdb_set_str_len(s, len, str);
+	if (str != buf)
+		free(str);
 }
 
 void
 dhdb_set_str_add(dhdb_t *s, const char *str)
 {
+	assert(str);
+
+	dhdb_set_str_add_len(s, strlen(str), str);
+}
+
+void
+dhdb_set_str_add_len(dhdb_t *s, int len, const char *str)
+{
+	assert(s);
+	assert(str);
+
+	_materialize(s);
 	if (!s->str)
-		return dhdb_set_str(s, str);
+		return dhdb_set_str_len(s, len, str);
 
-	s->str = realloc(s->str, strlen(s->str) + strlen(str) + 1);
-	strcat(s->str, str);
+	_changed(s);
+	_reserve(s, len);
+	memcpy(&s->str[s->str_len], str, len);
+	s->str_len += len;
+	s->str[s->str_len] = 0;
 }
 
 void
 dhdb_set_str_add_va(dhdb_t *s, const char *fmt, ...)
 {
+	char buf[VA_STR_BUF_LEN], *str;
+	int len;
+
 	VA_START;
-	return dhdb_set_str_add(s, _va_str(fmt, args));
+	str = _va_str(buf, sizeof(buf), &len, fmt, args);
+	dhdb_set_str_add_len(s, len, str);
+	if (str != buf)
+		free(str);
 }
 
 dhdb_t*
@@ -188,8 +355,9 @@ dhdb_first(dhdb_t *s)
 {
 	if (!s)
 		return NULL;
-	else
-		return s->first_child;
+
+	s = _materialize(s);
+	return s->first_child;
 }
 
 dhdb_t*
@@ -197,8 +365,9 @@ dhdb_last(dhdb_t *s)
 {
 	if (!s)
 		return NULL;
-	else
-		return s->last_child;
+
+	s = _materialize(s);
+	return s->last_child;
 }
 
 dhdb_t*
@@ -243,6 +412,12 @@ dhdb_set_obj(dhdb_t *s, const char *field, dhdb_t *v)
 	(void) _add_to_object(s, field, true, v);
 }
 
+dhdb_t*
+dhdb_append_obj(dhdb_t *s, const char *field, dhdb_t *v)
+{
+	return _add_to_object(s, field, false, v);
+}
+
 void
 dhdb_set_obj_str(dhdb_t *s, const char *field, const char *str)
 {
@@ -252,6 +427,32 @@ dhdb_set_obj_str(dhdb_t *s, const char *field, const char *str)
 	dhdb_set_str(o, str);
 }
 
+void
+dhdb_set_obj_take_name(dhdb_t *s, char *field, dhdb_t *v)
+{
+	assert(field);
+
+	if (!_set_type(s, DHDB_VALUE_OBJECT) || dhdb_by(s, field)) {
+		free(field);
+		return;
+	}
+
+	(void) _add_named(s, field, 0, v);
+}
+
+void
+dhdb_set_obj_str_take(dhdb_t *s, const char *field, char *str)
+{
+	dhdb_t *o;
+
+	o = _add_to_object(s, field, true, NULL);
+	if (o == NULL) {
+		free(str);
+		return;
+	}
+	dhdb_set_str_take(o, str);
+}
+
 void
 dhdb_set_obj_num(dhdb_t *s, const char *field, double num)
 {
@@ -274,13 +475,30 @@ dhdb_set_array(dhdb_t *s)
 	return s;
 }
 
+dhdb_t*
+dhdb_set_object(dhdb_t *s)
+{
+	assert(s);
+
+	if (!_set_type(s, DHDB_VALUE_UNDEFINED))
+		return NULL;
+	if (!_set_type(s, DHDB_VALUE_OBJECT))
+		return NULL;
+
+	return s;
+}
+
 static dhdb_t*
 _add_to_array(dhdb_t *s, dhdb_t *val, dhdb_t *after)
 {
 	dhdb_t *next;
 
+	assert(!(s->flags & DHDB_FLAG_FROZEN));
+	_materialize(s);
 	if (s->type != DHDB_VALUE_OBJECT && !_set_type(s, DHDB_VALUE_ARRAY))
 		return NULL;
+	if (s->shape)
+		_drop_shape(s);
 
 	if (val == NULL)
 		val = dhdb_create();
@@ -290,6 +508,7 @@ _add_to_array(dhdb_t *s, dhdb_t *val, dhdb_t *after)
 	assert(val->prev == NULL);
 
 	val->parent = s;
+	_changed(s);
 
 	/* Add to end of the list, or after 'after' item */
 	if (after == 0)
@@ -340,16 +559,21 @@ _add_to_object(dhdb_t *s, const char *field, bool prevent_duplicates,
 	if (prevent_duplicates && dhdb_by(s, field))
 		return dhdb_by(s, field);
 
+	return _add_named(s, strdup(field), 0, val);
+}
+
+/* Adds val to object s under name, the node owns name unless borrowed */
+static dhdb_t*
+_add_named(dhdb_t *s, char *name, uint8_t name_flags, dhdb_t *val)
+{
 	if (val == NULL)
 		val = dhdb_create();
 
-	if (val->name)
-		free(val->name);
-	val->name = strdup(field);
+	_free_name(val);
+	val->name = name;
+	val->flags |= name_flags;
 
-	val = _add_to_array(s, val, NULL);
-
-	return val;
+	return _add_to_array(s, val, NULL);
 }
 
 void
@@ -367,6 +591,23 @@ dhdb_add_str(dhdb_t *s, const char *str)
 	dhdb_set_str(n, str);
 }
 
+void
+dhdb_add_str_take(dhdb_t *s, char *str)
+{
+	dhdb_t *n;
+
+	assert(s);
+	assert(str);
+
+	n = _add_to_array(s, NULL, NULL);
+	if (!n) {
+		free(str);
+		return;
+	}
+
+	dhdb_set_str_take(n, str);
+}
+
 void
 dhdb_add_num(dhdb_t *s, double num)
 {
@@ -374,6 +615,9 @@ dhdb_add_num(dhdb_t *s, double num)
 
 	assert(s);
 
+	if (s->flags & DHDB_FLAG_PACKED)
+		return _pack(s, &num, 1);
+
 	n = _add_to_array(s, NULL, NULL);
 	if (!n)
 		return;
@@ -381,6 +625,30 @@ dhdb_add_num(dhdb_t *s, double num)
 	dhdb_set_num(n, num);
 }
 
+/*
+ * An empty array, or a value that becomes one, keeps the numbers packed
+ * in one buffer. Arrays that already have nodes get a node per number.
+ */
+void
+dhdb_add_num_array(dhdb_t *s, const double *nums, int n)
+{
+	int i;
+
+	assert(s);
+	assert(n >= 0);
+	assert(!(s->flags & DHDB_FLAG_FROZEN));
+
+	_load(s);
+	if (s->type != DHDB_VALUE_OBJECT && !_set_type(s, DHDB_VALUE_ARRAY))
+		return;
+	if (s->type == DHDB_VALUE_ARRAY &&
+	    (s->flags & DHDB_FLAG_PACKED || s->array_len == 0))
+		return _pack(s, nums, n);
+
+	for (i = 0; i < n; i++)
+		dhdb_add_num(s, nums[i]);
+}
+
 void
 dhdb_add(dhdb_t *s, dhdb_t *v)
 {
@@ -397,18 +665,44 @@ void
 dhdb_set_from(dhdb_t *s, dhdb_t *v)
 {
 	uint8_t type;
+	double num;
+	dhdb_t *n;
+
+	v = _resolve(v);
+	if (s == v)
+		return;
+
+	/* v would be freed along with the old contents of s */
+	for (n = dhdb_parent(v); n; n = n->parent) {
+		if (n == s) {
+			v = dhdb_create_from(v);
+			dhdb_set_from(s, v);
+			dhdb_free(v);
+			return;
+		}
+	}
 
 	type = dhdb_type(v);
-	if (!_set_type(s, type))
+	num = v ? _num(v) : 0;
+	if (!_set_type(s, DHDB_VALUE_UNDEFINED) || !_set_type(s, type))
 		return;
 
 	switch (type) {
 	case DHDB_VALUE_BOOL:
 	case DHDB_VALUE_NUMBER:
-		s->num = v->num;
+		s->num = num;
 		break;
 	case DHDB_VALUE_STRING:
 		s->str = strdup(v->str);
+		s->str_len = v->str_len;
+		s->str_cap = s->str_len + 1;
+		break;
+	case DHDB_VALUE_ARRAY:
+	case DHDB_VALUE_OBJECT:
+		if (_load(v)->flags & DHDB_FLAG_PACKED)
+			_pack(s, (double *) v->str, v->array_len);
+		else
+			_copy_children(s, v);
 		break;
 	}
 }
@@ -425,7 +719,7 @@ dhdb_set_bool(dhdb_t *s, bool val)
 void
 dhdb_set_bool_toggle(dhdb_t *s)
 {
-	return dhdb_set_bool(s, s->num ? false : true);
+	return dhdb_set_bool(s, _num(s) ? false : true);
 }
 
 void
@@ -449,74 +743,143 @@ dhdb_set_num(dhdb_t *s, double num)
 void
 dhdb_set_num_dec(dhdb_t *s)
 {
-	return dhdb_set_num(s, (s->num) - 1);
+	return dhdb_set_num(s, _num(s) - 1);
 }
 
 void
 dhdb_set_num_inc(dhdb_t *s)
 {
-	return dhdb_set_num(s, (s->num) + 1);
+	return dhdb_set_num(s, _num(s) + 1);
 }
 
 void
 dhdb_set_num_add(dhdb_t *s, double add_num)
 {
-	return dhdb_set_num(s, (s->num) + add_num);
+	return dhdb_set_num(s, _num(s) + add_num);
 }
 
 void
 dhdb_set_num_sub(dhdb_t *s, double add_num)
 {
-	return dhdb_set_num(s, (s->num) - add_num);
+	return dhdb_set_num(s, _num(s) - add_num);
 }
 
 void
 dhdb_set_num_div(dhdb_t *s, double div_num)
 {
-	return dhdb_set_num(s, (s->num) / div_num);
+	return dhdb_set_num(s, _num(s) / div_num);
 }
 
 void
 dhdb_set_num_mul(dhdb_t *s, double mul_num)
 {
-	return dhdb_set_num(s, (s->num) * mul_num);
+	return dhdb_set_num(s, _num(s) * mul_num);
 }
 
 void
 dhdb_set_num_from (dhdb_t *s, dhdb_t *v)
 {
+	v = _resolve(v);
 	if (v->type == DHDB_VALUE_STRING)
-		return dhdb_set_num(s, atof(s->str));
+		return dhdb_set_num(s, atof(v->str));
 
-	return dhdb_set_num(s, v->num);
+	return dhdb_set_num(s, _num(v));
 }
 
 void
 dhdb_set_str_from(dhdb_t *s, dhdb_t *v)
 {
-	static char buf[MAX_VA_STR_LEN];
-
+	v = _resolve(v);
 	if (v->type == DHDB_VALUE_BOOL)
-		return dhdb_set_str(s, v->num ? "true" : "false");
+		return dhdb_set_str(s, _num(v) ? "true" : "false");
 	if (v->type == DHDB_VALUE_NULL)
 		return dhdb_set_str(s, "null");
 	if (v->type == DHDB_VALUE_STRING)
 		return dhdb_set_str(s, v->str);
-	if (v->type == DHDB_VALUE_NUMBER) {
-		snprintf(buf, sizeof(buf), "%f", v->num);
-		return dhdb_set_str(s, buf);
-	}
+	if (v->type == DHDB_VALUE_NUMBER && v->flags & DHDB_FLAG_RAW_NUM)
+		return dhdb_set_str_len(s, v->src_len, v->src);
+	if (v->type == DHDB_VALUE_NUMBER)
+		return dhdb_set_str_va(s, "%f", _num(v));
 	return dhdb_set_str(s, "");
 }
 
 void
 dhdb_set_bool_from(dhdb_t *s, dhdb_t *v)
 {
-	return dhdb_set_bool(s, v->num);
+	return dhdb_set_bool(s, _num(v));
 }
 
 dhdb_t*
 dhdb_by(dhdb_t *s, const char *name)
+{
+	return _by(s, name);
+}
+
+/*
+ * The object the name was last found in is answered from the cache
+ * until its generation changes. Objects of the cached shape have the
+ * member at the cached position, others are checked by comparing the
+ * name found there. A shape that was freed and reallocated does not
+ * match since ids are not reused.
+ */
+dhdb_t*
+dhdb_by_cached(dhdb_t *s, const char *name, dhdb_lookup_cache_t *ic)
+{
+	dhdb_t *n;
+	int pos;
+
+	assert(s);
+	assert(name);
+	assert(ic);
+
+	if (s->type != DHDB_VALUE_OBJECT)
+		return NULL;
+
+	s = _materialize(s);
+	if (name == ic->name && s == ic->object && s->gen == ic->gen) {
+		ic->hits++;
+		return (dhdb_t *) ic->member;
+	}
+	if (name == ic->name && ic->pos >= 0 && ic->pos < s->array_len) {
+		n = _nth(s, ic->pos);
+		if ((s->shape && s->shape == ic->shape &&
+		    s->shape->id == ic->shape_id) || !strcasecmp(n->name, name)) {
+			ic->hits++;
+			ic->object = s;
+			ic->member = n;
+			ic->gen = s->gen;
+			return n;
+		}
+	}
+
+	ic->misses++;
+	if (s->shape)
+		n = _nth(s, pos = _shape_pos(s->shape, name));
+	else {
+		for (n = s->first_child, pos = 0; n; n = n->next, pos++)
+			if (!strcasecmp(n->name, name))
+				break;
+		if (n == NULL)
+			pos = -1;
+	}
+	ic->name = name;
+	ic->pos = pos;
+	ic->object = s;
+	ic->member = n;
+	ic->gen = s->gen;
+	ic->shape = s->shape;
+	ic->shape_id = s->shape ? s->shape->id : 0;
+	return n;
+}
+
+dhdb_t*
+dhdb_at(dhdb_t *s, int idx)
+{
+	return _at(s, idx);
+}
+
+static dhdb_t*
+_by(dhdb_t *s, const char *name)
 {
 	dhdb_t *n;
 
@@ -526,6 +889,9 @@ dhdb_by(dhdb_t *s, const char *name)
 	if (s->type != DHDB_VALUE_OBJECT)
 		return NULL;
 
+	s = _materialize(s);
+	if (s->shape)
+		return _nth(s, _shape_pos(s->shape, name));
 	n = s->first_child;
 	while (n) {
 		if (!strcasecmp(n->name, name))
@@ -537,8 +903,8 @@ dhdb_by(dhdb_t *s, const char *name)
 	return NULL;
 }
 
-dhdb_t*
-dhdb_at(dhdb_t *s, int idx)
+static dhdb_t*
+_at(dhdb_t *s, int idx)
 {
 	dhdb_t *n;
 	int i;
@@ -546,6 +912,7 @@ dhdb_at(dhdb_t *s, int idx)
 	assert(s);
 	assert(idx >= 0);
 
+	s = _materialize(s);
 	n = s->first_child;
 	i = 0;
 	while (n) {
@@ -570,9 +937,9 @@ dhdb_num_by(dhdb_t *s, const char *name)
 {
 	dhdb_t *v;
 
-	v = dhdb_by(s, name);
+	v = _by(_resolve(s), name);
 	if (v)
-		return v->num;
+		return _num(v);
 
 	return 0;
 }
@@ -582,9 +949,16 @@ dhdb_num_at(dhdb_t *s, int idx)
 {
 	dhdb_t *v;
 
-	v = dhdb_at(s, idx);
+	s = _load(_resolve(s));
+	if (s->flags & DHDB_FLAG_PACKED) {
+		if (idx < 0 || idx >= s->array_len)
+			return 0;
+		return ((double *) s->str)[idx];
+	}
+
+	v = _at(s, idx);
 	if (v)
-		return v->num;
+		return _num(v);
 
 	return 0;
 }
@@ -601,15 +975,167 @@ dhdb_bool_at(dhdb_t *s, int idx)
 	return (bool) dhdb_num_at(s, idx);
 }
 
+/*
+ * Kernels for packed arrays. Separate accumulators break the dependency
+ * between iterations, so that the compiler can keep them in one vector
+ * register and the loop runs at memory speed.
+ */
+static double
+_sum(const double *v, int len)
+{
+	double a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		a0 += v[i];
+		a1 += v[i + 1];
+		a2 += v[i + 2];
+		a3 += v[i + 3];
+	}
+	for (; i < len; i++)
+		a0 += v[i];
+	return (a0 + a1) + (a2 + a3);
+}
+
+/* NaN elements never compare less or greater, so they are skipped */
+static double
+_min(const double *v, int len)
+{
+	double m0 = INFINITY, m1 = INFINITY, m2 = INFINITY, m3 = INFINITY;
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		m0 = v[i] < m0 ? v[i] : m0;
+		m1 = v[i + 1] < m1 ? v[i + 1] : m1;
+		m2 = v[i + 2] < m2 ? v[i + 2] : m2;
+		m3 = v[i + 3] < m3 ? v[i + 3] : m3;
+	}
+	for (; i < len; i++)
+		m0 = v[i] < m0 ? v[i] : m0;
+	m0 = m1 < m0 ? m1 : m0;
+	m2 = m3 < m2 ? m3 : m2;
+	return m2 < m0 ? m2 : m0;
+}
+
+static double
+_max(const double *v, int len)
+{
+	double m0 = -INFINITY, m1 = -INFINITY, m2 = -INFINITY, m3 = -INFINITY;
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		m0 = v[i] > m0 ? v[i] : m0;
+		m1 = v[i + 1] > m1 ? v[i + 1] : m1;
+		m2 = v[i + 2] > m2 ? v[i + 2] : m2;
+		m3 = v[i + 3] > m3 ? v[i + 3] : m3;
+	}
+	for (; i < len; i++)
+		m0 = v[i] > m0 ? v[i] : m0;
+	m0 = m1 > m0 ? m1 : m0;
+	m2 = m3 > m2 ? m3 : m2;
+	return m2 > m0 ? m2 : m0;
+}
+
+/*
+ * Arrays that are not packed are walked, counting only their numbers.
+ * An array without numbers has the sum 0, and NaN as the rest.
+ */
+double
+dhdb_array_sum(dhdb_t *s)
+{
+	const double *v;
+	double sum;
+	dhdb_t *n;
+	int len;
+
+	if ((v = dhdb_internal_packed(s, &len)))
+		return _sum(v, len);
+
+	sum = 0;
+	for (n = dhdb_first(_resolve(s)); n; n = n->next)
+		if (dhdb_type(n) == DHDB_VALUE_NUMBER)
+			sum += _num(n);
+	return sum;
+}
+
+double
+dhdb_array_min(dhdb_t *s)
+{
+	const double *v;
+	double min, x;
+	dhdb_t *n;
+	int len;
+
+	if ((v = dhdb_internal_packed(s, &len)))
+		return len > 0 ? _min(v, len) : NAN;
+
+	min = NAN;
+	for (n = dhdb_first(_resolve(s)); n; n = n->next) {
+		if (dhdb_type(n) != DHDB_VALUE_NUMBER)
+			continue;
+		x = _num(n);
+		if (x < min || isnan(min))
+			min = x;
+	}
+	return min;
+}
+
+double
+dhdb_array_max(dhdb_t *s)
+{
+	const double *v;
+	double max, x;
+	dhdb_t *n;
+	int len;
+
+	if ((v = dhdb_internal_packed(s, &len)))
+		return len > 0 ? _max(v, len) : NAN;
+
+	max = NAN;
+	for (n = dhdb_first(_resolve(s)); n; n = n->next) {
+		if (dhdb_type(n) != DHDB_VALUE_NUMBER)
+			continue;
+		x = _num(n);
+		if (x > max || isnan(max))
+			max = x;
+	}
+	return max;
+}
+
+double
+dhdb_array_mean(dhdb_t *s)
+{
+	const double *v;
+	double sum;
+	dhdb_t *n;
+	int len;
+
+	if ((v = dhdb_internal_packed(s, &len)))
+		return len > 0 ? _sum(v, len) / len : NAN;
+
+	sum = 0;
+	len = 0;
+	for (n = dhdb_first(_resolve(s)); n; n = n->next) {
+		if (dhdb_type(n) == DHDB_VALUE_NUMBER) {
+			sum += _num(n);
+			len++;
+		}
+	}
+	return len > 0 ? sum / len : NAN;
+}
+
 bool
 dhdb_bool(dhdb_t *s)
 {
-	return (bool) s->num;
+	return (bool) _num(s);
 }
 
 const char*
 dhdb_str(dhdb_t *s)
 {
+	s = _resolve(s);
+	if (s->flags & DHDB_FLAG_PACKED)
+		return NULL;
 	return s->str;
 }
 
@@ -618,9 +1144,9 @@ dhdb_str_at(dhdb_t *s, int idx)
 {
 	dhdb_t *v;
 
-	v = dhdb_at(s, idx);
+	v = _at(_resolve(s), idx);
 	if (v)
-		return v->str;
+		return dhdb_str(v);
 
 	return 0;
 }
@@ -628,7 +1154,19 @@ dhdb_str_at(dhdb_t *s, int idx)
 double
 dhdb_num(dhdb_t *s)
 {
-	return s->num;
+	return _num(s);
+}
+
+const char*
+dhdb_num_text(dhdb_t *s, int *len)
+{
+	s = _resolve(s);
+	if (s == NULL || !(s->flags & DHDB_FLAG_RAW_NUM))
+		return NULL;
+
+	if (len)
+		*len = s->src_len;
+	return s->src;
 }
 
 const char*
@@ -636,9 +1174,9 @@ dhdb_str_by(dhdb_t *s, const char *name)
 {
 	dhdb_t *v;
 
-	v = dhdb_by(s, name);
+	v = _by(_resolve(s), name);
 	if (v)
-		return v->str;
+		return dhdb_str(v);
 
 	return NULL;
 }
@@ -649,25 +1187,83 @@ dhdb_create()
 	return calloc(1, sizeof(dhdb_t));
 }
 
+/*
+ * Deep copy in one allocation: nodes in DFS order, then names and strings.
+ * Freeing the returned root releases the whole block at once.
+ */
 dhdb_t*
-dhdb_create_str(const char *str)
+dhdb_create_from(dhdb_t *v)
 {
-	dhdb_t *s;
+	dhdb_t *nodes;
+	char *chars;
+	size_t bytes;
+	int count;
 
-	s = dhdb_create();
-	dhdb_set_str(s, str);
-	return s;
+	if (v == NULL)
+		return dhdb_create();
+
+	count = 0;
+	bytes = 0;
+	dhdb_internal_measure(v, true, true, &count, &bytes);
+
+	nodes = malloc(count * sizeof(dhdb_t) + bytes);
+	assert(nodes);
+	chars = (char *) &nodes[count];
+
+	return _clone(v, NULL, &nodes, &chars);
 }
 
+/*
+ * Copy-on-write variant of v. Reading goes through to v, and the first
+ * structural access or write copies one level, leaving proxies for the
+ * children. A write deep down thus copies only the path to the node.
+ */
 dhdb_t*
-dhdb_create_str_va(const char *fmt, ...)
+dhdb_create_shared(dhdb_t *v)
 {
-	VA_START;
-	return dhdb_create_str(_va_str(fmt, args));
+	if (v == NULL)
+		return dhdb_create();
+
+	return _share(v);
 }
 
 dhdb_t*
-dhdb_create_str_len(int len, const char *str)
+dhdb_create_str(const char *str)
+{
+	dhdb_t *s;
+
+	s = dhdb_create();
+	dhdb_set_str(s, str);
+	return s;
+}
+
+dhdb_t*
+dhdb_create_str_take(char *str)
+{
+	dhdb_t *s;
+
+	s = dhdb_create();
+	dhdb_set_str_take(s, str);
+	return s;
+}
+
+dhdb_t*
+dhdb_create_str_va(const char *fmt, ...)
+{
+	char buf[VA_STR_BUF_LEN], *str;
+	int len;
+	dhdb_t *s;
+
+	VA_START;
+	str = _va_str(buf, sizeof(buf), &len, fmt, args);
+	s = dhdb_create_str_len(len, str);
+	if (str != buf)
+		free(str);
+	return s;
+}
+
+dhdb_t*
+dhdb_create_str_len(int len, const char *str)
 {
 	dhdb_t *s;
 
@@ -741,6 +1337,8 @@ _remove_item(dhdb_t *s, dhdb_t *item)
 {
 	dhdb_t *next, *prev;
 
+	if (s->shape)
+		_drop_shape(s);
 	next = item->next;
 	prev = item->prev;
 
@@ -754,6 +1352,7 @@ _remove_item(dhdb_t *s, dhdb_t *item)
 		s->last_child = prev;
 
 	s->array_len--;
+	_changed(s);
 }
 
 static bool
@@ -763,17 +1362,37 @@ _set_type(dhdb_t *s, uint8_t type)
 	int i;
 	char buf[64];
 
-	if (s->type == DHDB_VALUE_STRING && s->str) {
-		free(s->str);
-		s->str = 0;
+	if (s->flags & DHDB_FLAG_SHARED)
+		_unshare(s, dhdb_is_container(s) &&
+		    (type == DHDB_VALUE_ARRAY || type == DHDB_VALUE_OBJECT));
+	if (s->flags & DHDB_FLAG_LAZY) {
+		if (type == DHDB_VALUE_ARRAY || type == DHDB_VALUE_OBJECT)
+			_load(s);
+		else
+			s->flags &= ~DHDB_FLAG_LAZY;
+	}
+	if (s->flags & DHDB_FLAG_PACKED) {
+		if (type == DHDB_VALUE_OBJECT)
+			_unpack(s);
+		else if (type != DHDB_VALUE_ARRAY) {
+			_free_str(s);
+			s->flags &= ~DHDB_FLAG_PACKED;
+			s->array_len = 0;
+		}
 	}
+	if (s->flags & DHDB_FLAG_RAW_NUM) {
+		s->flags &= ~(DHDB_FLAG_RAW_NUM | DHDB_FLAG_NUM_PENDING);
+		s->src = NULL;
+		s->src_len = 0;
+	}
+	if (s->type == DHDB_VALUE_STRING)
+		_free_str(s);
+	if (type != DHDB_VALUE_OBJECT)
+		_release_shape(s);
 	if (s->type == DHDB_VALUE_OBJECT && type == DHDB_VALUE_ARRAY) {
 		n = dhdb_first(s);
 		while (n) {
-			if (n->name) {
-				free(n->name);
-				n->name = 0;
-			}
+			_free_name(n);
 			n = dhdb_next(n);
 		}
 	}
@@ -801,15 +1420,763 @@ _set_type(dhdb_t *s, uint8_t type)
 	}
 
 	s->type = type;
+	_changed(s);
 	return true;
 }
 
-static const char*
-_va_str(const char *fmt, va_list args)
+/*
+ * Makes room for len more bytes and the terminator. Capacity doubles so
+ * that appending in a loop stays linear. Borrowed strings get copied.
+ */
+static void
+_reserve(dhdb_t *s, int len)
 {
-	static char str[MAX_VA_STR_LEN];
+	int cap;
+	char *str;
+
+	if (!(s->flags & DHDB_FLAG_BORROWED_STR) &&
+	    s->str_len + len + 1 <= s->str_cap)
+		return;
 
-	vsnprintf(str, sizeof(str), fmt, args);
+	cap = s->str_cap > 16 ? s->str_cap : 16;
+	while (cap < s->str_len + len + 1)
+		cap *= 2;
+
+	if (s->flags & DHDB_FLAG_BORROWED_STR) {
+		str = malloc(cap);
+		memcpy(str, s->str, s->str_len + 1);
+		s->flags &= ~DHDB_FLAG_BORROWED_STR;
+	} else
+		str = realloc(s->str, cap);
+	assert(str);
+
+	s->str = str;
+	s->str_cap = cap;
+}
+
+/*
+ * Formats to buf, or to a malloc'd string when buf is too small, so
+ * there is no length limit. Arguments may point to the node's own string.
+ */
+static char*
+_va_str(char *buf, int size, int *len, const char *fmt, va_list args)
+{
+	va_list copy;
+	char *str = buf;
+
+	va_copy(copy, args);
+	*len = vsnprintf(buf, size, fmt, copy);
+	va_end(copy);
+	if (*len >= size) {
+		str = malloc(*len + 1);
+		assert(str);
+		vsnprintf(str, *len + 1, fmt, args);
+	}
 	va_end(args);
 	return str;
 }
+
+void
+dhdb_internal_set_str_borrowed(dhdb_t *s, int len, const char *str)
+{
+	if (!_set_type(s, DHDB_VALUE_STRING))
+		return;
+
+	s->str = (char *) str;
+	s->str_len = len;
+	s->flags |= DHDB_FLAG_BORROWED_STR;
+}
+
+dhdb_t*
+dhdb_internal_set_obj_borrowed(dhdb_t *s, const char *field, dhdb_t *v)
+{
+	dhdb_t *o;
+
+	if (!_set_type(s, DHDB_VALUE_OBJECT))
+		return NULL;
+	if ((o = dhdb_by(s, field)))
+		return o;
+
+	return _add_named(s, (char *) field, DHDB_FLAG_BORROWED_NAME, v);
+}
+
+/* Counts the nodes and the string bytes a clone of s needs */
+void
+dhdb_internal_measure(dhdb_t *s, bool root, bool deep, int *count,
+    size_t *bytes)
+{
+	dhdb_t *n;
+
+	(*count)++;
+	if (s->name && !root)
+		*bytes += strlen(s->name) + 1;
+	s = _resolve(s);
+	if (s->flags & DHDB_FLAG_PACKED)
+		*bytes += s->array_len * sizeof(double) + sizeof(double) - 1;
+	else if (s->str)
+		*bytes += s->str_len + 1;
+	if (s->flags & (DHDB_FLAG_LAZY | DHDB_FLAG_RAW_NUM))
+		*bytes += s->src_len + 1;
+
+	if (!deep)
+		return;
+	for (n = s->first_child; n; n = n->next)
+		dhdb_internal_measure(n, false, true, count, bytes);
+}
+
+static char*
+_clone_chars(char **chars, const char *src, int len)
+{
+	char *dst;
+
+	dst = *chars;
+	memcpy(dst, src, len);
+	dst[len] = 0;
+	*chars += len + 1;
+	return dst;
+}
+
+/* Packed numbers are aligned for the kernels that read them */
+static double*
+_clone_nums(char **chars, const double *src, int len)
+{
+	double *dst;
+
+	dst = (double *) (((uintptr_t) *chars + sizeof(double) - 1) &
+	    ~(uintptr_t) (sizeof(double) - 1));
+	memcpy(dst, src, len * sizeof(double));
+	*chars = (char *) &dst[len];
+	return dst;
+}
+
+/*
+ * Copies s into the next free node of the block. Strings stay in the
+ * block and are marked borrowed, so modifying them copies them out.
+ * Unparsed lazy text and raw number text are copied too, which keeps
+ * the clone independent of the source buffer. The node is not linked
+ * to the parent.
+ */
+static dhdb_t*
+_clone_node(dhdb_t *s, dhdb_t *parent, dhdb_t **nodes, char **chars)
+{
+	dhdb_t *c;
+	const char *name;
+
+	name = s->name;
+	s = _resolve(s);
+	c = (*nodes)++;
+	memset(c, 0, sizeof(dhdb_t));
+	c->type = s->type;
+	c->flags = s->flags &
+	    (DHDB_FLAG_LAZY | DHDB_FLAG_RAW_NUM | DHDB_FLAG_NUM_PENDING);
+	c->lazy_opts = s->lazy_opts;
+	c->num = s->num;
+	c->index = s->index;
+
+	if (parent) {
+		c->flags |= DHDB_FLAG_IN_BLOCK;
+		c->parent = parent;
+		c->block = _owner(parent);
+		if (name) {
+			c->name = _clone_chars(chars, name, strlen(name));
+			c->flags |= DHDB_FLAG_BORROWED_NAME;
+		}
+	}
+	if (s->flags & DHDB_FLAG_PACKED) {
+		c->str = (char *) _clone_nums(chars, (double *) s->str,
+		    s->array_len);
+		c->array_len = s->array_len;
+		c->flags |= DHDB_FLAG_PACKED | DHDB_FLAG_BORROWED_STR;
+	} else if (s->str) {
+		c->str = _clone_chars(chars, s->str, s->str_len);
+		c->str_len = s->str_len;
+		c->flags |= DHDB_FLAG_BORROWED_STR;
+	}
+	if (s->flags & (DHDB_FLAG_LAZY | DHDB_FLAG_RAW_NUM)) {
+		c->src = _clone_chars(chars, s->src, s->src_len);
+		c->src_len = s->src_len;
+	}
+	return c;
+}
+
+static dhdb_t*
+_clone(dhdb_t *s, dhdb_t *parent, dhdb_t **nodes, char **chars)
+{
+	dhdb_t *c, *n;
+
+	c = _clone_node(s, parent, nodes, chars);
+	if (parent) {
+		c->prev = parent->last_child;
+		if (parent->last_child)
+			parent->last_child->next = c;
+		else
+			parent->first_child = c;
+		parent->last_child = c;
+		parent->array_len++;
+	}
+
+	for (n = _resolve(s)->first_child; n; n = n->next)
+		(void) _clone(n, c, nodes, chars);
+
+	return c;
+}
+
+/*
+ * Clones the run of len siblings starting at s, linked to each other
+ * but not to the parent, and returns the last one. Without deep only
+ * the nodes themselves are copied.
+ */
+dhdb_t*
+dhdb_internal_clone_run(dhdb_t *s, int len, bool deep, dhdb_t *parent,
+    dhdb_t **nodes, char **chars)
+{
+	dhdb_t *c, *n, *prev;
+
+	prev = NULL;
+	for (; len > 0; len--, s = s->next) {
+		c = _clone_node(s, parent, nodes, chars);
+		c->prev = prev;
+		if (prev)
+			prev->next = c;
+		prev = c;
+
+		if (!deep)
+			continue;
+		for (n = _resolve(s)->first_child; n; n = n->next)
+			(void) _clone(n, c, nodes, chars);
+	}
+	return prev;
+}
+
+/* Children become clone roots of their own so that each can be freed */
+static void
+_copy_children(dhdb_t *s, dhdb_t *v)
+{
+	dhdb_t *n;
+
+	v = _resolve(v);
+	for (n = dhdb_first(v); n; n = n->next) {
+		if (s->type == DHDB_VALUE_OBJECT)
+			(void) _add_named(s, strdup(n->name), 0,
+			    dhdb_create_from(n));
+		else
+			(void) _add_to_array(s, dhdb_create_from(n), NULL);
+	}
+}
+
+void
+dhdb_internal_out_add(struct dhdbOut *o, const char *str, int len)
+{
+	int avail, cap;
+
+	if (o->fixed) {
+		avail = o->cap - 1 - o->len;
+		if (avail > 0) {
+			if (len < avail)
+				avail = len;
+			memcpy(&o->buf[o->len], str, avail);
+			o->buf[o->len + avail] = 0;
+		}
+		o->len += len;
+		return;
+	}
+
+	if (o->len + len + 1 > o->cap) {
+		cap = o->cap > 256 ? o->cap : 256;
+		while (cap < o->len + len + 1)
+			cap *= 2;
+		o->buf = realloc(o->buf, cap);
+		assert(o->buf);
+		o->cap = cap;
+	}
+	memcpy(&o->buf[o->len], str, len);
+	o->len += len;
+	o->buf[o->len] = 0;
+}
+
+void
+dhdb_internal_out_str(struct dhdbOut *o, const char *str)
+{
+	dhdb_internal_out_add(o, str, strlen(str));
+}
+
+void
+dhdb_internal_out_printf(struct dhdbOut *o, const char *fmt, ...)
+{
+	char buf[VA_STR_BUF_LEN], *str;
+	int len;
+
+	VA_START;
+	str = _va_str(buf, sizeof(buf), &len, fmt, args);
+	dhdb_internal_out_add(o, str, len);
+	if (str != buf)
+		free(str);
+}
+
+dhdb_t*
+dhdb_internal_resolve(dhdb_t *s)
+{
+	return _resolve(s);
+}
+
+/* Proxies of a published version read through instead of unsharing */
+void
+dhdb_internal_freeze(dhdb_t *s)
+{
+	dhdb_t *n;
+
+	if (s->flags & DHDB_FLAG_SHARED) {
+		s->flags |= DHDB_FLAG_FROZEN;
+		return;
+	}
+	for (n = s->first_child; n; n = n->next)
+		dhdb_internal_freeze(n);
+}
+
+static inline dhdb_t*
+_resolve(dhdb_t *s)
+{
+	if (s && s->flags & DHDB_FLAG_SHARED)
+		return s->shared;
+	return s;
+}
+
+/*
+ * Nodes in a clone block are pinned through the root that owns the
+ * block. It is recorded rather than found through the parents, since
+ * the node may have been detached or added to another tree since.
+ */
+static dhdb_t*
+_owner(dhdb_t *s)
+{
+	if (s->flags & DHDB_FLAG_IN_BLOCK)
+		return s->block;
+	return s;
+}
+
+static dhdb_t*
+_share(dhdb_t *v)
+{
+	dhdb_t *p;
+
+	v = _resolve(v);
+	p = dhdb_create();
+	p->type = v->type;
+	p->flags = DHDB_FLAG_SHARED;
+	p->shared = v;
+	__atomic_add_fetch(&_owner(v)->refs, 1, __ATOMIC_RELAXED);
+	return p;
+}
+
+/*
+ * Turns proxy s into a real node. With copy, the value is copied and
+ * children become proxies, otherwise s is left empty for a new value.
+ */
+static void
+_unshare(dhdb_t *s, bool copy)
+{
+	dhdb_t *v, *n;
+
+	assert(!(s->flags & DHDB_FLAG_FROZEN));
+	v = s->shared;
+	s->flags &= ~DHDB_FLAG_SHARED;
+	s->shared = NULL;
+
+	if (copy) {
+		switch (v->type) {
+		case DHDB_VALUE_STRING:
+			s->str = strndup(v->str, v->str_len);
+			s->str_len = v->str_len;
+			s->str_cap = s->str_len + 1;
+			break;
+		case DHDB_VALUE_ARRAY:
+		case DHDB_VALUE_OBJECT:
+			if (_load(v)->flags & DHDB_FLAG_PACKED) {
+				_pack(s, (double *) v->str, v->array_len);
+				break;
+			}
+			for (n = dhdb_first(v); n; n = n->next) {
+				if (v->shape)
+					(void) _add_named(s, n->name,
+					    DHDB_FLAG_BORROWED_NAME, _share(n));
+				else if (v->type == DHDB_VALUE_OBJECT)
+					(void) _add_named(s, strdup(n->name),
+					    0, _share(n));
+				else
+					(void) _add_to_array(s, _share(n),
+					    NULL);
+			}
+			if (v->shape)
+				dhdb_internal_set_shape(s, v->shape);
+			break;
+		default:
+			s->num = _num(v);
+			break;
+		}
+	} else
+		s->type = DHDB_VALUE_UNDEFINED;
+
+	_release(v);
+}
+
+static void
+_release(dhdb_t *v)
+{
+	v = _owner(v);
+	assert(__atomic_load_n(&v->refs, __ATOMIC_RELAXED) &
+	    ~DHDB_REFS_RELEASED);
+	if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) ==
+	    DHDB_REFS_RELEASED) {
+		v->refs = 0;
+		dhdb_free(v);
+	}
+}
+
+/* Watched nodes pass the change on to their watched parents */
+static void
+_changed(dhdb_t *s)
+{
+	s->gen++;
+	if (!(s->flags & DHDB_FLAG_WATCHED))
+		return;
+	for (s = s->parent; s && s->flags & DHDB_FLAG_WATCHED; s = s->parent)
+		s->gen++;
+}
+
+/* Borrowed strings point into a buffer the node doesn't own */
+static void
+_free_str(dhdb_t *s)
+{
+	if (s->str && !(s->flags & DHDB_FLAG_BORROWED_STR))
+		free(s->str);
+	s->str = NULL;
+	s->str_len = 0;
+	s->str_cap = 0;
+	s->flags &= ~DHDB_FLAG_BORROWED_STR;
+}
+
+static void
+_free_name(dhdb_t *s)
+{
+	if (s->name && !(s->flags & DHDB_FLAG_BORROWED_NAME))
+		free(s->name);
+	s->name = NULL;
+	s->flags &= ~DHDB_FLAG_BORROWED_NAME;
+}
+
+/* Same as dhdb_by compares keys, case does not matter */
+static uint32_t
+_key_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *key; key++)
+		h = (h ^ (uint8_t) tolower((uint8_t) *key)) * 16777619u;
+	return h;
+}
+
+/*
+ * The shape is one block with the keys in order, a slot table twice
+ * their count and the key text. Of keys equal but for case, the first
+ * one gets the slot like dhdb_by would find it.
+ */
+static uint32_t _shape_ids;
+
+struct dhdbShape*
+dhdb_internal_shape_create(dhdb_t *s)
+{
+	struct dhdbShape *sh;
+	size_t bytes;
+	char *chars;
+	dhdb_t *n;
+	int i, j, mask;
+
+	bytes = 0;
+	for (n = s->first_child; n; n = n->next)
+		bytes += strlen(n->name) + 1;
+	for (mask = 1; mask < s->array_len * 2; mask <<= 1)
+		;
+	mask--;
+
+	sh = malloc(sizeof(struct dhdbShape) + s->array_len * sizeof(char *) +
+	    (mask + 1) * sizeof(int) + bytes);
+	assert(sh);
+	sh->refs = 1;
+	sh->id = __atomic_add_fetch(&_shape_ids, 1, __ATOMIC_RELAXED);
+	sh->hash = dhdb_internal_shape_hash(s);
+	sh->len = s->array_len;
+	sh->mask = mask;
+	sh->keys = (char **) &sh[1];
+	sh->slots = (int *) &sh->keys[sh->len];
+	chars = (char *) &sh->slots[mask + 1];
+	memset(sh->slots, -1, (mask + 1) * sizeof(int));
+
+	for (i = 0, n = s->first_child; n; i++, n = n->next) {
+		sh->keys[i] = chars;
+		chars = stpcpy(chars, n->name) + 1;
+		for (j = _key_hash(n->name) & mask; sh->slots[j] != -1;
+		    j = (j + 1) & mask)
+			if (!strcasecmp(sh->keys[sh->slots[j]], n->name))
+				break;
+		if (sh->slots[j] == -1)
+			sh->slots[j] = i;
+	}
+	return sh;
+}
+
+/* Objects in different threads may let go of the same shape */
+void
+dhdb_internal_shape_release(struct dhdbShape *sh)
+{
+	if (__atomic_sub_fetch(&sh->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(sh);
+}
+
+/* Hash of the member names in order, case included */
+uint32_t
+dhdb_internal_shape_hash(dhdb_t *s)
+{
+	uint32_t h = 2166136261u;
+	const char *p;
+	dhdb_t *n;
+
+	for (n = s->first_child; n; n = n->next) {
+		for (p = n->name; *p; p++)
+			h = (h ^ (uint8_t) *p) * 16777619u;
+		h = (h ^ 0xff) * 16777619u;
+	}
+	return h;
+}
+
+bool
+dhdb_internal_shape_match(struct dhdbShape *sh, dhdb_t *s)
+{
+	dhdb_t *n;
+	int i;
+
+	if (sh->len != s->array_len)
+		return false;
+	for (i = 0, n = s->first_child; n; i++, n = n->next)
+		if (n->name != sh->keys[i] && strcmp(n->name, sh->keys[i]))
+			return false;
+	return true;
+}
+
+void
+dhdb_internal_set_shape(dhdb_t *s, struct dhdbShape *sh)
+{
+	dhdb_t *n;
+	int i;
+
+	assert(s->type == DHDB_VALUE_OBJECT);
+	assert(dhdb_internal_shape_match(sh, s));
+	_release_shape(s);
+	for (i = 0, n = s->first_child; n; i++, n = n->next) {
+		if (n->name == sh->keys[i])
+			continue;
+		_free_name(n);
+		n->name = sh->keys[i];
+		n->flags |= DHDB_FLAG_BORROWED_NAME;
+	}
+	__atomic_add_fetch(&sh->refs, 1, __ATOMIC_RELAXED);
+	s->shape = sh;
+}
+
+/* The names of the members may point to freed keys after this */
+static void
+_release_shape(dhdb_t *s)
+{
+	if (s->shape == NULL)
+		return;
+	dhdb_internal_shape_release(s->shape);
+	s->shape = NULL;
+}
+
+/*
+ * Members get names of their own before the key sequence changes. A
+ * member being freed has let go of its name already.
+ */
+static void
+_drop_shape(dhdb_t *s)
+{
+	dhdb_t *n;
+
+	for (n = s->first_child; n; n = n->next) {
+		if (!(n->flags & DHDB_FLAG_BORROWED_NAME))
+			continue;
+		n->name = strdup(n->name);
+		n->flags &= ~DHDB_FLAG_BORROWED_NAME;
+	}
+	_release_shape(s);
+}
+
+/* Position of the member named key in objects of the shape, or -1 */
+static int
+_shape_pos(struct dhdbShape *sh, const char *key)
+{
+	int j;
+
+	for (j = _key_hash(key) & sh->mask; sh->slots[j] != -1;
+	    j = (j + 1) & sh->mask)
+		if (!strcasecmp(sh->keys[sh->slots[j]], key))
+			break;
+	return sh->slots[j];
+}
+
+/* Child at pos of s walking from the nearer end, NULL when pos is -1 */
+static dhdb_t*
+_nth(dhdb_t *s, int pos)
+{
+	dhdb_t *n;
+	int i;
+
+	if (pos < 0)
+		return NULL;
+	assert(pos < s->array_len);
+	if (pos < s->array_len / 2)
+		for (n = s->first_child, i = pos; i > 0; i--)
+			n = n->next;
+	else
+		for (n = s->last_child, i = s->array_len - 1 - pos; i > 0; i--)
+			n = n->prev;
+	return n;
+}
+
+/*
+ * Lazy containers get their children parsed on first structural access,
+ * proxies get unshared. Returns the node whose children to use, which
+ * for frozen proxies is the shared node. Packed arrays stay packed.
+ */
+static inline dhdb_t*
+_load(dhdb_t *s)
+{
+	if (s->flags & DHDB_FLAG_SHARED) {
+		if (s->flags & DHDB_FLAG_FROZEN)
+			return s->shared;
+		_unshare(s, true);
+	}
+	if (!(s->flags & DHDB_FLAG_LAZY))
+		return s;
+
+	s->flags &= ~DHDB_FLAG_LAZY;
+	assert(dhdb_internal_materialize);
+	dhdb_internal_materialize(s);
+	return s;
+}
+
+/* Like _load, but packed arrays get nodes for code that walks children */
+static inline dhdb_t*
+_materialize(dhdb_t *s)
+{
+	s = _load(s);
+	if (s->flags & DHDB_FLAG_PACKED)
+		_unpack(s);
+	return s;
+}
+
+const double*
+dhdb_internal_packed(dhdb_t *s, int *len)
+{
+	s = _load(_resolve(s));
+	if (!(s->flags & DHDB_FLAG_PACKED))
+		return NULL;
+	*len = s->array_len;
+	return (double *) s->str;
+}
+
+/*
+ * Appends to the numbers of a packed array, or makes an empty array
+ * packed. Capacity in str_cap counts numbers and doubles like it does
+ * for strings. A borrowed buffer gets copied.
+ */
+static void
+_pack(dhdb_t *s, const double *nums, int n)
+{
+	double *buf;
+	int cap;
+
+	if (n == 0)
+		return;
+	if (s->array_len + n > s->str_cap ||
+	    s->flags & DHDB_FLAG_BORROWED_STR) {
+		cap = s->str_cap > 0 ? s->str_cap * 2 : 8;
+		if (cap < s->array_len + n)
+			cap = s->array_len + n;
+		if (s->flags & DHDB_FLAG_BORROWED_STR) {
+			buf = malloc(cap * sizeof(double));
+			assert(buf);
+			memcpy(buf, s->str, s->array_len * sizeof(double));
+			s->flags &= ~DHDB_FLAG_BORROWED_STR;
+		} else {
+			buf = realloc(s->str, cap * sizeof(double));
+			assert(buf);
+		}
+		s->str = (char *) buf;
+		s->str_cap = cap;
+	}
+	memcpy(&((double *) s->str)[s->array_len], nums, n * sizeof(double));
+	s->array_len += n;
+	s->flags |= DHDB_FLAG_PACKED;
+	_changed(s);
+}
+
+/* Turns the packed numbers into number nodes */
+static void
+_unpack(dhdb_t *s)
+{
+	double *buf;
+	bool borrowed;
+	int i, len;
+
+	buf = (double *) s->str;
+	len = s->array_len;
+	borrowed = s->flags & DHDB_FLAG_BORROWED_STR;
+	s->flags &= ~(DHDB_FLAG_PACKED | DHDB_FLAG_BORROWED_STR);
+	s->str = NULL;
+	s->str_cap = 0;
+	s->array_len = 0;
+
+	for (i = 0; i < len; i++)
+		dhdb_add_num(s, buf[i]);
+	if (!borrowed)
+		free(buf);
+}
+
+/* Either one is packed, the other may have number nodes instead */
+static bool
+_equal_packed(dhdb_t *a, dhdb_t *b)
+{
+	const double *x, *y;
+	dhdb_t *n;
+	int i;
+
+	if (!(a->flags & DHDB_FLAG_PACKED)) {
+		n = a;
+		a = b;
+		b = n;
+	}
+	x = (double *) a->str;
+	if (b->flags & DHDB_FLAG_PACKED) {
+		y = (double *) b->str;
+		for (i = 0; i < a->array_len; i++)
+			if (x[i] != y[i])
+				return false;
+		return true;
+	}
+	for (i = 0, n = b->first_child; n; i++, n = n->next)
+		if (dhdb_type(n) != DHDB_VALUE_NUMBER || _num(n) != x[i])
+			return false;
+	return true;
+}
+
+/* Raw numbers are converted from their source text on first use */
+static inline double
+_num(dhdb_t *s)
+{
+	s = _resolve(s);
+	if (s->flags & DHDB_FLAG_NUM_PENDING) {
+		s->num = strtod(s->src, NULL);
+		s->flags &= ~DHDB_FLAG_NUM_PENDING;
+	}
+	return s->num;
+}
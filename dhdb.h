@@ -35,12 +35,14 @@ typedef struct dhdbValue dhdb_t;
 /* Creation and destroying */
 dhdb_t*		dhdb_create		();
 dhdb_t*		dhdb_create_null	();
-dhdb_t*		dhdb_create_from	(dhdb_t *v);
+dhdb_t*		dhdb_create_from	(dhdb_t *v);	// Deep copy, nodes below the root must not outlive it
+dhdb_t*		dhdb_create_shared	(dhdb_t *v);	// Copy-on-write variant, v must stay unmodified
 
 dhdb_t*		dhdb_create_str		(const char *str);
 dhdb_t*		dhdb_create_str_va	(const char *str, ...);
 dhdb_t*		dhdb_create_str_len	(int len, const char *str);
 dhdb_t*		dhdb_create_str_from	(dhdb_t *v);
+dhdb_t*		dhdb_create_str_take	(char *str);
 
 dhdb_t*		dhdb_create_num		(double num);
 dhdb_t*		dhdb_create_num_from	(dhdb_t *v);
@@ -56,10 +58,16 @@ uint8_t		dhdb_type		(dhdb_t *s);
 const char*	dhdb_name		(dhdb_t *s);
 bool		dhdb_is_container	(dhdb_t *s);
 uint32_t	dhdb_size		(dhdb_t *s);
+bool		dhdb_equal		(dhdb_t *a, dhdb_t *b);	// Deep comparison, member order does not matter
+uint32_t	dhdb_generation		(dhdb_t *s);	// Changes when the node or its children change
 
-/* Generic value search */
+/*
+ * Generic value search. Getting child nodes of a packed array, with
+ * dhdb_at, dhdb_first or dhdb_last, unpacks it into a node per number
+ * for good. dhdb_num_at, dhdb_len and the aggregates read it as is.
+ */
 dhdb_t*		dhdb_by		(dhdb_t *s, const char *name);
-dhdb_t*		dhdb_at		(dhdb_t *s, int idx);
+dhdb_t*		dhdb_at		(dhdb_t *s, int idx);	// Unpacks a packed array
 dhdb_t*		dhdb_first	(dhdb_t *s);
 dhdb_t*		dhdb_last	(dhdb_t *s);
 dhdb_t*		dhdb_next	(dhdb_t *s);
@@ -67,10 +75,34 @@ dhdb_t*		dhdb_prev	(dhdb_t *s);
 dhdb_t*		dhdb_parent	(dhdb_t *s);
 uint32_t	dhdb_index	(dhdb_t *s);	// Array index of given element
 
+/*
+ * Caller-held cache for looking up one name in many similar objects,
+ * such as in a loop over records. Zero it before the first use and after
+ * freeing objects it was used on. The name is compared by pointer, so
+ * use one cache per call site. Looking up again in the same unchanged
+ * object takes constant time. Other objects are tried at the cached
+ * position, reached from the nearer end without comparing names.
+ */
+typedef struct dhdbLookupCache
+{
+	const char *name;
+	int pos;		// Where the name was found last, or -1
+	const void *object;	// Where it was found, while its generation is gen
+	const void *member;
+	uint32_t gen;
+	const void *shape;
+	uint32_t shape_id;
+	uint32_t hits;
+	uint32_t misses;
+} dhdb_lookup_cache_t;
+
+dhdb_t*		dhdb_by_cached	(dhdb_t *s, const char *name, dhdb_lookup_cache_t *ic);
+
 /* Conversion from JSON type to C type with search helpers */
 double		dhdb_num	(dhdb_t *s);
 double		dhdb_num_by	(dhdb_t *s, const char *name);
 double		dhdb_num_at	(dhdb_t *s, int idx);
+const char*	dhdb_num_text	(dhdb_t *s, int *len);	// Source text of an unmodified parsed number or NULL
 
 const char*	dhdb_str	(dhdb_t *s);
 const char*	dhdb_str_by	(dhdb_t *s, const char *name);
@@ -80,13 +112,24 @@ bool	dhdb_bool	(dhdb_t *s);
 bool	dhdb_bool_by	(dhdb_t *s, const char *name);
 bool	dhdb_bool_at	(dhdb_t *s, int idx);
 
+/* Aggregates over the numbers of an array, fastest when the array is packed */
+double		dhdb_array_sum		(dhdb_t *s);
+double		dhdb_array_min		(dhdb_t *s);	// NaN when there are no numbers
+double		dhdb_array_max		(dhdb_t *s);
+double		dhdb_array_mean		(dhdb_t *s);
+
 /* Value settings */
 void		dhdb_set_str		(dhdb_t *s, const char *str);
 void		dhdb_set_str_va		(dhdb_t *s, const char *fmt, ...);
 void		dhdb_set_str_add	(dhdb_t *s, const char *str);
 void		dhdb_set_str_add_va	(dhdb_t *s, const char *fmt, ...);
+void		dhdb_set_str_add_len	(dhdb_t *s, int len, const char *str);
 void		dhdb_set_str_len	(dhdb_t *s, int len, const char *str);
 
+/* Take ownership of a malloc'd string instead of copying it */
+void		dhdb_set_str_take	(dhdb_t *s, char *str);
+void		dhdb_set_str_take_len	(dhdb_t *s, int len, char *str);
+
 void		dhdb_set_num		(dhdb_t *s, double num);
 void		dhdb_set_num_dec	(dhdb_t *s);
 void		dhdb_set_num_inc	(dhdb_t *s);
@@ -100,7 +143,7 @@ void		dhdb_set_bool_toggle	(dhdb_t *s);
 
 void		dhdb_set_null		(dhdb_t *s);
 
-/* Copy contents from another dhdb_t* pointer instead of doing pointer assignment */
+/* Copy contents from another dhdb_t* pointer instead of doing pointer assignment, containers are copied deeply */
 void		dhdb_set_from		(dhdb_t *s, dhdb_t *v);
 
 /* TODO: Value conversions */
@@ -112,13 +155,20 @@ void		dhdb_set_bool_from	(dhdb_t *s, dhdb_t *v);
 void		dhdb_set_obj		(dhdb_t *s, const char *field, dhdb_t *val);
 void		dhdb_set_obj_str	(dhdb_t *s, const char *field, const char *str);
 void		dhdb_set_obj_num	(dhdb_t *s, const char *field, double num);
+void		dhdb_set_obj_take_name	(dhdb_t *s, char *field, dhdb_t *val);	// Takes ownership of malloc'd field
+void		dhdb_set_obj_str_take	(dhdb_t *s, const char *field, char *str);	// Takes ownership of malloc'd str
+dhdb_t*		dhdb_append_obj		(dhdb_t *s, const char *field, dhdb_t *val);	// Adds field without checking for an existing one
 
 /* Creating an array or adding to an array */
 void		dhdb_add_str		(dhdb_t *s, const char *str);
+void		dhdb_add_str_take	(dhdb_t *s, char *str);	// Takes ownership of malloc'd str
 void		dhdb_add_num		(dhdb_t *s, double num);
+/* Kept packed if s has no nodes yet, until something asks for its nodes */
+void		dhdb_add_num_array	(dhdb_t *s, const double *nums, int n);
 void		dhdb_add		(dhdb_t *s, dhdb_t *v);
 void		dhdb_insert		(dhdb_t *s, dhdb_t *after, dhdb_t *v); // Insert array element after 'after'
 dhdb_t*		dhdb_set_array		(dhdb_t *s); /* Necessary only for creating an empty array */
+dhdb_t*		dhdb_set_object		(dhdb_t *s); /* Necessary only for creating an empty object */
 dhdb_t*		dhdb_detach		(dhdb_t *s); // Detach element from its parents, remember to manage its freeing
 
 /* Changing item type (needed only by editors such as for changing object array to plain array) */
@@ -0,0 +1,322 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_conc.h"
+#include "dhdb_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define DEFAULT_SHARDS		64
+#define CACHE_LINE		64
+
+struct shard
+{
+	pthread_rwlock_t lock;
+	dhdb_t *obj;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct dhdbConc
+{
+	struct shard *shards;
+	uint32_t mask;
+};
+
+/*
+ * Intrusive MPSC queue (Vyukov) linked through the next pointers of the
+ * values, which are free until the values are drained into the array.
+ * Producers swap themselves in as head, the consumer follows next from
+ * tail. A batch is pushed as one segment, already linked by its array.
+ */
+struct dhdbConcArray
+{
+	dhdb_t *head __attribute__((aligned(CACHE_LINE)));
+	dhdb_t *tail __attribute__((aligned(CACHE_LINE)));
+	dhdb_t *array;
+	dhdb_t stub;
+};
+
+static struct shard* _shard(dhdb_conc_t *, const char *);
+static void _push(dhdb_conc_array_t *, dhdb_t *, dhdb_t *);
+static void _deliver(dhdb_conc_array_t *, dhdb_t *);
+
+dhdb_conc_t*
+dhdb_conc_create(int shards)
+{
+	dhdb_conc_t *c;
+	uint32_t n;
+
+	if (shards <= 0)
+		shards = DEFAULT_SHARDS;
+	for (n = 1; n < shards; n *= 2)
+		;
+
+	c = malloc(sizeof(*c));
+	assert(c);
+	if (posix_memalign((void **) &c->shards, CACHE_LINE,
+	    n * sizeof(struct shard))) {
+		free(c);
+		return NULL;
+	}
+	c->mask = n - 1;
+	for (n = 0; n <= c->mask; n++) {
+		pthread_rwlock_init(&c->shards[n].lock, NULL);
+		c->shards[n].obj = dhdb_set_object(dhdb_create());
+	}
+	return c;
+}
+
+void
+dhdb_conc_free(dhdb_conc_t *c)
+{
+	uint32_t i;
+
+	for (i = 0; i <= c->mask; i++) {
+		pthread_rwlock_destroy(&c->shards[i].lock);
+		dhdb_free(c->shards[i].obj);
+	}
+	free(c->shards);
+	free(c);
+}
+
+dhdb_t*
+dhdb_conc_by(dhdb_conc_t *c, const char *field)
+{
+	struct shard *sh;
+	dhdb_t *v;
+
+	sh = _shard(c, field);
+	pthread_rwlock_rdlock(&sh->lock);
+	v = dhdb_by(sh->obj, field);
+	if (v)
+		v = dhdb_create_from(v);
+	pthread_rwlock_unlock(&sh->lock);
+	return v;
+}
+
+bool
+dhdb_conc_has(dhdb_conc_t *c, const char *field)
+{
+	struct shard *sh;
+	bool found;
+
+	sh = _shard(c, field);
+	pthread_rwlock_rdlock(&sh->lock);
+	found = dhdb_by(sh->obj, field) != NULL;
+	pthread_rwlock_unlock(&sh->lock);
+	return found;
+}
+
+void
+dhdb_conc_set_obj(dhdb_conc_t *c, const char *field, dhdb_t *v)
+{
+	struct shard *sh;
+
+	assert(v);
+
+	sh = _shard(c, field);
+	pthread_rwlock_wrlock(&sh->lock);
+	dhdb_free(dhdb_by(sh->obj, field));
+	dhdb_set_obj(sh->obj, field, v);
+	pthread_rwlock_unlock(&sh->lock);
+}
+
+bool
+dhdb_conc_remove(dhdb_conc_t *c, const char *field)
+{
+	struct shard *sh;
+	dhdb_t *v;
+
+	sh = _shard(c, field);
+	pthread_rwlock_wrlock(&sh->lock);
+	v = dhdb_by(sh->obj, field);
+	dhdb_free(v);
+	pthread_rwlock_unlock(&sh->lock);
+	return v != NULL;
+}
+
+int
+dhdb_conc_len(dhdb_conc_t *c)
+{
+	uint32_t i;
+	int len;
+
+	len = 0;
+	for (i = 0; i <= c->mask; i++) {
+		pthread_rwlock_rdlock(&c->shards[i].lock);
+		len += dhdb_len(c->shards[i].obj);
+		pthread_rwlock_unlock(&c->shards[i].lock);
+	}
+	return len;
+}
+
+void
+dhdb_conc_update(dhdb_conc_t *c, const char *field,
+    void (*fn)(dhdb_t *v, void *arg), void *arg)
+{
+	struct shard *sh;
+	dhdb_t *v;
+
+	sh = _shard(c, field);
+	pthread_rwlock_wrlock(&sh->lock);
+	v = dhdb_by(sh->obj, field);
+	if (v == NULL) {
+		v = dhdb_create();
+		dhdb_set_obj(sh->obj, field, v);
+	}
+	fn(v, arg);
+	pthread_rwlock_unlock(&sh->lock);
+}
+
+dhdb_t*
+dhdb_conc_to_dhdb(dhdb_conc_t *c)
+{
+	dhdb_t *s, *n;
+	uint32_t i;
+
+	s = dhdb_set_object(dhdb_create());
+	for (i = 0; i <= c->mask; i++) {
+		pthread_rwlock_rdlock(&c->shards[i].lock);
+		for (n = dhdb_first(c->shards[i].obj); n; n = dhdb_next(n))
+			dhdb_set_obj(s, dhdb_name(n), dhdb_create_from(n));
+		pthread_rwlock_unlock(&c->shards[i].lock);
+	}
+	return s;
+}
+
+dhdb_conc_array_t*
+dhdb_conc_array_create(dhdb_t *array)
+{
+	dhdb_conc_array_t *a;
+
+	assert(array);
+
+	if (posix_memalign((void **) &a, CACHE_LINE, sizeof(*a)))
+		return NULL;
+	memset(a, 0, sizeof(*a));
+	if (dhdb_type(array) != DHDB_VALUE_ARRAY)
+		dhdb_set_array(array);
+	a->array = array;
+	a->head = &a->stub;
+	a->tail = &a->stub;
+	return a;
+}
+
+void
+dhdb_conc_array_free(dhdb_conc_array_t *a)
+{
+	while (dhdb_conc_drain(a))
+		;
+	free(a);
+}
+
+void
+dhdb_conc_add(dhdb_conc_array_t *a, dhdb_t *v)
+{
+	assert(v->parent == NULL);
+
+	v->prev = NULL;
+	_push(a, v, v);
+}
+
+void
+dhdb_conc_add_batch(dhdb_conc_array_t *a, dhdb_t *batch)
+{
+	dhdb_t *first, *last;
+
+	first = dhdb_first(batch);
+	last = dhdb_last(batch);
+	if (first == NULL)
+		return;
+
+	batch->first_child = NULL;
+	batch->last_child = NULL;
+	batch->array_len = 0;
+	_push(a, first, last);
+}
+
+int
+dhdb_conc_drain(dhdb_conc_array_t *a)
+{
+	dhdb_t *tail, *next;
+	int n;
+
+	n = 0;
+	tail = a->tail;
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	for (;;) {
+		if (tail == &a->stub) {
+			if (next == NULL)
+				break;
+			tail = next;
+			next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+		}
+		if (next == NULL) {
+			/* A producer is between swapping head and linking */
+			if (tail != __atomic_load_n(&a->head, __ATOMIC_ACQUIRE))
+				break;
+			_push(a, &a->stub, &a->stub);
+			next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+			if (next == NULL)
+				break;
+		}
+		_deliver(a, tail);
+		n++;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	a->tail = tail;
+	return n;
+}
+
+static void
+_push(dhdb_conc_array_t *a, dhdb_t *first, dhdb_t *last)
+{
+	dhdb_t *prev;
+
+	__atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&a->head, last, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
+
+static void
+_deliver(dhdb_conc_array_t *a, dhdb_t *v)
+{
+	v->next = NULL;
+	v->prev = NULL;
+	v->parent = NULL;
+	dhdb_add(a->array, v);
+}
+
+/* FNV-1a over the lowercased key, keys compare case-insensitively */
+static struct shard*
+_shard(dhdb_conc_t *c, const char *field)
+{
+	uint32_t hash;
+
+	assert(field);
+
+	hash = 2166136261u;
+	while (*field) {
+		hash ^= (uint8_t) tolower((uint8_t) *field++);
+		hash *= 16777619u;
+	}
+	return &c->shards[hash & c->mask];
+}
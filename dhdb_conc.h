@@ -0,0 +1,65 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_CONC_H__
+#define __DHDB_CONC_H__
+
+#include "dhdb.h"
+
+/*
+Object for concurrent use from many threads, such as a session map
+- Members are sharded by key hash, each shard has its own lock
+- Writers on keys in different shards never wait for each other
+- Keys are case-insensitive like with dhdb_by
+- dhdb_conc_by returns a copy, since the member may be replaced at any time
+- Members must not use lazy parsing or raw numbers, since reads would modify them
+*/
+typedef struct dhdbConc dhdb_conc_t;
+
+dhdb_conc_t*	dhdb_conc_create	(int shards);	// Rounded up to a power of two, 0 for default
+void		dhdb_conc_free		(dhdb_conc_t *c);
+
+dhdb_t*		dhdb_conc_by		(dhdb_conc_t *c, const char *field);	// Copy to be freed by caller, or NULL
+bool		dhdb_conc_has		(dhdb_conc_t *c, const char *field);
+void		dhdb_conc_set_obj	(dhdb_conc_t *c, const char *field, dhdb_t *v);	// Takes ownership of v, replaces
+bool		dhdb_conc_remove	(dhdb_conc_t *c, const char *field);
+int		dhdb_conc_len		(dhdb_conc_t *c);
+
+/* Runs fn with the member locked for writing, creating it when missing */
+void		dhdb_conc_update	(dhdb_conc_t *c, const char *field,
+			    void (*fn)(dhdb_t *v, void *arg), void *arg);
+
+/* Copy of all members as a plain object, not an atomic snapshot across shards */
+dhdb_t*		dhdb_conc_to_dhdb	(dhdb_conc_t *c);
+
+/*
+Lock-free appending to an array from many threads
+- Producers add values or splice in whole batches built without locking
+- A single consumer drains the added values into the array in order
+- Only the consumer may use the array itself, between drains it holds a
+  consistent prefix of what has been added
+*/
+typedef struct dhdbConcArray dhdb_conc_array_t;
+
+dhdb_conc_array_t*	dhdb_conc_array_create	(dhdb_t *array);
+void			dhdb_conc_array_free	(dhdb_conc_array_t *a);	// Drains, the array stays with the caller
+
+void		dhdb_conc_add		(dhdb_conc_array_t *a, dhdb_t *v);	// Takes ownership of v
+void		dhdb_conc_add_batch	(dhdb_conc_array_t *a, dhdb_t *batch);	// Moves all elements, leaves batch empty
+int		dhdb_conc_drain		(dhdb_conc_array_t *a);	// Consumer only, returns the number drained
+
+#endif
@@ -46,7 +46,9 @@ _dump(dhdb_t *s, int level, int index)
 	bytes = sizeof(dhdb_t);
 	if (s->name)
 		bytes += strlen(s->name) + 1;
-	if (s->str)
+	if (s->flags & DHDB_FLAG_PACKED)
+		bytes += s->array_len * sizeof(double);
+	else if (s->str)
 		bytes += strlen(s->str) + 1;
 
 	for (int i = 0; i < level; i++)
@@ -62,8 +64,13 @@ _dump(dhdb_t *s, int level, int index)
 	if (s->name)
 		printf("%s ", s->name);
 
+	if (s->flags & DHDB_FLAG_SHARED) {
+		printf("[shared] ");
+		s = s->shared;
+	}
+
 	if (s->type == DHDB_VALUE_NUMBER)
-		printf("%lf ", s->num);
+		printf("%lf ", dhdb_num(s));
 	else if (s->type == DHDB_VALUE_STRING)
 		printf("\"%s\" ", s->str);
 	else if (s->type == DHDB_VALUE_BOOL)
@@ -71,7 +78,11 @@ _dump(dhdb_t *s, int level, int index)
 	else if (s->type == DHDB_VALUE_NULL)
 		printf("null ");
 
-	if (s->type == DHDB_VALUE_ARRAY || s->type == DHDB_VALUE_OBJECT)
+	if (s->flags & DHDB_FLAG_LAZY)
+		printf("[lazy, %d bytes] ", s->src_len);
+	else if (s->flags & DHDB_FLAG_PACKED)
+		printf("[packed, len=%d] ", s->array_len);
+	else if (s->type == DHDB_VALUE_ARRAY || s->type == DHDB_VALUE_OBJECT)
 		printf("[len=%d] ", s->array_len);
 
 	putchar('\n');
@@ -0,0 +1,210 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_extract.h"
+#include "dhdb_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+/*
+ * Steps up to the last * expand into rows. The names after it select
+ * one value of each row, and with DHDB_EXTRACT_SHAPES the position a
+ * name was found at is tried first in the next row.
+ */
+struct step
+{
+	char *name;		// NULL for *
+	dhdb_lookup_cache_t cache;
+};
+
+struct column
+{
+	struct step *steps;
+	int num_steps;
+	int rows;		// Steps that expand into rows
+	bool shapes;
+
+	uint8_t type;
+	void *out;
+	size_t cap;
+	size_t len;
+};
+
+static size_t _extract(dhdb_t *, const char *, uint8_t, void *, size_t, int);
+static void _rows(struct column *, dhdb_t *, int);
+static dhdb_t* _by(struct column *, dhdb_t *, struct step *);
+static void _put(struct column *, dhdb_t *);
+static void _put_packed(struct column *, const double *, int, int);
+
+size_t
+dhdb_extract_num(dhdb_t *s, const char *pattern, double *out, size_t cap)
+{
+	return _extract(s, pattern, DHDB_VALUE_NUMBER, out, cap, 0);
+}
+
+size_t
+dhdb_extract_str(dhdb_t *s, const char *pattern, const char **out, size_t cap)
+{
+	return _extract(s, pattern, DHDB_VALUE_STRING, out, cap, 0);
+}
+
+size_t
+dhdb_extract_bool(dhdb_t *s, const char *pattern, bool *out, size_t cap)
+{
+	return _extract(s, pattern, DHDB_VALUE_BOOL, out, cap, 0);
+}
+
+size_t
+dhdb_extract_num_opt(dhdb_t *s, const char *pattern, double *out, size_t cap,
+    int opts)
+{
+	return _extract(s, pattern, DHDB_VALUE_NUMBER, out, cap, opts);
+}
+
+size_t
+dhdb_extract_str_opt(dhdb_t *s, const char *pattern, const char **out,
+    size_t cap, int opts)
+{
+	return _extract(s, pattern, DHDB_VALUE_STRING, out, cap, opts);
+}
+
+size_t
+dhdb_extract_bool_opt(dhdb_t *s, const char *pattern, bool *out, size_t cap,
+    int opts)
+{
+	return _extract(s, pattern, DHDB_VALUE_BOOL, out, cap, opts);
+}
+
+static size_t
+_extract(dhdb_t *s, const char *pattern, uint8_t type, void *out, size_t cap,
+    int opts)
+{
+	struct column c;
+	char **names;
+	int i;
+
+	assert(s);
+	assert(pattern);
+
+	memset(&c, 0, sizeof(c));
+	c.type = type;
+	c.out = out;
+	c.cap = out ? cap : 0;
+	c.shapes = opts & DHDB_EXTRACT_SHAPES;
+
+	names = dhdb_internal_pattern(pattern, &c.num_steps);
+	c.steps = calloc(c.num_steps, sizeof(struct step));
+	assert(c.steps || c.num_steps == 0);
+	for (i = 0; i < c.num_steps; i++) {
+		c.steps[i].name = names[i];
+		if (names[i] == NULL)
+			c.rows = i + 1;
+	}
+	free(names);
+
+	_rows(&c, s, 0);
+
+	for (i = 0; i < c.num_steps; i++)
+		free(c.steps[i].name);
+	free(c.steps);
+	return c.len;
+}
+
+static void
+_rows(struct column *c, dhdb_t *s, int step)
+{
+	const double *nums;
+	dhdb_t *n;
+	int i, len;
+
+	if (step == c->rows) {
+		for (i = step; s && i < c->num_steps; i++)
+			s = _by(c, s, &c->steps[i]);
+		_put(c, s);
+		return;
+	}
+
+	if (c->steps[step].name) {
+		if ((n = dhdb_by(s, c->steps[step].name)))
+			_rows(c, n, step + 1);
+		return;
+	}
+	if ((nums = dhdb_internal_packed(s, &len))) {
+		_put_packed(c, nums, len, step + 1);
+		return;
+	}
+	for (n = dhdb_first(s); n; n = dhdb_next(n))
+		_rows(c, n, step + 1);
+}
+
+/*
+ * Packed numbers are read where they are, only a * that ends the
+ * pattern selects them and the names after one are never found.
+ */
+static void
+_put_packed(struct column *c, const double *nums, int len, int step)
+{
+	int i;
+
+	if (step < c->rows)
+		return;
+	for (i = 0; i < len; i++) {
+		if (step < c->num_steps || c->type != DHDB_VALUE_NUMBER)
+			_put(c, NULL);
+		else if (c->len++ < c->cap)
+			((double *) c->out)[c->len - 1] = nums[i];
+	}
+}
+
+static dhdb_t*
+_by(struct column *c, dhdb_t *s, struct step *st)
+{
+	if (!c->shapes)
+		return dhdb_by(s, st->name);
+	return dhdb_by_cached(s, st->name, &st->cache);
+}
+
+static void
+_put(struct column *c, dhdb_t *n)
+{
+	uint8_t type;
+
+	if (c->len >= c->cap) {
+		c->len++;
+		return;
+	}
+
+	type = n ? dhdb_type(n) : DHDB_VALUE_UNDEFINED;
+	switch (c->type) {
+	case DHDB_VALUE_NUMBER:
+		((double *) c->out)[c->len] =
+		    type == DHDB_VALUE_NUMBER ? dhdb_num(n) : NAN;
+		break;
+	case DHDB_VALUE_STRING:
+		((const char **) c->out)[c->len] =
+		    type == DHDB_VALUE_STRING ? dhdb_str(n) : NULL;
+		break;
+	case DHDB_VALUE_BOOL:
+		((bool *) c->out)[c->len] =
+		    type == DHDB_VALUE_BOOL && dhdb_bool(n);
+		break;
+	}
+	c->len++;
+}
@@ -0,0 +1,49 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_EXTRACT_H__
+#define __DHDB_EXTRACT_H__
+
+#include "dhdb.h"
+
+#include <stddef.h>
+
+#define DHDB_EXTRACT_SHAPES	(1 << 0) // Look names up with dhdb_by_cached, one cache for each
+
+/*
+Copies leaf values matched by a pattern into a C array, one per row
+- The pattern is made of names and * separated with the separator of
+  dhdb_path, for example items.*.price
+- Every match of the pattern up to its last * is a row, the names after
+  it are looked up in each row and missing values are NaN, NULL or false
+- Non-numbers are NaN in numbers, non-strings NULL in strings and
+  anything but true false in bools
+- Strings point into the tree and are valid until it is changed
+- At most cap values are written, the number of rows is returned
+*/
+size_t	dhdb_extract_num	(dhdb_t *s, const char *pattern, double *out, size_t cap);
+size_t	dhdb_extract_str	(dhdb_t *s, const char *pattern, const char **out, size_t cap);
+size_t	dhdb_extract_bool	(dhdb_t *s, const char *pattern, bool *out, size_t cap);
+
+size_t	dhdb_extract_num_opt	(dhdb_t *s, const char *pattern, double *out, size_t cap,
+	    int opts);
+size_t	dhdb_extract_str_opt	(dhdb_t *s, const char *pattern, const char **out,
+	    size_t cap, int opts);
+size_t	dhdb_extract_bool_opt	(dhdb_t *s, const char *pattern, bool *out, size_t cap,
+	    int opts);
+
+#endif
@@ -16,6 +16,7 @@
  */
 
 #include "dhdb_ini.h"
+#include "dhdb_private.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -27,8 +28,11 @@
 
 static void _parse_section(dhdb_t *, const char *, dhdb_t **);
 static void _parse_line(dhdb_t *, const char *, dhdb_t **);
-static void _print_value(dhdb_t *, char *);
-static const char* _serialize(dhdb_t *, char *, int);
+static void _print_value(dhdb_t *, struct dhdbOut *);
+static void _serialize(dhdb_t *, struct dhdbOut *, int);
+
+/* Buffer of the calling thread for dhdb_to_ini, reused on its next call */
+static __thread struct dhdbOut _out;
 
 dhdb_t*
 dhdb_create_from_ini(const char *str)
@@ -59,12 +63,23 @@ dhdb_create_from_ini(const char *str)
 const char*
 dhdb_to_ini(dhdb_t *s)
 {
-	static char out[8192];
+	assert(s);
+	_out.len = 0;
+	dhdb_internal_out_str(&_out, "");
+	_serialize(s, &_out, 0);
+	return _out.buf;
+}
+
+int
+dhdb_to_ini_r(dhdb_t *s, char *buf, int size)
+{
+	struct dhdbOut o = { buf, 0, size, true };
 
 	assert(s);
-	out[0] = 0;
-	_serialize(s, out, 0);
-	return out;
+	if (size > 0)
+		buf[0] = 0;
+	_serialize(s, &o, 0);
+	return o.len;
 }
 
 static void
@@ -114,55 +129,42 @@ _parse_line(dhdb_t *s, const char *line, dhdb_t **current_section)
 }
 
 static void
-_print_value(dhdb_t *s, char *out)
+_print_value(dhdb_t *s, struct dhdbOut *o)
 {
-	char val[8192];
-	val[0] = 0;
-
 	if (dhdb_type(s) == DHDB_VALUE_NUMBER) {
 		if ((int) dhdb_num(s) == dhdb_num(s))
-			snprintf(val, sizeof(val), "%ld",
+			dhdb_internal_out_printf(o, "%ld",
 			    (long int) dhdb_num(s));
 		else
-			snprintf(val, sizeof(val), "%.8f", dhdb_num(s));
+			dhdb_internal_out_printf(o, "%.8f", dhdb_num(s));
 	}
 	else if (dhdb_type(s) == DHDB_VALUE_STRING)
-		snprintf(val, sizeof(val), "%s", dhdb_str(s));
+		dhdb_internal_out_str(o, dhdb_str(s));
 	else if (dhdb_type(s) == DHDB_VALUE_BOOL)
-		snprintf(val, sizeof(val), "%s",
-		    dhdb_num(s) ? "true" : "false");
+		dhdb_internal_out_str(o, dhdb_num(s) ? "true" : "false");
 	else if (dhdb_type(s) == DHDB_VALUE_NULL)
-		snprintf(val, sizeof(val), "null");
-
-	strcat(out, val);
+		dhdb_internal_out_str(o, "null");
 }
 
-static const char*
-_serialize(dhdb_t *s, char *out, int level)
+static void
+_serialize(dhdb_t *s, struct dhdbOut *o, int level)
 {
-	char val[8192];
 	const char *name;
 	dhdb_t *n;
 
-	val[0] = 0;
 	name = dhdb_name(s);
 
-	if (level == 1 && name && dhdb_type(s) == DHDB_VALUE_OBJECT) {
-		strcat(out, "[");
-		strcat(out, dhdb_name(s));
-		strcat(out, "]\n");
-	} else if (name && dhdb_type(s) != DHDB_VALUE_OBJECT) {
-		strcat(out, dhdb_name(s));
-		strcat(out, "=");
-		_print_value(s, out);
-		strcat(out, "\n");
+	if (level == 1 && name && dhdb_type(s) == DHDB_VALUE_OBJECT)
+		dhdb_internal_out_printf(o, "[%s]\n", name);
+	else if (name && dhdb_type(s) != DHDB_VALUE_OBJECT) {
+		dhdb_internal_out_printf(o, "%s=", name);
+		_print_value(s, o);
+		dhdb_internal_out_str(o, "\n");
 	}
 
-	n = dhdb_first(s);
+	n = dhdb_first(dhdb_internal_resolve(s));
 	while (n) {
-		_serialize(n, out, level + 1);
+		_serialize(n, o, level + 1);
 		n = dhdb_next(n);
 	}
-
-	return out;
 }
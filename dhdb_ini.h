@@ -21,6 +21,7 @@
 #include "dhdb.h"
 
 dhdb_t*		dhdb_create_from_ini(const char *str);
-const char*	dhdb_to_ini(dhdb_t *s);
+const char*	dhdb_to_ini(dhdb_t *s);	// Buffer of the calling thread, valid until its next call
+int		dhdb_to_ini_r(dhdb_t *s, char *buf, int size);	// Like snprintf
 
 #endif
@@ -17,6 +17,7 @@
 
 #include "dhdb_json.h"
 #include "dhdb_dump.h"
+#include "dhdb_private.h"
 
 #ifndef __USE_POSIX
 #define __USE_POSIX
@@ -44,12 +45,306 @@ static const char *jsonValueTxt[] = {
 
 static const char *_parse_error[] = {
 	"Successful", "Expected ':'", "Unknown type",
-	"Expected digit or '.'", "Closing quote not found", "Expected string"
+	"Expected digit or '.'", "Closing quote not found", "Expected string",
+	"Closing bracket not found"
 };
 
+#define DHDB_JSON_BORROW	(1 << 7) // Set by dhdb_create_from_json_insitu
+
+#define SHAPE_DEPTH		16
+#define SHAPE_SIBLINGS		8	// Looked at for a shape not in the table
+
+/* Shapes found during one parse, the table holds a reference to each */
+struct shape_table
+{
+	struct dhdbShape **slots;
+	int mask;
+	int len;
+	struct dhdbShape *last[SHAPE_DEPTH];	// Latest shape by nesting depth
+};
+
+struct parse_ctx
+{
+	int opts;
+	int err_code;
+	int err_col;
+	struct shape_table shapes;
+};
+
+static int _parse(struct parse_ctx *, const char *, int, dhdb_t *, uint8_t,
+    int);
+static void _serialize(dhdb_t *, struct dhdbOut *, int, bool);
+
+/*
+ * Records the source span of a container without parsing it. Returns
+ * index of the closing bracket like _parse does, or 0 on error.
+ */
+static int
+_defer(struct parse_ctx *ctx, const char *str, int sz, dhdb_t *json, int col)
+{
+	int i, depth = 0;
+	bool in_str = false;
+
+	for (i = 0; i < sz; i++) {
+		if (in_str) {
+			if (str[i] == '\"')
+				in_str = false;
+			continue;
+		}
+		if (str[i] == '\"')
+			in_str = true;
+		else if (str[i] == '[' || str[i] == '{')
+			depth++;
+		else if ((str[i] == ']' || str[i] == '}') && --depth == 0)
+			break;
+	}
+	if (i == sz) {
+		ctx->err_code = 6;
+		ctx->err_col = col;
+		return 0;
+	}
+
+	json->type = (str[0] == '{') ? DHDB_VALUE_OBJECT : DHDB_VALUE_ARRAY;
+	json->flags |= DHDB_FLAG_LAZY;
+	json->lazy_opts = ctx->opts;
+	json->src = str;
+	json->src_len = i + 1;
+	return i;
+}
+
+/* Parses a child value, deferring containers in lazy mode */
 static int
-_parse(const char *str, dhdb_t *json, uint8_t type, int col,
-    int *err_code, int *err_col)
+_parse_child(struct parse_ctx *ctx, const char *str, int sz, dhdb_t *json,
+    int col)
+{
+	int i;
+
+	if (ctx->opts & DHDB_JSON_LAZY) {
+		for (i = 0; i < sz && isspace(str[i]); i++)
+			;
+		if (i < sz && (str[i] == '[' || str[i] == '{'))
+			return i + _defer(ctx, &str[i], sz - i, json, col + i);
+	}
+
+	return _parse(ctx, str, sz, json, DHDB_VALUE_UNDEFINED, col);
+}
+
+/* Whether the len bytes of str are a number in the JSON grammar */
+static bool
+_is_json_num(const char *str, int len)
+{
+	int i = 0, digits;
+
+	if (i < len && str[i] == '-')
+		i++;
+	if (i < len && str[i] == '0')
+		i++;
+	else {
+		for (digits = 0; i < len && isdigit(str[i]); i++)
+			digits++;
+		if (digits == 0)
+			return false;
+	}
+	if (i < len && str[i] == '.') {
+		for (i++, digits = 0; i < len && isdigit(str[i]); i++)
+			digits++;
+		if (digits == 0)
+			return false;
+	}
+	if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+		i++;
+		if (i < len && (str[i] == '+' || str[i] == '-'))
+			i++;
+		for (digits = 0; i < len && isdigit(str[i]); i++)
+			digits++;
+		if (digits == 0)
+			return false;
+	}
+	return i == len;
+}
+
+/*
+ * Raw text is kept only when it is a JSON number, since it is written
+ * back as it is. Other text gets what strtod makes of it either way.
+ */
+static void
+_set_num(struct parse_ctx *ctx, dhdb_t *json, const char *str, int len)
+{
+	if (ctx->opts & DHDB_JSON_RAW_NUMBERS && _is_json_num(str, len)) {
+		dhdb_set_num(json, 0);
+		json->flags |= DHDB_FLAG_RAW_NUM | DHDB_FLAG_NUM_PENDING;
+		json->src = str;
+		json->src_len = len;
+		return;
+	}
+
+	/* Number text is validated and followed by a non-digit */
+	dhdb_set_num(json, strtod(str, NULL));
+}
+
+/*
+ * Shape the members of an object starting at json are guessed to have,
+ * that of its previous sibling or of the latest object at its depth.
+ */
+static struct dhdbShape*
+_guess_shape(struct parse_ctx *ctx, dhdb_t *json, int *depth)
+{
+	dhdb_t *n;
+
+	*depth = 0;
+	for (n = json->parent; n; n = n->parent)
+		(*depth)++;
+	if (json->parent && json->parent->type == DHDB_VALUE_ARRAY &&
+	    json->prev && json->prev->shape)
+		return json->prev->shape;
+	if (*depth < SHAPE_DEPTH)
+		return ctx->shapes.last[*depth];
+	return NULL;
+}
+
+/* The guess was wrong, members parsed so far get names of their own */
+static void
+_unguess(dhdb_t *json)
+{
+	dhdb_t *n;
+
+	for (n = json->first_child; n; n = n->next) {
+		n->name = strdup(n->name);
+		n->flags &= ~DHDB_FLAG_BORROWED_NAME;
+	}
+}
+
+static void
+_add_shape(struct shape_table *t, struct dhdbShape *sh)
+{
+	struct dhdbShape **old;
+	int i, j, mask;
+
+	if ((t->len + 1) * 2 > t->mask) {
+		old = t->slots;
+		mask = t->mask;
+		t->mask = mask ? mask * 2 + 1 : 63;
+		t->slots = calloc(t->mask + 1, sizeof(struct dhdbShape *));
+		assert(t->slots);
+		for (i = 0; old && i <= mask; i++) {
+			if (old[i] == NULL)
+				continue;
+			for (j = old[i]->hash & t->mask; t->slots[j];
+			    j = (j + 1) & t->mask)
+				;
+			t->slots[j] = old[i];
+		}
+		free(old);
+	}
+	for (j = sh->hash & t->mask; t->slots[j]; j = (j + 1) & t->mask)
+		;
+	t->slots[j] = sh;
+	t->len++;
+}
+
+/*
+ * Gives a parsed object the shape of earlier objects with the same keys,
+ * or a new one. A guess still left matched all the keys so far.
+ */
+static void
+_set_shape(struct parse_ctx *ctx, dhdb_t *json, struct dhdbShape *guess,
+    int depth)
+{
+	struct shape_table *t = &ctx->shapes;
+	struct dhdbShape *sh;
+	uint32_t hash;
+	dhdb_t *n;
+	int j;
+
+	if (json->array_len == 0)
+		return;
+	if (guess && guess->len == json->array_len)
+		sh = guess;
+	else {
+		if (guess)
+			_unguess(json);
+		sh = NULL;
+		hash = dhdb_internal_shape_hash(json);
+		for (j = hash & t->mask; t->slots && t->slots[j];
+		    j = (j + 1) & t->mask) {
+			if (t->slots[j]->hash == hash &&
+			    dhdb_internal_shape_match(t->slots[j], json)) {
+				sh = t->slots[j];
+				break;
+			}
+		}
+		/* Lazy containers get parsed with tables of their own */
+		for (n = json->prev, j = 0; sh == NULL && n && j < SHAPE_SIBLINGS;
+		    n = n->prev, j++)
+			if (n->shape && n->shape->hash == hash &&
+			    dhdb_internal_shape_match(n->shape, json))
+				sh = n->shape;
+		if (sh == NULL) {
+			sh = dhdb_internal_shape_create(json);
+			_add_shape(t, sh);
+		}
+	}
+	dhdb_internal_set_shape(json, sh);
+	if (depth < SHAPE_DEPTH)
+		t->last[depth] = sh;
+}
+
+static void
+_free_shapes(struct parse_ctx *ctx)
+{
+	struct shape_table *t = &ctx->shapes;
+	int i;
+
+	for (i = 0; t->slots && i <= t->mask; i++)
+		if (t->slots[i])
+			dhdb_internal_shape_release(t->slots[i]);
+	free(t->slots);
+}
+
+static bool
+_is_end(char c)
+{
+	return isspace(c) || c == ',' || c == ']' || c == '}';
+}
+
+/*
+ * Adds a number element to an array that is still packed or empty.
+ * Returns index of the last byte consumed like _parse, or -1 when the
+ * element is something else and needs a node of its own.
+ */
+static int
+_parse_packed(const char *str, int sz, dhdb_t *json)
+{
+	double num;
+	char *end;
+	int i, j;
+
+	if (json->array_len > 0 && !(json->flags & DHDB_FLAG_PACKED))
+		return -1;
+	for (i = 0; i < sz && isspace(str[i]); i++)
+		;
+	if (i == sz || (!isdigit(str[i]) && str[i] != '-'))
+		return -1;
+	for (j = i + 1; j < sz && (isdigit(str[j]) || str[j] == '.' ||
+	    str[j] == 'e' || str[j] == 'E' || str[j] == '+' || str[j] == '-');
+	    j++)
+		;
+	if (j == sz || !_is_end(str[j]))
+		return -1;
+
+	/* Anything strtod would read differently gets the error of _parse */
+	num = strtod(&str[i], &end);
+	if (end != &str[j])
+		return -1;
+	dhdb_add_num_array(json, &num, 1);
+	if (str[j] == ']' || str[j] == '}')
+		return j - 1;
+	return j;
+}
+
+static int
+_parse(struct parse_ctx *ctx, const char *str, int sz, dhdb_t *json,
+    uint8_t type, int col)
 {
 	int i, add;
 	int valBegin = 0;
@@ -57,9 +352,15 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 	int haveObjectName = 0;
 	dhdb_t *currentObject = 0, *val;
 	bool bool_val = false;
-	int sz = strlen(str);
 	char *field;
+	struct dhdbShape *guess = NULL;
+	int depth = 0, len;
 	
+	/*
+	 * Returns index of the last byte consumed. Literals and numbers
+	 * consume a trailing space or comma, but leave a closing bracket
+	 * to the container they are in.
+	 */
 	for (i = 0; i < sz; i++) {
 		if (type == DHDB_VALUE_UNDEFINED && isspace(str[i]))
 			continue;
@@ -79,10 +380,16 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 			}
 			else if (str[i] == '[') {
 				type = DHDB_VALUE_ARRAY;
+				if (json->type == DHDB_VALUE_UNDEFINED)
+					json->type = type;
 				continue;
 			}
 			else if (str[i] == '{') {
 				type = DHDB_VALUE_OBJECT;
+				if (json->type == DHDB_VALUE_UNDEFINED)
+					json->type = type;
+				if (ctx->opts & DHDB_JSON_SHAPES)
+					guess = _guess_shape(ctx, json, &depth);
 				continue;
 			}
 			else if (!strncmp(&str[i], "false", 5)) {
@@ -100,8 +407,8 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 				i += 4 - 1;
 			}
 			else {
-				*err_code = 2;
-				*err_col = col + i;
+				ctx->err_code = 2;
+				ctx->err_col = col + i;
 				type = DHDB_VALUE_UNDEFINED;
 				return 0;
 			}
@@ -111,41 +418,48 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 		 * for each type
 		 */
 		if (type == DHDB_VALUE_STRING) {
-			if (str[i] == '\"') {
+			if (str[i] == '\"' && (ctx->opts & DHDB_JSON_BORROW)) {
+				((char *) str)[i] = 0;
+				dhdb_internal_set_str_borrowed(json,
+				    i - valBegin, &str[valBegin]);
+				return i;
+			} else if (str[i] == '\"') {
 				dhdb_set_str_len(json, i - valBegin,
 				    &str[valBegin]);
 				return i;
 			}
 		}
 		if (type == DHDB_VALUE_BOOL || type == DHDB_VALUE_NULL) {
-			if (isspace(str[i]) || i == sz - 1 || str[i] == ',') {
+			if (_is_end(str[i]) || i == sz - 1) {
 				if (type == DHDB_VALUE_NULL)
 					dhdb_set_null(json);
 				else if (type == DHDB_VALUE_BOOL)
 					dhdb_set_bool(json, bool_val);
+				if (str[i] == ']' || str[i] == '}')
+					return i - 1;
 				return i;
 			}
 		}
 		if (type == DHDB_VALUE_NUMBER) {
-			if (isspace(str[i]) || i == sz - 1 || str[i] == ',') {
-				char *s;
-				if (i != sz - 1)
-					s = strndup(&str[valBegin],
-					    i - valBegin);
-				else
-					s = strdup(&str[valBegin]);
-				dhdb_set_num(json, atof(s));
-				free(s);
+			if (_is_end(str[i])) {
+				_set_num(ctx, json, &str[valBegin], i - valBegin);
+				if (str[i] == ']' || str[i] == '}')
+					return i - 1;
 				return i;
 			}
 			if (!isdigit(str[i]) && str[i] != '.' &&
 			    str[i] != 'e' && str[i] != 'E' &&
 			    str[i] != '+' && str[i] != '-') {
 				type = DHDB_VALUE_UNDEFINED;
-				*err_code = 3;
-				*err_col = col + i;
+				ctx->err_code = 3;
+				ctx->err_col = col + i;
 				return 0;
 			}
+			if (i == sz - 1) {
+				_set_num(ctx, json, &str[valBegin],
+				    i - valBegin + 1);
+				return i;
+			}
 		}
 		if (type == DHDB_VALUE_ARRAY) {
 			if (str[i] == ' ' || str[i] == '\t')
@@ -155,12 +469,18 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 			if (str[i] == ',')
 				continue;
 
+			if ((ctx->opts & (DHDB_JSON_PACKED |
+			    DHDB_JSON_RAW_NUMBERS)) == DHDB_JSON_PACKED &&
+			    (add = _parse_packed(&str[i], sz - i, json)) >= 0) {
+				i += add;
+				continue;
+			}
+
 			val = dhdb_create(NULL);
 			dhdb_add(json, val);
 
-			add = _parse(&str[i], val, DHDB_VALUE_UNDEFINED,
-			    col + i, err_code, err_col);
-			if (add == 0)
+			add = _parse_child(ctx, &str[i], sz - i, val, col + i);
+			if (ctx->err_code)
 				break;
 			i += add;
 		}
@@ -173,7 +493,33 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 				haveMemberBegin = 1;
 				continue;
 			}
-			if (str[i] == '\"') {
+			/* Names from the guessed shape need no copy */
+			if (str[i] == '\"' && guess) {
+				len = i - valBegin;
+				field = json->array_len < guess->len ?
+				    guess->keys[json->array_len] : NULL;
+				if (field && !strncmp(field, &str[valBegin], len) &&
+				    field[len] == 0) {
+					haveObjectName = 1;
+					val = dhdb_create(NULL);
+					dhdb_internal_set_obj_borrowed(json, field,
+					    val);
+					currentObject = val;
+					continue;
+				}
+				_unguess(json);
+				guess = NULL;
+			}
+			if (str[i] == '\"' && (ctx->opts & DHDB_JSON_BORROW)) {
+				((char *) str)[i] = 0;
+				haveObjectName = 1;
+
+				val = dhdb_create(NULL);
+				dhdb_internal_set_obj_borrowed(json,
+				    &str[valBegin], val);
+				currentObject = val;
+			}
+			else if (str[i] == '\"') {
 				field = strndup(&str[valBegin],
 				    i - valBegin);
 				haveObjectName = 1;
@@ -183,15 +529,18 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 				currentObject = val;
 				free(field);
 			}
-			else if (!haveMemberBegin && str[i] == '}')
+			else if (!haveMemberBegin && str[i] == '}') {
+				if (ctx->opts & DHDB_JSON_SHAPES)
+					_set_shape(ctx, json, guess, depth);
 				return i;
+			}
 			else if (haveMemberBegin && i == sz - 1) {
-				*err_code = 4;
-				*err_col = col + (valBegin - 1);
+				ctx->err_code = 4;
+				ctx->err_col = col + (valBegin - 1);
 				return 0;
 			} else if (!haveMemberBegin && str[i] != ',') {
-				*err_code = 5;
-				*err_col = col + i;
+				ctx->err_code = 5;
+				ctx->err_col = col + i;
 				return 0;
 			}
 			
@@ -203,10 +552,9 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 			if (str[i] == ':') {
 				i++;
 
-				add = _parse(&str[i], currentObject,
-				    DHDB_VALUE_UNDEFINED, col + i, err_code,
-				    err_col);
-				if (add == 0)
+				add = _parse_child(ctx, &str[i], sz - i,
+				    currentObject, col + i);
+				if (ctx->err_code)
 					break;
 				i += add;
 
@@ -214,28 +562,101 @@ _parse(const char *str, dhdb_t *json, uint8_t type, int col,
 				haveObjectName = 0;
 				haveMemberBegin = 0;
 			} else {
-				*err_code = 1;
-				*err_col = col + i;
+				ctx->err_code = 1;
+				ctx->err_col = col + i;
 				return 0;
 				//printf("ERROR, EXPECTED ':' GOT SOMETHING ELSE!\n");
 			}
 		}
 	}
+
+	if (ctx->err_code == 0 && type == DHDB_VALUE_STRING) {
+		ctx->err_code = 4;
+		ctx->err_col = col + valBegin - 1;
+	} else if (ctx->err_code == 0 && (type == DHDB_VALUE_ARRAY ||
+	    type == DHDB_VALUE_OBJECT)) {
+		ctx->err_code = 6;
+		ctx->err_col = col;
+	}
 	return 0;
 }
 
+/*
+ * A container that turns out to be invalid is left empty, like the
+ * eager parser leaves no tree, and the error is kept on it.
+ */
+static void
+_materialize(dhdb_t *s)
+{
+	struct parse_ctx ctx = { .opts = s->lazy_opts };
+
+	_parse(&ctx, s->src, s->src_len, s, DHDB_VALUE_UNDEFINED, 0);
+	_free_shapes(&ctx);
+	if (ctx.err_code == 0) {
+		s->src = NULL;
+		s->src_len = 0;
+		return;
+	}
+
+	fprintf(stderr, "%s: Error '%s' at byte %d of lazy %s\n",
+	    __FUNCTION__, _parse_error[ctx.err_code], ctx.err_col,
+	    s->name ? s->name : "value");
+	if (s->type == DHDB_VALUE_OBJECT)
+		dhdb_set_object(s);
+	else
+		dhdb_set_array(s);
+	s->flags |= DHDB_FLAG_LAZY_ERROR;
+	s->lazy_opts = ctx.err_code;
+	s->src += ctx.err_col;
+	s->src_len = 0;
+}
+
+const char*
+dhdb_json_lazy_error(dhdb_t *s, const char **at)
+{
+	assert(s);
+
+	(void) dhdb_len(s);
+	s = dhdb_internal_resolve(s);
+	if (!(s->flags & DHDB_FLAG_LAZY_ERROR))
+		return NULL;
+	if (at)
+		*at = s->src;
+	return _parse_error[s->lazy_opts];
+}
+
+/* Threads parsing in parallel all store the same hook */
+static void
+_setup(int opts)
+{
+	if (opts & DHDB_JSON_LAZY)
+		__atomic_store_n(&dhdb_internal_materialize, _materialize,
+		    __ATOMIC_RELAXED);
+}
+
 dhdb_t*
 dhdb_create_from_json(const char *str)
+{
+	return dhdb_create_from_json_opt(str, 0);
+}
+
+dhdb_t*
+dhdb_create_from_json_opt(const char *str, int opts)
 {
 	dhdb_t *s;
-	int err_code = 0, err_col = 0;
+	struct parse_ctx ctx = { .opts = opts };
+	int err_code, err_col;
 	int beginI, endI;
 	char *err_line;
 
 	s = dhdb_create(NULL);
 	assert(s);
 
-	_parse(str, s, DHDB_VALUE_UNDEFINED, 0, &err_code, &err_col);
+	_setup(opts);
+	_parse(&ctx, str, strlen(str), s, DHDB_VALUE_UNDEFINED, 0);
+	_free_shapes(&ctx);
+	err_code = ctx.err_code;
+	err_col = ctx.err_col;
 	if (err_code) {
 		dhdb_dump(s);
 		fprintf(stderr, "%s: Error '%s' at byte %d of %zu:\n",
@@ -260,6 +681,44 @@ dhdb_create_from_json(const char *str)
 	return s;
 }
 
+/*
+ * Parses the values in the first len bytes of str, separated by commas
+ * or white space, and adds them to the array s. Used for parsing parts
+ * of a large document in parallel. Returns NULL or the error, with the
+ * byte it was found at in err_col.
+ */
+const char*
+dhdb_internal_json_parse_values(dhdb_t *s, const char *str, int len,
+    int opts, int *err_col)
+{
+	struct parse_ctx ctx = { .opts = opts };
+	dhdb_t *val;
+	int i;
+
+	_setup(opts);
+	for (i = 0; i < len; i++) {
+		if (isspace(str[i]) || str[i] == ',')
+			continue;
+
+		val = dhdb_create(NULL);
+		dhdb_add(s, val);
+		i += _parse_child(&ctx, &str[i], len - i, val, i);
+		if (ctx.err_code) {
+			_free_shapes(&ctx);
+			*err_col = ctx.err_col;
+			return _parse_error[ctx.err_code];
+		}
+	}
+	_free_shapes(&ctx);
+	return NULL;
+}
+
+dhdb_t*
+dhdb_create_from_json_insitu(char *buf, int opts)
+{
+	return dhdb_create_from_json_opt(buf, opts | DHDB_JSON_BORROW);
+}
+
 dhdb_t*
 dhdb_create_from_json_file(const char *fmt, ...)
 {
@@ -289,7 +748,7 @@ dhdb_create_from_json_file(const char *fmt, ...)
 
 	buf = malloc(statbuf.st_size + 1);
 	if (buf == 0) {
-		fprintf(stderr, "Couldn't malloc %lld bytes space for %s\n", statbuf.st_size, file);
+		fprintf(stderr, "Couldn't malloc %lld bytes space for %s\n", (long long) statbuf.st_size, file);
 		return 0;
 	}
 	int n = fread(buf, sizeof(char), statbuf.st_size, fp);
@@ -307,100 +766,241 @@ dhdb_create_from_json_file(const char *fmt, ...)
 	return s;
 }
 
-static const char*
-_serialize(dhdb_t *json, char *out, int level, bool pretty)
+struct dhdbNdjson
 {
-	char val[8192];
-	const char *name;
-	dhdb_t *n;
+	FILE *fp;
+	char *line;
+	size_t cap;
+	int line_num;
+	bool error;
+};
 
-	val[0] = 0;
-	name = dhdb_name(json);
-	if (name) {
-		strcat(out, "\"");
-		strcat(out, name);
-		strcat(out, "\" : ");
-	}
+dhdb_ndjson_t*
+dhdb_ndjson_create(FILE *fp)
+{
+	dhdb_ndjson_t *it;
+
+	it = calloc(1, sizeof(dhdb_ndjson_t));
+	assert(it);
+	it->fp = fp;
+	return it;
+}
+
+void
+dhdb_ndjson_free(dhdb_ndjson_t *it)
+{
+	if (it == NULL)
+		return;
+	free(it->line);
+	free(it);
+}
 
-	if (dhdb_type(json) == DHDB_VALUE_NUMBER) {
-		if ((int) dhdb_num(json) == dhdb_num(json))
-			snprintf(val, sizeof(val), "%ld",
-			    (long int) dhdb_num(json));
-		else
-			snprintf(val, sizeof(val), "%.8f", dhdb_num(json));
+/* Blank lines are skipped, the line buffer is reused for every record */
+dhdb_t*
+dhdb_ndjson_next(dhdb_ndjson_t *it)
+{
+	dhdb_t *s;
+	char *p;
+
+	if (it->error)
+		return NULL;
+	while (getline(&it->line, &it->cap, it->fp) != -1) {
+		it->line_num++;
+		for (p = it->line; isspace(*p); p++)
+			;
+		if (*p == 0)
+			continue;
+
+		if ((s = dhdb_create_from_json(p)) == NULL) {
+			fprintf(stderr, "%s: Error on line %d\n", __FUNCTION__,
+			    it->line_num);
+			it->error = true;
+		}
+		return s;
 	}
+	return NULL;
+}
+
+bool
+dhdb_ndjson_error(dhdb_ndjson_t *it)
+{
+	return it->error;
+}
+
+static void
+_indent(struct dhdbOut *o, int level)
+{
+	for (int i = 0; i < level; i++)
+		dhdb_internal_out_add(o, "  ", 2);
+}
+
+static void
+_num(struct dhdbOut *o, double num)
+{
+	if ((int) num == num)
+		dhdb_internal_out_printf(o, "%ld", (long int) num);
+	else
+		dhdb_internal_out_printf(o, "%.8f", num);
+}
+
+static void
+_open(dhdb_t *json, struct dhdbOut *o, int level, bool pretty)
+{
+	const char *name, *text;
+	int len;
+
+	name = dhdb_name(json);
+	if (name)
+		dhdb_internal_out_printf(o, "\"%s\" : ", name);
+
+	if ((text = dhdb_num_text(json, &len)))
+		dhdb_internal_out_add(o, text, len);
+	else if (dhdb_type(json) == DHDB_VALUE_NUMBER)
+		_num(o, dhdb_num(json));
 	else if (dhdb_type(json) == DHDB_VALUE_STRING)
-		snprintf(val, sizeof(val), "\"%s\"", dhdb_str(json));
+		dhdb_internal_out_printf(o, "\"%s\"", dhdb_str(json));
 	else if (dhdb_type(json) == DHDB_VALUE_BOOL)
-		snprintf(val, sizeof(val), "%s",
-		    dhdb_num(json) ? "true" : "false");
+		dhdb_internal_out_str(o, dhdb_num(json) ? "true" : "false");
 	else if (dhdb_type(json) == DHDB_VALUE_NULL)
-		snprintf(val, sizeof(val), "null");
-
-	strcat(out, val);
+		dhdb_internal_out_str(o, "null");
 
-	n = dhdb_first(json);
-
-	if (name && n && pretty) {
-		strcat(out, "\n");
-		if (pretty)
-			for (int i = 0; i < level; i++)
-				strcat(out, "  ");
+	/* Don't unshare copy-on-write proxies or unpack arrays for reading */
+	if (name && pretty && dhdb_is_container(json) && dhdb_len(json) > 0) {
+		dhdb_internal_out_str(o, "\n");
+		_indent(o, level);
 	}
 	if (dhdb_type(json) == DHDB_VALUE_ARRAY)
-		strcat(out, "[ ");
+		dhdb_internal_out_str(o, "[ ");
 	else if (dhdb_type(json) == DHDB_VALUE_OBJECT)
-		strcat(out, "{ ");
-
-	while (n) {
-		_serialize(n, out, level + 1, pretty);
-		if (dhdb_next(n)) {
-			strcat(out, ",");
-			if (pretty) {
-				strcat(out, "\n");
-				for (int i = 0; i < level + 1; i++)
-					strcat(out, "  ");
-			}
+		dhdb_internal_out_str(o, "{ ");
+}
+
+/* Separator after a child of a container at level */
+static void
+_separator(struct dhdbOut *o, int level, bool pretty, bool last)
+{
+	if (!last) {
+		dhdb_internal_out_str(o, ",");
+		if (pretty) {
+			dhdb_internal_out_str(o, "\n");
+			_indent(o, level + 1);
 		}
-		else
-			strcat(out, " ");
-	
-		n = dhdb_next(n);
 	}
+	else
+		dhdb_internal_out_str(o, " ");
+}
 
+/* Child n of a container at level, followed by its separator */
+static void
+_member(dhdb_t *n, struct dhdbOut *o, int level, bool pretty)
+{
+	_serialize(n, o, level + 1, pretty);
+	_separator(o, level, pretty, dhdb_next(n) == NULL);
+}
+
+static void
+_close(dhdb_t *json, struct dhdbOut *o, int level, bool pretty)
+{
 	if (pretty && (dhdb_type(json) == DHDB_VALUE_ARRAY ||
 	    dhdb_type(json) == DHDB_VALUE_OBJECT)) {
-		strcat(out, "\n");
-		for (int i = 0; i < level; i++)
-			strcat(out, "  ");
+		dhdb_internal_out_str(o, "\n");
+		_indent(o, level);
 	}
 	if (dhdb_type(json) == DHDB_VALUE_ARRAY)
-		strcat(out, "]");
+		dhdb_internal_out_str(o, "]");
 	else if (dhdb_type(json) == DHDB_VALUE_OBJECT)
-		strcat(out, "}");
+		dhdb_internal_out_str(o, "}");
+}
 
-	return out;
+static void
+_serialize(dhdb_t *json, struct dhdbOut *o, int level, bool pretty)
+{
+	const double *nums;
+	dhdb_t *n;
+	int i, len;
+
+	_open(json, o, level, pretty);
+	if ((nums = dhdb_internal_packed(json, &len))) {
+		for (i = 0; i < len; i++) {
+			_num(o, nums[i]);
+			_separator(o, level, pretty, i == len - 1);
+		}
+	} else {
+		for (n = dhdb_first(dhdb_internal_resolve(json)); n;
+		    n = dhdb_next(n))
+			_member(n, o, level, pretty);
+	}
+	_close(json, o, level, pretty);
+}
+
+void
+dhdb_internal_json_open(struct dhdbOut *o, dhdb_t *s, bool pretty)
+{
+	_open(s, o, 0, pretty);
+}
+
+void
+dhdb_internal_json_member(struct dhdbOut *o, dhdb_t *n, bool pretty)
+{
+	_member(n, o, 0, pretty);
+}
+
+void
+dhdb_internal_json_close(struct dhdbOut *o, dhdb_t *s, bool pretty)
+{
+	_close(s, o, 0, pretty);
+	if (!pretty)
+		dhdb_internal_out_str(o, "\n");
 }
 
+/*
+ * The returned string is in a buffer of the calling thread, reused on
+ * its next call. Threads that come and go should rather use the _r
+ * variants, which don't keep a buffer around.
+ */
+static __thread struct dhdbOut _out;
+
 const char*
 dhdb_to_json(dhdb_t *s)
 {
-	static char out[64000];
-
 	assert(s);
-	out[0] = 0;
-	_serialize(s, out, 0, false);
-	strcat(out, "\n");
-	return out;	
+	_out.len = 0;
+	_serialize(s, &_out, 0, false);
+	dhdb_internal_out_str(&_out, "\n");
+	return _out.buf;
 }
 
 const char*
 dhdb_to_json_pretty(dhdb_t *s)
 {
-	static char out[64000];
+	assert(s);
+	_out.len = 0;
+	dhdb_internal_out_str(&_out, "");
+	_serialize(s, &_out, 0, true);
+	return _out.buf;
+}
+
+int
+dhdb_to_json_r(dhdb_t *s, char *buf, int size)
+{
+	struct dhdbOut o = { buf, 0, size, true };
+
+	assert(s);
+	if (size > 0)
+		buf[0] = 0;
+	_serialize(s, &o, 0, false);
+	dhdb_internal_out_str(&o, "\n");
+	return o.len;
+}
+
+int
+dhdb_to_json_pretty_r(dhdb_t *s, char *buf, int size)
+{
+	struct dhdbOut o = { buf, 0, size, true };
 
 	assert(s);
-	out[0] = 0;
-	_serialize(s, out, 0, true);
-	return out;	
+	if (size > 0)
+		buf[0] = 0;
+	_serialize(s, &o, 0, true);
+	return o.len;
 }
@@ -20,11 +20,43 @@
 
 #include "dhdb.h"
 
+#include <stdio.h>
+
 // RFC 7159
 
+#define DHDB_JSON_LAZY		(1 << 0) // Parse containers below the root on first access
+#define DHDB_JSON_RAW_NUMBERS	(1 << 1) // Convert numbers on first use, keep their text for export
+#define DHDB_JSON_PACKED	(1 << 2) // Arrays of only numbers are packed, ignored with raw numbers
+#define DHDB_JSON_SHAPES	(1 << 3) // Objects with the same keys in the same order share their names
+
 dhdb_t*		dhdb_create_from_json(const char *str);
+/* With these options, str must stay valid and unchanged for the tree's lifetime */
+dhdb_t*		dhdb_create_from_json_opt(const char *str, int opts);
+/* Strings and names point into buf, which gets modified and must outlive the tree */
+dhdb_t*		dhdb_create_from_json_insitu(char *buf, int opts);
 dhdb_t*		dhdb_create_from_json_file(const char *fmt, ...);
+
+/*
+ * With DHDB_JSON_LAZY only the brackets of a container are checked at
+ * first, syntax errors inside it are found when it is first accessed.
+ * The container is then left empty, and this returns the error and
+ * where in str it was found, parsing s if it is still lazy. Returns
+ * NULL for containers that parsed and other values.
+ */
+const char*	dhdb_json_lazy_error(dhdb_t *s, const char **at);
+
+/* Reads newline-delimited JSON one record at a time, the caller frees the records */
+typedef struct dhdbNdjson dhdb_ndjson_t;
+
+dhdb_ndjson_t*	dhdb_ndjson_create	(FILE *fp);	// fp is not closed by dhdb_ndjson_free
+void		dhdb_ndjson_free	(dhdb_ndjson_t *it);
+dhdb_t*		dhdb_ndjson_next	(dhdb_ndjson_t *it);	// NULL at the end or on an error
+bool		dhdb_ndjson_error	(dhdb_ndjson_t *it);
+/* Return a buffer of the calling thread, valid until its next call */
 const char*	dhdb_to_json(dhdb_t *s);
 const char*	dhdb_to_json_pretty(dhdb_t *s);
+/* Write to buf like snprintf, returning the length of the whole output */
+int		dhdb_to_json_r(dhdb_t *s, char *buf, int size);
+int		dhdb_to_json_pretty_r(dhdb_t *s, char *buf, int size);
 
 #endif
@@ -0,0 +1,439 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_json_par.h"
+#include "dhdb_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#define CHUNKS_PER_THREAD	4
+#define MAX_CHUNK_MEMBERS	4096	// Bounds the output kept in memory
+#define MIN_CHUNK_BYTES		4096
+
+struct chunk
+{
+	dhdb_t *first;
+	int len;
+	struct dhdbOut out;
+};
+
+struct format_job
+{
+	struct chunk *chunks;
+	bool pretty;
+};
+
+struct parse_chunk
+{
+	const char *str;
+	int len;
+	int opts;
+	dhdb_t *array;		// Values parsed from str
+	const char *err;
+	int err_col;
+	dhdb_t *root;		// Where the values go and their first index
+	uint32_t base;
+};
+
+struct parse_job
+{
+	struct parse_chunk *chunks;
+	int len;
+	int cap;
+};
+
+static long _to_json_fd(dhdb_pool_t *, dhdb_t *, int, bool);
+static void _format(void *, int);
+static void _iov(struct iovec *, int *, struct dhdbOut *);
+static int _writev(int, struct iovec *, int, long *);
+static void _add_chunk(struct parse_job *, const char *, size_t, int);
+static bool _split_array(struct parse_job *, const char *, size_t, size_t,
+    size_t, int);
+static void _split_lines(struct parse_job *, const char *, size_t, size_t,
+    int);
+static dhdb_t* _load(dhdb_pool_t *, struct parse_job *, const char *,
+    const char *);
+static bool _pack_root(struct parse_job *, dhdb_t *, uint32_t);
+static void _parse_chunk(void *, int);
+static void _adopt(void *, int);
+
+long
+dhdb_par_to_json_fd(dhdb_pool_t *p, dhdb_t *s, int fd)
+{
+	return _to_json_fd(p, s, fd, false);
+}
+
+long
+dhdb_par_to_json_pretty_fd(dhdb_pool_t *p, dhdb_t *s, int fd)
+{
+	return _to_json_fd(p, s, fd, true);
+}
+
+dhdb_t*
+dhdb_par_create_from_json(dhdb_pool_t *p, const char *str, int opts)
+{
+	struct parse_job job = { 0 };
+	size_t i, len;
+
+	for (i = 0; isspace(str[i]); i++)
+		;
+	if (str[i] != '[')
+		return dhdb_create_from_json_opt(str, opts);
+
+	len = strlen(str);
+	if (!_split_array(&job, str, i + 1, len,
+	    dhdb_pool_threads(p) * CHUNKS_PER_THREAD, opts)) {
+		fprintf(stderr, "%s: Error 'Closing bracket not found' at byte "
+		    "%zu\n", __FUNCTION__, i);
+		free(job.chunks);
+		return NULL;
+	}
+	return _load(p, &job, str, __FUNCTION__);
+}
+
+dhdb_t*
+dhdb_par_create_from_ndjson(dhdb_pool_t *p, const char *str, int opts)
+{
+	struct parse_job job = { 0 };
+
+	_split_lines(&job, str, strlen(str),
+	    dhdb_pool_threads(p) * CHUNKS_PER_THREAD, opts);
+	return _load(p, &job, str, __FUNCTION__);
+}
+
+static long
+_to_json_fd(dhdb_pool_t *p, dhdb_t *s, int fd, bool pretty)
+{
+	struct format_job job;
+	struct dhdbOut head = { 0 }, tail = { 0 };
+	struct iovec *iov;
+	struct chunk *c;
+	dhdb_t *n;
+	int i, per, num_chunks, max_chunks, iov_len;
+	long total;
+
+	assert(s);
+	max_chunks = dhdb_pool_threads(p) * CHUNKS_PER_THREAD;
+	per = dhdb_len(s) / max_chunks;
+	if (per < 1)
+		per = 1;
+	if (per > MAX_CHUNK_MEMBERS)
+		per = MAX_CHUNK_MEMBERS;
+
+	job.chunks = calloc(max_chunks, sizeof(struct chunk));
+	job.pretty = pretty;
+	iov = calloc(max_chunks + 2, sizeof(struct iovec));
+	assert(job.chunks && iov);
+
+	total = 0;
+	iov_len = 0;
+	dhdb_internal_json_open(&head, s, pretty);
+	_iov(iov, &iov_len, &head);
+
+	/* Don't unshare copy-on-write proxies just for reading */
+	n = dhdb_first(dhdb_internal_resolve(s));
+	while (n) {
+		for (num_chunks = 0; n && num_chunks < max_chunks;
+		    num_chunks++) {
+			c = &job.chunks[num_chunks];
+			c->first = n;
+			for (c->len = 0; n && c->len < per; c->len++)
+				n = dhdb_next(n);
+		}
+		dhdb_pool_run(p, num_chunks, _format, &job);
+
+		for (i = 0; i < num_chunks; i++)
+			_iov(iov, &iov_len, &job.chunks[i].out);
+		if (_writev(fd, iov, iov_len, &total) == -1) {
+			total = -1;
+			goto out;
+		}
+		iov_len = 0;
+	}
+
+	dhdb_internal_json_close(&tail, s, pretty);
+	_iov(iov, &iov_len, &tail);
+	if (_writev(fd, iov, iov_len, &total) == -1)
+		total = -1;
+
+out:
+	for (i = 0; i < max_chunks; i++)
+		free(job.chunks[i].out.buf);
+	free(job.chunks);
+	free(iov);
+	free(head.buf);
+	free(tail.buf);
+	return total;
+}
+
+static void
+_format(void *arg, int i)
+{
+	struct format_job *job = arg;
+	struct chunk *c = &job->chunks[i];
+	dhdb_t *n;
+	int j;
+
+	c->out.len = 0;
+	for (j = 0, n = c->first; j < c->len; j++, n = dhdb_next(n))
+		dhdb_internal_json_member(&c->out, n, job->pretty);
+}
+
+static void
+_iov(struct iovec *iov, int *len, struct dhdbOut *o)
+{
+	iov[*len].iov_base = o->buf;
+	iov[*len].iov_len = o->len;
+	(*len)++;
+}
+
+/* Writes all of iov, which gets modified, and adds to total */
+static int
+_writev(int fd, struct iovec *iov, int len, long *total)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			len--;
+			continue;
+		}
+		n = writev(fd, iov, len < IOV_MAX ? len : IOV_MAX);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		*total += n;
+		for (; len > 0 && n >= iov->iov_len; iov++, len--)
+			n -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void
+_add_chunk(struct parse_job *job, const char *str, size_t len, int opts)
+{
+	struct parse_chunk *c;
+
+	if (job->len == job->cap) {
+		job->cap = job->cap ? job->cap * 2 : 64;
+		job->chunks = realloc(job->chunks,
+		    job->cap * sizeof(struct parse_chunk));
+		assert(job->chunks);
+	}
+	c = &job->chunks[job->len++];
+	memset(c, 0, sizeof(struct parse_chunk));
+	c->str = str;
+	c->len = len;
+	c->opts = opts;
+}
+
+/*
+ * Splits the elements of the root array from begin at the commas
+ * between them, a chunk about every so many bytes. Strings are skipped
+ * the way the parser skips them. Returns false if the root array does
+ * not end.
+ */
+static bool
+_split_array(struct parse_job *job, const char *str, size_t begin,
+    size_t len, size_t num_chunks, int opts)
+{
+	size_t i, target;
+	int depth = 0;
+	bool in_str = false;
+
+	target = len / num_chunks;
+	if (target < MIN_CHUNK_BYTES)
+		target = MIN_CHUNK_BYTES;
+
+	for (i = begin; i < len; i++) {
+		if (in_str) {
+			if (str[i] == '\"')
+				in_str = false;
+			continue;
+		}
+		if (str[i] == '\"')
+			in_str = true;
+		else if (str[i] == '[' || str[i] == '{')
+			depth++;
+		else if (str[i] == ']' || str[i] == '}') {
+			if (depth-- == 0)
+				break;
+		}
+		else if (str[i] == ',' && depth == 0 && i - begin >= target) {
+			_add_chunk(job, &str[begin], i - begin, opts);
+			begin = i + 1;
+		}
+	}
+	if (i == len)
+		return false;
+
+	_add_chunk(job, &str[begin], i - begin, opts);
+	return true;
+}
+
+static void
+_split_lines(struct parse_job *job, const char *str, size_t len,
+    size_t num_chunks, int opts)
+{
+	size_t begin, end, target;
+	const char *nl;
+
+	target = len / num_chunks;
+	if (target < MIN_CHUNK_BYTES)
+		target = MIN_CHUNK_BYTES;
+
+	for (begin = 0; begin < len; begin = end) {
+		end = begin + target;
+		if (end >= len)
+			end = len;
+		else if ((nl = memchr(&str[end], '\n', len - end)))
+			end = nl - str + 1;
+		else
+			end = len;
+		_add_chunk(job, &str[begin], end - begin, opts);
+	}
+}
+
+/*
+ * Parses the chunks into arrays of their own in parallel, then moves
+ * the values to the root. Each chunk's values are renumbered in
+ * parallel too, only the splicing is left for the caller.
+ */
+static dhdb_t*
+_load(dhdb_pool_t *p, struct parse_job *job, const char *str,
+    const char *func)
+{
+	struct parse_chunk *c;
+	dhdb_t *root, *a;
+	uint32_t base;
+	bool ok;
+	int i;
+
+	root = dhdb_set_array(dhdb_create());
+	dhdb_pool_run(p, job->len, _parse_chunk, job->chunks);
+
+	ok = true;
+	base = 0;
+	for (i = 0; i < job->len && ok; i++) {
+		c = &job->chunks[i];
+		if (c->err) {
+			fprintf(stderr, "%s: Error '%s' at byte %zu\n", func,
+			    c->err, (size_t) (c->str - str) + c->err_col);
+			ok = false;
+		}
+		c->root = root;
+		c->base = base;
+		base += c->array->array_len;
+	}
+
+	if (ok && !_pack_root(job, root, base)) {
+		dhdb_pool_run(p, job->len, _adopt, job->chunks);
+		for (i = 0; i < job->len; i++) {
+			a = job->chunks[i].array;
+			if (a->first_child == NULL)
+				continue;
+			a->first_child->prev = root->last_child;
+			if (root->last_child)
+				root->last_child->next = a->first_child;
+			else
+				root->first_child = a->first_child;
+			root->last_child = a->last_child;
+			root->array_len += a->array_len;
+
+			a->first_child = NULL;
+			a->last_child = NULL;
+			a->array_len = 0;
+		}
+	}
+
+	for (i = 0; i < job->len; i++)
+		dhdb_free(job->chunks[i].array);
+	free(job->chunks);
+	if (!ok) {
+		dhdb_free(root);
+		return NULL;
+	}
+	return root;
+}
+
+/*
+ * With DHDB_JSON_PACKED a root of only numbers is packed like
+ * dhdb_create_from_json_opt would do. The chunks keep their nodes
+ * and are freed by the caller.
+ */
+static bool
+_pack_root(struct parse_job *job, dhdb_t *root, uint32_t len)
+{
+	double *nums;
+	dhdb_t *n;
+	uint32_t j;
+	int i;
+
+	if (len == 0 || (job->chunks[0].opts & (DHDB_JSON_PACKED |
+	    DHDB_JSON_RAW_NUMBERS)) != DHDB_JSON_PACKED)
+		return false;
+	for (i = 0; i < job->len; i++)
+		for (n = job->chunks[i].array->first_child; n; n = n->next)
+			if (n->type != DHDB_VALUE_NUMBER)
+				return false;
+
+	nums = malloc(len * sizeof(double));
+	assert(nums);
+	j = 0;
+	for (i = 0; i < job->len; i++)
+		for (n = job->chunks[i].array->first_child; n; n = n->next)
+			nums[j++] = n->num;
+	dhdb_add_num_array(root, nums, len);
+	free(nums);
+	return true;
+}
+
+static void
+_parse_chunk(void *arg, int i)
+{
+	struct parse_chunk *c = &((struct parse_chunk *) arg)[i];
+
+	c->array = dhdb_set_array(dhdb_create());
+	c->err = dhdb_internal_json_parse_values(c->array, c->str, c->len,
+	    c->opts, &c->err_col);
+}
+
+static void
+_adopt(void *arg, int i)
+{
+	struct parse_chunk *c = &((struct parse_chunk *) arg)[i];
+	dhdb_t *n;
+
+	for (n = c->array->first_child; n; n = n->next) {
+		n->parent = c->root;
+		n->index += c->base;
+	}
+}
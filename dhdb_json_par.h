@@ -0,0 +1,45 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_JSON_PAR_H__
+#define __DHDB_JSON_PAR_H__
+
+#include "dhdb_par.h"
+#include "dhdb_json.h"
+
+/*
+Parallel export of large JSON documents
+- Members of the root container are formatted in chunks on the threads
+  of the pool, each chunk into its own buffer
+- Chunks are written out in order with writev, a round at a time, so
+  memory use stays bounded however large the document is
+- Output is the same as with dhdb_to_json and dhdb_to_json_pretty
+*/
+long	dhdb_par_to_json_fd		(dhdb_pool_t *p, dhdb_t *s, int fd);	// Bytes written, or -1 with errno set
+long	dhdb_par_to_json_pretty_fd	(dhdb_pool_t *p, dhdb_t *s, int fd);
+
+/*
+Parallel import of large JSON arrays and newline-delimited JSON
+- A quick scan splits the input between elements or lines, the parts
+  are parsed on the threads of the pool and joined in order
+- Options and error handling are as with dhdb_create_from_json_opt
+- A root that is not an array is parsed as usual, on the calling thread
+*/
+dhdb_t*	dhdb_par_create_from_json	(dhdb_pool_t *p, const char *str, int opts);
+dhdb_t*	dhdb_par_create_from_ndjson	(dhdb_pool_t *p, const char *str, int opts);	// Array of the records
+
+#endif
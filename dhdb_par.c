@@ -0,0 +1,594 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_par.h"
+#include "dhdb_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define RUNS_PER_THREAD		8	// Enough runs that uneven ones even out
+#define MAX_PLAN_DEPTH		32
+
+/*
+ * The plan lists the spine, nodes near the root that are handled by the
+ * caller, and the runs of siblings below it in depth-first order. Spine
+ * nodes come before their children, so parent steps precede theirs.
+ */
+struct step
+{
+	dhdb_t *s;		// Spine node or the first node of the run
+	dhdb_t *other;		// Counterpart of s in the second tree
+	int len;		// Nodes in the run, 0 for a spine node
+	int parent;		// Step of the parent, -1 for the root
+	int count;		// Nodes and string bytes of the clone
+	size_t bytes;		// or the size of the run
+	dhdb_t *first;		// Cloned nodes
+	dhdb_t *last;
+	char *chars;
+};
+
+struct plan
+{
+	struct step *steps;
+	int len;
+	int cap;
+	int unequal;
+	void (*fn)(struct plan *, struct step *);
+};
+
+struct dhdbPool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_t *threads;
+	int num_threads;	// Workers, the caller takes part too
+	int busy;		// Workers still in the current job
+	uint64_t job;
+	bool quit;
+
+	void (*fn)(void *, int);
+	void *arg;
+	int num_tasks;
+	int next;		// Next task to take
+};
+
+static void* _worker(void *);
+static void _work(dhdb_pool_t *);
+static void _run(dhdb_pool_t *, struct plan *,
+    void (*)(struct plan *, struct step *));
+static void _run_step(void *, int);
+static int _step(struct plan *, dhdb_t *, dhdb_t *, int, int);
+static void _plan(struct plan *, dhdb_t *, int, int, int, bool);
+static bool _plan_pair(struct plan *, dhdb_t *, dhdb_t *, int, int, int);
+static void _splice(dhdb_t *, dhdb_t *, dhdb_t *, int);
+static void _free_run(struct plan *, struct step *);
+static void _size_run(struct plan *, struct step *);
+static void _measure_run(struct plan *, struct step *);
+static void _clone_run(struct plan *, struct step *);
+static void _equal_run(struct plan *, struct step *);
+
+dhdb_pool_t*
+dhdb_pool_create(int threads)
+{
+	dhdb_pool_t *p;
+	int i;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+
+	p = calloc(1, sizeof(dhdb_pool_t));
+	assert(p);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	p->num_threads = threads - 1;
+	p->threads = calloc(threads, sizeof(pthread_t));
+	assert(p->threads);
+	for (i = 0; i < p->num_threads; i++)
+		if (pthread_create(&p->threads[i], NULL, _worker, p) != 0)
+			assert(0);
+
+	return p;
+}
+
+void
+dhdb_pool_free(dhdb_pool_t *p)
+{
+	int i;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < p->num_threads; i++)
+		pthread_join(p->threads[i], NULL);
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	free(p->threads);
+	free(p);
+}
+
+int
+dhdb_pool_threads(dhdb_pool_t *p)
+{
+	return p->num_threads + 1;
+}
+
+/*
+ * The caller takes tasks too. Only one job runs at a time, so the pool
+ * is not for use from several threads at once.
+ */
+void
+dhdb_pool_run(dhdb_pool_t *p, int num_tasks, void (*fn)(void *arg, int task),
+    void *arg)
+{
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->arg = arg;
+	p->num_tasks = num_tasks;
+	__atomic_store_n(&p->next, 0, __ATOMIC_RELAXED);
+	p->busy = p->num_threads;
+	p->job++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	_work(p);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busy > 0)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Spine nodes are unlinked from their children and freed last, deepest
+ * first, so that the root of a clone block goes after its nodes.
+ */
+void
+dhdb_par_free(dhdb_pool_t *p, dhdb_t *s)
+{
+	struct plan pl;
+	struct step *st;
+	int i;
+
+	if (s == NULL)
+		return;
+
+	memset(&pl, 0, sizeof(pl));
+	_plan(&pl, s, -1, dhdb_pool_threads(p) * RUNS_PER_THREAD, 0, false);
+	for (i = 0; i < pl.len; i++)
+		if (pl.steps[i].len == 0 && pl.steps[i].s->refs > 0)
+			break;
+	if (i < pl.len) {
+		free(pl.steps);
+		dhdb_free(s);
+		return;
+	}
+
+	_run(p, &pl, _free_run);
+	for (i = pl.len - 1; i >= 0; i--) {
+		st = &pl.steps[i];
+		if (st->len > 0)
+			continue;
+		if (i > 0)
+			st->s->parent = NULL;
+		st->s->first_child = NULL;
+		st->s->last_child = NULL;
+		st->s->array_len = 0;
+		dhdb_free(st->s);
+	}
+	free(pl.steps);
+}
+
+uint32_t
+dhdb_par_size(dhdb_pool_t *p, dhdb_t *s)
+{
+	struct plan pl;
+	uint32_t bytes;
+	int i;
+
+	memset(&pl, 0, sizeof(pl));
+	_plan(&pl, s, -1, dhdb_pool_threads(p) * RUNS_PER_THREAD, 0, false);
+	_run(p, &pl, _size_run);
+
+	bytes = 0;
+	for (i = 0; i < pl.len; i++) {
+		if (pl.steps[i].len > 0)
+			bytes += pl.steps[i].bytes;
+		else
+			bytes += dhdb_internal_node_size(pl.steps[i].s);
+	}
+	free(pl.steps);
+	return bytes;
+}
+
+/*
+ * Same single block as dhdb_create_from. The spine is copied first,
+ * then each run into its own region, and last the runs are linked to
+ * their parents in order.
+ */
+dhdb_t*
+dhdb_par_clone(dhdb_pool_t *p, dhdb_t *s)
+{
+	struct plan pl;
+	struct step *st;
+	dhdb_t *nodes, *parent;
+	char *chars;
+	size_t bytes;
+	int i, count;
+
+	if (s == NULL)
+		return dhdb_create();
+
+	memset(&pl, 0, sizeof(pl));
+	_plan(&pl, s, -1, dhdb_pool_threads(p) * RUNS_PER_THREAD, 0, true);
+	_run(p, &pl, _measure_run);
+
+	count = 0;
+	bytes = 0;
+	for (i = 0; i < pl.len; i++) {
+		st = &pl.steps[i];
+		if (st->len == 0)
+			dhdb_internal_measure(st->s, i == 0, false, &st->count,
+			    &st->bytes);
+		count += st->count;
+		bytes += st->bytes;
+	}
+
+	nodes = malloc(count * sizeof(dhdb_t) + bytes);
+	assert(nodes);
+	chars = (char *) &nodes[count];
+
+	for (i = 0; i < pl.len; i++) {
+		st = &pl.steps[i];
+		parent = i > 0 ? pl.steps[st->parent].first : NULL;
+		if (st->len > 0) {
+			st->first = nodes;
+			st->chars = chars;
+			nodes += st->count;
+			chars += st->bytes;
+			continue;
+		}
+		st->first = nodes;
+		st->last = dhdb_internal_clone_run(st->s, 1, false, parent,
+		    &nodes, &chars);
+	}
+
+	_run(p, &pl, _clone_run);
+	for (i = 1; i < pl.len; i++) {
+		st = &pl.steps[i];
+		_splice(pl.steps[st->parent].first, st->first, st->last,
+		    st->len > 0 ? st->len : 1);
+	}
+
+	s = pl.steps[0].first;
+	free(pl.steps);
+	return s;
+}
+
+bool
+dhdb_par_equal(dhdb_pool_t *p, dhdb_t *a, dhdb_t *b)
+{
+	struct plan pl;
+	bool equal;
+
+	if (!dhdb_is_container(a))
+		return dhdb_equal(a, b);
+
+	memset(&pl, 0, sizeof(pl));
+	equal = _plan_pair(&pl, a, b, -1,
+	    dhdb_pool_threads(p) * RUNS_PER_THREAD, 0);
+	if (equal) {
+		_run(p, &pl, _equal_run);
+		equal = !pl.unequal;
+	}
+	free(pl.steps);
+	return equal;
+}
+
+static void*
+_worker(void *arg)
+{
+	dhdb_pool_t *p = arg;
+	uint64_t job;
+
+	job = 0;
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->quit && p->job == job)
+			pthread_cond_wait(&p->wake, &p->lock);
+		if (p->quit)
+			break;
+		job = p->job;
+		pthread_mutex_unlock(&p->lock);
+
+		_work(p);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->busy == 0)
+			pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void
+_work(dhdb_pool_t *p)
+{
+	int i;
+
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+	    p->num_tasks)
+		p->fn(p->arg, i);
+}
+
+/* Runs fn on every run of the plan, returns when all are done */
+static void
+_run(dhdb_pool_t *p, struct plan *pl,
+    void (*fn)(struct plan *, struct step *))
+{
+	pl->fn = fn;
+	dhdb_pool_run(p, pl->len, _run_step, pl);
+}
+
+static void
+_run_step(void *arg, int i)
+{
+	struct plan *pl = arg;
+
+	if (pl->steps[i].len > 0)
+		pl->fn(pl, &pl->steps[i]);
+}
+
+static int
+_step(struct plan *pl, dhdb_t *s, dhdb_t *other, int len, int parent)
+{
+	struct step *st;
+
+	if (pl->len == pl->cap) {
+		pl->cap = pl->cap ? pl->cap * 2 : 64;
+		pl->steps = realloc(pl->steps, pl->cap * sizeof(struct step));
+		assert(pl->steps);
+	}
+	st = &pl->steps[pl->len];
+	memset(st, 0, sizeof(struct step));
+	st->s = s;
+	st->other = other;
+	st->len = len;
+	st->parent = parent;
+	return pl->len++;
+}
+
+/*
+ * Adds s to the spine. Children are split into want runs when there are
+ * enough of them, otherwise containers among them share want and are
+ * split further, and the leaves between them become runs as they are.
+ * With resolve, proxies are followed like dhdb_create_from does.
+ */
+static void
+_plan(struct plan *pl, dhdb_t *s, int parent, int want, int depth,
+    bool resolve)
+{
+	dhdb_t *x, *n, *first;
+	int self, len, per;
+
+	self = _step(pl, s, NULL, 0, parent);
+	x = resolve ? dhdb_internal_resolve(s) : s;
+	if (x->array_len == 0)
+		return;
+
+	if (x->array_len >= want || depth >= MAX_PLAN_DEPTH) {
+		per = (x->array_len + want - 1) / want;
+		for (n = x->first_child; n; ) {
+			first = n;
+			for (len = 0; len < per && n; len++)
+				n = n->next;
+			_step(pl, first, NULL, len, self);
+		}
+		return;
+	}
+
+	want = (want + x->array_len - 1) / x->array_len;
+	first = NULL;
+	len = 0;
+	for (n = x->first_child; n; n = n->next) {
+		x = resolve ? dhdb_internal_resolve(n) : n;
+		if (x->first_child == NULL) {
+			if (first == NULL)
+				first = n;
+			len++;
+			continue;
+		}
+		if (first)
+			_step(pl, first, NULL, len, self);
+		first = NULL;
+		len = 0;
+		_plan(pl, n, self, want, depth + 1, resolve);
+	}
+	if (first)
+		_step(pl, first, NULL, len, self);
+}
+
+/*
+ * Like _plan over both trees at once. Spine nodes are compared here and
+ * their children paired like dhdb_equal does, returns false on the
+ * first difference. Runs start from the positional counterpart.
+ */
+static bool
+_plan_pair(struct plan *pl, dhdb_t *a, dhdb_t *b, int parent, int want,
+    int depth)
+{
+	dhdb_t *n, *m, *first, *other;
+	int self, len, per;
+
+	a = dhdb_internal_resolve(a);
+	b = dhdb_internal_resolve(b);
+	if (a == b)
+		return true;
+	if (b == NULL || a->type != b->type)
+		return false;
+	if (dhdb_len(a) != dhdb_len(b))
+		return false;
+	if ((a->flags | b->flags) & DHDB_FLAG_PACKED)
+		return dhdb_equal(a, b);
+
+	self = _step(pl, a, b, 0, parent);
+	if (a->array_len == 0)
+		return true;
+
+	if (a->array_len >= want || depth >= MAX_PLAN_DEPTH) {
+		per = (a->array_len + want - 1) / want;
+		m = b->first_child;
+		for (n = a->first_child; n; ) {
+			first = n;
+			other = m;
+			for (len = 0; len < per && n; len++) {
+				n = n->next;
+				m = m->next;
+			}
+			_step(pl, first, other, len, self);
+		}
+		return true;
+	}
+
+	want = (want + a->array_len - 1) / a->array_len;
+	first = other = NULL;
+	len = 0;
+	m = b->first_child;
+	for (n = a->first_child; n; n = n->next, m = m->next) {
+		if (a->type == DHDB_VALUE_OBJECT &&
+		    (m == NULL || strcasecmp(n->name, m->name)))
+			m = dhdb_by(b, n->name);
+		if (m == NULL)
+			return false;
+		if (!dhdb_is_container(n)) {
+			if (first == NULL) {
+				first = n;
+				other = m;
+			}
+			len++;
+			continue;
+		}
+		if (first)
+			_step(pl, first, other, len, self);
+		first = NULL;
+		len = 0;
+		if (!_plan_pair(pl, n, m, self, want, depth + 1))
+			return false;
+	}
+	if (first)
+		_step(pl, first, other, len, self);
+	return true;
+}
+
+/* Appends the linked siblings first to last to the children of parent */
+static void
+_splice(dhdb_t *parent, dhdb_t *first, dhdb_t *last, int len)
+{
+	first->prev = parent->last_child;
+	if (parent->last_child)
+		parent->last_child->next = first;
+	else
+		parent->first_child = first;
+	parent->last_child = last;
+	parent->array_len += len;
+}
+
+static void
+_free_run(struct plan *pl, struct step *st)
+{
+	dhdb_t *n, *next;
+	int i;
+
+	n = st->s;
+	for (i = 0; i < st->len; i++) {
+		next = n->next;
+		n->parent = NULL;
+		n->next = NULL;
+		n->prev = NULL;
+		dhdb_free(n);
+		n = next;
+	}
+}
+
+static void
+_size_run(struct plan *pl, struct step *st)
+{
+	dhdb_t *n;
+	int i;
+
+	n = st->s;
+	for (i = 0; i < st->len; i++, n = n->next)
+		st->bytes += dhdb_size(n);
+}
+
+static void
+_measure_run(struct plan *pl, struct step *st)
+{
+	dhdb_t *n;
+	int i;
+
+	n = st->s;
+	for (i = 0; i < st->len; i++, n = n->next)
+		dhdb_internal_measure(n, false, true, &st->count, &st->bytes);
+}
+
+static void
+_clone_run(struct plan *pl, struct step *st)
+{
+	dhdb_t *nodes;
+
+	nodes = st->first;
+	st->last = dhdb_internal_clone_run(st->s, st->len, true,
+	    pl->steps[st->parent].first, &nodes, &st->chars);
+}
+
+static void
+_equal_run(struct plan *pl, struct step *st)
+{
+	dhdb_t *n, *m, *b;
+	int i;
+
+	b = pl->steps[st->parent].other;
+	n = st->s;
+	m = st->other;
+	for (i = 0; i < st->len; i++, n = n->next, m = m->next) {
+		if (__atomic_load_n(&pl->unequal, __ATOMIC_RELAXED))
+			return;
+		if (b->type == DHDB_VALUE_OBJECT &&
+		    (m == NULL || strcasecmp(n->name, m->name)))
+			m = dhdb_by(b, n->name);
+		if (m == NULL || !dhdb_equal(n, m)) {
+			__atomic_store_n(&pl->unequal, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
@@ -0,0 +1,48 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_PAR_H__
+#define __DHDB_PAR_H__
+
+#include "dhdb.h"
+
+/*
+Parallel deep operations for large trees
+- Worker threads of a pool are created once and reused between calls
+- The top of the tree is split into runs of siblings, large arrays and
+  objects into several runs, and idle threads take the next run
+- Results are the same as with dhdb_free, dhdb_size, dhdb_create_from
+  and dhdb_equal
+- No other thread may use the tree meanwhile
+- dhdb_par_free and dhdb_par_equal do not support copy-on-write
+  variants inside the tree, use the sequential functions for those
+*/
+typedef struct dhdbPool dhdb_pool_t;
+
+dhdb_pool_t*	dhdb_pool_create	(int threads);	// Including the caller, 0 for one per CPU
+void		dhdb_pool_free		(dhdb_pool_t *p);
+int		dhdb_pool_threads	(dhdb_pool_t *p);
+/* Calls fn for tasks 0 to num_tasks - 1 on the pool, returns when all are done */
+void		dhdb_pool_run		(dhdb_pool_t *p, int num_tasks,
+		    void (*fn)(void *arg, int task), void *arg);
+
+void		dhdb_par_free		(dhdb_pool_t *p, dhdb_t *s);
+uint32_t	dhdb_par_size		(dhdb_pool_t *p, dhdb_t *s);
+dhdb_t*		dhdb_par_clone		(dhdb_pool_t *p, dhdb_t *s);
+bool		dhdb_par_equal		(dhdb_pool_t *p, dhdb_t *a, dhdb_t *b);
+
+#endif
@@ -16,6 +16,7 @@
  */
 
 #include "dhdb_path.h"
+#include "dhdb_private.h"
 
 #include <assert.h>
 #ifndef __USE_POSIX
@@ -31,12 +32,17 @@
 #define __USE_XOPEN2K8
 #endif
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
 
 #define MAX_VA_PATH_LEN		256 // Maximum length for varargs created path names
 #define MAX_PATH_NAME_LEN	256 // Maximum length for path names created by dhdb_path_name
-#define MAX_PICK_DEPTH		32  // Maximum number of root elements to remember when picking a path
+
+#define VA_PATH char path_buf[MAX_VA_PATH_LEN]; va_list args; va_start(args, fmt)
 
 static char _separator = '/';
+static __thread char _thread_separator;
 static const uint32_t _token_alloc_block_size = 8;
 
 typedef struct tokenized_path
@@ -45,16 +51,53 @@ typedef struct tokenized_path
 	int max_level;
 } path_token_t;
 
+enum { PICK_NAME, PICK_ANY, PICK_DESCEND, PICK_RANGE, PICK_PREDICATE };
+enum { PICK_EQ, PICK_NE, PICK_LT, PICK_LE, PICK_GT, PICK_GE };
+
+/* One step of a pick path: name, *, **, [a:b] or [field op value] */
+struct pick_step
+{
+	uint8_t		kind;
+	char		*name;		// Name, or field of a predicate
+	uint8_t		op;
+	uint8_t		type;		// Type of the predicate value
+	double		num;
+	char		*str;
+	int		begin;		// Range, negative counts from the end
+	int		end;
+	struct pick_step *and;		// Predicates right after a range or predicate
+};
+
+/* A step being applied to a node, and where it got to */
+struct pick_frame
+{
+	dhdb_t		*node;
+	dhdb_t		*next;		// Next child to consider
+	int		step;
+	int		pos;		// Index of next, for ranges
+	int		end;
+	bool		self;		// ** has yet to match the node itself
+};
+
 struct path_iter
 {
-	path_token_t	*tokens;
-	dhdb_t		**root_arr;
-	dhdb_t		*leaf;
-	int		level;
+	struct pick_step	*steps;
+	int			num_steps;
+	struct pick_frame	*stack;
+	int			depth;
+	int			max_depth;
+	dhdb_t			*root;	// Match of an empty path
+	bool			flatten;
 };
 
+static char _sep()
+{
+	return _thread_separator ? _thread_separator : _separator;
+}
+
 static path_token_t* _tokenize_path(const char *path)
 {
+	char separator = _sep();
 	struct tokenized_path *tp = malloc(sizeof(struct tokenized_path));
 	int max_alloc = _token_alloc_block_size;
 	tp->path = malloc(max_alloc * sizeof(void *));
@@ -65,7 +108,7 @@ static path_token_t* _tokenize_path(const char *path)
 	for (i = 0; i < sz; i++) {
 		char *token = 0;
 		bool is_last = (i == sz - 1);
-		if (path[i] == _separator || is_last) {
+		if (path[i] == separator || is_last) {
 			if (is_last) {
 				token = strdup(&path[tokenBegin]);
 			} else {
@@ -90,20 +133,171 @@ static void _free_tokenized_path(path_token_t *s)
 	free(s);
 }
 
-static const char* _token_for_level(path_token_t *s, int level)
+static void _free_step (struct pick_step *st)
+{
+	if (st->and) {
+		_free_step(st->and);
+		free(st->and);
+	}
+	free(st->name);
+	free(st->str);
+}
+
+static void _free_pick (struct pick_step *steps, int num_steps)
+{
+	for (int i = 0; i < num_steps; i++)
+		_free_step(&steps[i]);
+	free(steps);
+}
+
+static char* _trim (const char *str, int len)
+{
+	while (len > 0 && isspace(*str)) {
+		str++;
+		len--;
+	}
+	while (len > 0 && isspace(str[len - 1]))
+		len--;
+	return strndup(str, len);
+}
+
+/* Parses the inside of brackets as a range, an index or a predicate */
+static bool _compile_bracket (struct pick_step *st, const char *str, int len)
+{
+	static const char *ops[] = { "==", "!=", "<=", ">=", "=", "<", ">" };
+	static const uint8_t op_codes[] = { PICK_EQ, PICK_NE, PICK_LE, PICK_GE, PICK_EQ, PICK_LT, PICK_GT };
+	char *end, *value;
+	const char *op = NULL;
+	int i, j;
+
+	for (i = 0; i < len && op == NULL; i++)
+		for (j = 0; j < sizeof(ops) / sizeof(ops[0]); j++)
+			if (strlen(ops[j]) <= len - i &&
+			    !strncmp(&str[i], ops[j], strlen(ops[j]))) {
+				op = &str[i];
+				break;
+			}
+
+	if (op == NULL) {
+		st->kind = PICK_RANGE;
+		st->begin = strtol(str, &end, 10);
+		while (end - str < len && isspace(*end))
+			end++;
+		if (end - str < len && *end == ':') {
+			const char *b = end + 1;
+			st->end = strtol(b, &end, 10);
+			if (end == b)
+				st->end = INT_MAX;
+			while (end - str < len && isspace(*end))
+				end++;
+		} else
+			st->end = st->begin == -1 ? INT_MAX : st->begin + 1;
+		return len > 0 && end - str == len;
+	}
+
+	st->kind = PICK_PREDICATE;
+	st->op = op_codes[j];
+	st->name = _trim(str, op - str);
+	op += strlen(ops[j]);
+	value = _trim(op, len - (op - str));
+	len = strlen(value);
+	if (len >= 2 && (*value == '"' || *value == '\'') && value[len - 1] == *value) {
+		st->type = DHDB_VALUE_STRING;
+		st->str = strndup(value + 1, len - 2);
+	} else if (!strcmp(value, "true") || !strcmp(value, "false")) {
+		st->type = DHDB_VALUE_BOOL;
+		st->num = *value == 't';
+	} else if (!strcmp(value, "null")) {
+		st->type = DHDB_VALUE_NULL;
+	} else {
+		st->num = strtod(value, &end);
+		if (*value && *end == 0)
+			st->type = DHDB_VALUE_NUMBER;
+		else {
+			st->type = DHDB_VALUE_STRING;
+			st->str = strdup(value);
+		}
+	}
+	free(value);
+	return *st->name != 0;
+}
+
+static struct pick_step* _add_step (struct pick_step **steps, int *num_steps, int *max_steps)
 {
-	if (level >= s->max_level)
-		level = s->max_level - 1;
-	if (level < 0)
-		level = 0;
+	if (*num_steps == *max_steps) {
+		*max_steps = *max_steps ? *max_steps * 2 : _token_alloc_block_size;
+		*steps = realloc(*steps, *max_steps * sizeof(struct pick_step));
+		assert(*steps);
+	}
+	memset(&(*steps)[*num_steps], 0, sizeof(struct pick_step));
+	return &(*steps)[(*num_steps)++];
+}
 
-	return s->path[level];
+/*
+ * Splits path at separators outside of brackets. A token is a name, *
+ * or ** followed by any number of bracket groups. Each is a step of its
+ * own, except that predicates right after a bracket filter what it
+ * selects. Returns the number of steps or -1 if the path is malformed.
+ */
+static int _compile_pick (const char *path, struct pick_step **steps)
+{
+	char separator = _sep();
+	int num_steps = 0, max_steps = 0, bracket;
+	struct pick_step *st, tmp;
+	const char *p = path, *b;
+
+	*steps = NULL;
+	while (*p) {
+		for (b = p; *p && *p != separator && *p != '['; p++)
+			;
+		if (p != b) {
+			st = _add_step(steps, &num_steps, &max_steps);
+			if (p - b == 2 && !strncmp(b, "**", 2))
+				st->kind = PICK_DESCEND;
+			else if (p - b == 1 && *b == '*')
+				st->kind = PICK_ANY;
+			else {
+				st->kind = PICK_NAME;
+				st->name = strndup(b, p - b);
+			}
+		}
+
+		for (bracket = -1; *p == '['; p++) {
+			for (b = ++p; *p && *p != ']'; p++)
+				;
+			memset(&tmp, 0, sizeof(tmp));
+			if (*p == 0 || !_compile_bracket(&tmp, b, p - b)) {
+				_free_step(&tmp);
+				goto malformed;
+			}
+			if (bracket == -1 || tmp.kind != PICK_PREDICATE) {
+				bracket = num_steps;
+				*_add_step(steps, &num_steps, &max_steps) = tmp;
+				continue;
+			}
+			for (st = &(*steps)[bracket]; st->and; st = st->and)
+				;
+			st->and = malloc(sizeof(struct pick_step));
+			assert(st->and);
+			*st->and = tmp;
+		}
+
+		if (*p == separator)
+			p++;
+		else if (*p)
+			goto malformed;
+	}
+	return num_steps;
+
+malformed:
+	_free_pick(*steps, num_steps);
+	*steps = NULL;
+	return -1;
 }
 
-static const char* _va_path(const char *fmt, va_list args)
+static const char* _va_path(char *path, const char *fmt, va_list args)
 {
-	static char path[MAX_VA_PATH_LEN];
-	vsnprintf(path, sizeof(path), fmt, args);
+	vsnprintf(path, MAX_VA_PATH_LEN, fmt, args);
 	va_end(args);
 	return path;
 }
@@ -111,11 +305,12 @@ static const char* _va_path(const char *fmt, va_list args)
 static dhdb_t* _path (dhdb_t *s, const char *path)
 {
 	dhdb_t *leaf = s;
+	char separator = _sep();
 	int i, sz = strlen(path), tokenBegin = 0;
 	for (i = 0; i < sz; i++) {
 		char *token = 0;
 		dhdb_t *o;
-		if (path[i] == _separator || i == sz - 1) {
+		if (path[i] == separator || i == sz - 1) {
 			if (i == sz - 1) {
 				token = strndup(&path[tokenBegin], i - tokenBegin + 1);
 			} else {
@@ -133,155 +328,333 @@ static dhdb_t* _path (dhdb_t *s, const char *path)
 
 dhdb_t*	dhdb_path (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _path(s, _va_path(fmt, args));
+	VA_PATH;
+	return _path(s, _va_path(path_buf, fmt, args));
 }
 
 dhdb_t* dhdb_path_first (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return dhdb_first(_path(s, _va_path(fmt, args)));
+	VA_PATH;
+	return dhdb_first(_path(s, _va_path(path_buf, fmt, args)));
 }
 
 const char* dhdb_path_str (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return dhdb_str(_path(s, _va_path(fmt, args)));
+	VA_PATH;
+	return dhdb_str(_path(s, _va_path(path_buf, fmt, args)));
 }
 
 double dhdb_path_num (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return dhdb_num(_path(s, _va_path(fmt, args)));
+	VA_PATH;
+	return dhdb_num(_path(s, _va_path(path_buf, fmt, args)));
 }
 
 bool dhdb_path_bool (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return dhdb_bool(_path(s, _va_path(fmt, args)));
+	VA_PATH;
+	return dhdb_bool(_path(s, _va_path(path_buf, fmt, args)));
 }
 
-static dhdb_t* _go_back_try_again (dhdb_path_iter_t *iter)
+struct many_path
+{
+	const char	*path;
+	int		idx;
+};
+
+static int _many_path_cmp (const void *a, const void *b)
 {
-	iter->level--;
-	if (iter->level < 0) {
-		return NULL;
+	return strcmp(((const struct many_path *) a)->path, ((const struct many_path *) b)->path);
+}
+
+/* Length of the first token of path, up to separator or end */
+static int _token_len (const char *path, char separator)
+{
+	const char *end = strchr(path, separator);
+	return end ? end - path : strlen(path);
+}
+
+/*
+ * Looks paths up in sorted order, which is the depth-first order of
+ * their trie. The nodes matched by the tokens of the previous path stay
+ * on a stack, so only the tokens after the shared prefix are looked up.
+ */
+int dhdb_path_get_many (dhdb_t *s, const char **paths, dhdb_t **out, int n)
+{
+	char separator = _sep();
+	struct many_path *sorted = malloc((n > 0 ? n : 1) * sizeof(struct many_path));
+	int max_depth = _token_alloc_block_size, max_token = 0, found = 0;
+	dhdb_t **stack = malloc(max_depth * sizeof(dhdb_t *));
+	char *token = NULL;
+	const char *prev = "";
+	int prev_depth = 0;
+
+	assert(sorted && stack);
+	for (int i = 0; i < n; i++) {
+		sorted[i].path = paths[i];
+		sorted[i].idx = i;
 	}
-	const char *token = _token_for_level(iter->tokens, iter->level - 1);
-	if (*token == '*') {
-		iter->leaf = dhdb_next(iter->root_arr[iter->level]);
-		iter->root_arr[iter->level] = iter->leaf;
-		if (iter->leaf == NULL) {
-			return _go_back_try_again(iter);
+	qsort(sorted, n, sizeof(struct many_path), _many_path_cmp);
+	stack[0] = s;
+
+	for (int i = 0; i < n; i++) {
+		const char *p = sorted[i].path, *q = prev;
+		int depth = 0, len;
+
+		// Reuse the nodes of the tokens shared with the previous path
+		while (*p && depth < prev_depth) {
+			len = _token_len(p, separator);
+			if (_token_len(q, separator) != len || strncmp(p, q, len))
+				break;
+			depth++;
+			p += len;
+			q += len;
+			if (*p)
+				p++;
+			if (*q)
+				q++;
 		}
-	} else {
-		return _go_back_try_again(iter);
+
+		while (*p && stack[depth]) {
+			len = _token_len(p, separator);
+			if (len >= max_token) {
+				max_token = len + 1;
+				token = realloc(token, max_token);
+				assert(token);
+			}
+			memcpy(token, p, len);
+			token[len] = 0;
+			if (depth + 1 >= max_depth) {
+				max_depth *= 2;
+				stack = realloc(stack, max_depth * sizeof(dhdb_t *));
+				assert(stack);
+			}
+			stack[depth + 1] = dhdb_by(stack[depth], token);
+			depth++;
+			p += len;
+			if (*p)
+				p++;
+		}
+
+		out[sorted[i].idx] = *p ? NULL : stack[depth];
+		if (out[sorted[i].idx])
+			found++;
+		prev = sorted[i].path;
+		prev_depth = depth;
 	}
-	return iter->leaf;
+
+	free(token);
+	free(stack);
+	free(sorted);
+	return found;
 }
 
-static void _dump_roots(dhdb_path_iter_t *iter)
+/*
+ * Whether the numbers of a packed node can be among the matches, which
+ * are nodes and need the array unpacked. Numbers have no fields and no
+ * children, so only steps without predicates followed by ** or nothing
+ * can match them.
+ */
+static bool _pick_numbers (dhdb_path_iter_t *iter, int step, dhdb_t *node)
 {
-	for (int i = 0; i < 10; i++) {
-		dhdb_t *root = iter->root_arr[i];
-		if (root)
-			printf("Root %d: %s %s\n", i, dhdb_name(root), iter->level == i ? "CURRENT" : "");
-	}
+	struct pick_step *st = &iter->steps[step];
+	int len;
+
+	if (dhdb_internal_packed(node, &len) == NULL)
+		return true;
+	if (st->kind == PICK_PREDICATE || st->and)
+		return false;
+	for (step++; step < iter->num_steps; step++)
+		if (iter->steps[step].kind != PICK_DESCEND)
+			return false;
+	return true;
 }
 
-static dhdb_t* _search_until_leaf (dhdb_path_iter_t *iter)
+static void _pick_push (dhdb_path_iter_t *iter, dhdb_t *node, int step)
 {
-	while (dhdb_is_container(iter->leaf)) {
-		dhdb_t *root = iter->root_arr[iter->level];
-		const char *token = _token_for_level(iter->tokens, iter->level);
-		if (*token == '*') {
-			iter->leaf = dhdb_first(root);
-		} else {
-			iter->leaf = dhdb_by(root, token);
-		}
-		iter->level++;
-		iter->root_arr[iter->level] = iter->leaf;
+	struct pick_frame *f;
+
+	if (iter->depth == iter->max_depth) {
+		iter->max_depth = iter->max_depth ? iter->max_depth * 2 : 16;
+		iter->stack = realloc(iter->stack, iter->max_depth * sizeof(struct pick_frame));
+		assert(iter->stack);
 	}
+	f = &iter->stack[iter->depth++];
+	f->node = node;
+	f->step = step;
+	f->pos = 0;
+	f->self = false;
+	f->next = NULL;
 
-	// If we got leaf but we didn't actually check tokens until token max
-	if (iter->leaf && iter->level < iter->tokens->max_level) {
-		iter->leaf = _go_back_try_again(iter);
-		if (iter->leaf)
-			iter->leaf = _search_until_leaf(iter);
+	struct pick_step *st = &iter->steps[step];
+	if (st->kind != PICK_NAME && !_pick_numbers(iter, step, node)) {
+		f->self = st->kind == PICK_DESCEND;
+		return;
+	}
+	switch (st->kind) {
+	case PICK_NAME:
+		f->next = dhdb_by(node, st->name);
+		break;
+	case PICK_RANGE:
+		if (dhdb_type(node) != DHDB_VALUE_ARRAY)
+			break;
+		int len = dhdb_len(node);
+		f->pos = st->begin < 0 ? st->begin + len : st->begin;
+		f->end = st->end < 0 ? st->end + len : st->end;
+		if (f->pos < 0)
+			f->pos = 0;
+		f->next = dhdb_first(node);
+		for (int i = 0; f->next && i < f->pos; i++)
+			f->next = dhdb_next(f->next);
+		break;
+	case PICK_DESCEND:
+		f->self = true;
+		/* FALLTHROUGH */
+	default:
+		f->next = dhdb_first(node);
+		break;
 	}
+}
+
+static bool _pick_match (dhdb_t *n, struct pick_step *st)
+{
+	dhdb_t *v;
+	int cmp;
+
+	if (st->and && !_pick_match(n, st->and))
+		return false;
+	if (st->kind != PICK_PREDICATE)
+		return true;
+
+	v = dhdb_by(n, st->name);
+
+	if (v == NULL)
+		return false;
+	if (dhdb_type(v) != st->type)
+		return st->op == PICK_NE;
 
-	return iter->leaf;
+	if (st->type == DHDB_VALUE_STRING)
+		cmp = strcmp(dhdb_str(v), st->str);
+	else if (st->type == DHDB_VALUE_NULL)
+		cmp = 0;
+	else
+		cmp = (dhdb_num(v) > st->num) - (dhdb_num(v) < st->num);
+
+	switch (st->op) {
+	case PICK_EQ: return cmp == 0;
+	case PICK_NE: return cmp != 0;
+	case PICK_LT: return cmp < 0;
+	case PICK_LE: return cmp <= 0;
+	case PICK_GT: return cmp > 0;
+	case PICK_GE: return cmp >= 0;
+	}
+	return false;
 }
 
-static dhdb_t* _pick_first_matching_leaf (dhdb_path_iter_t *iter)
+/* Next node the step of the frame selects, and the step that follows it */
+static dhdb_t* _pick_advance (dhdb_path_iter_t *iter, struct pick_frame *f, int *step)
 {
-	if (iter->leaf) {
-		const char *token = _token_for_level(iter->tokens, iter->level);
-		if (*token == '*')
-			iter->leaf = dhdb_next(iter->leaf);
-		if (iter->leaf == NULL || *token != '*') {
-			iter->leaf = _go_back_try_again(iter);
-			iter->leaf = _search_until_leaf(iter);
-		}
-	} else {
-		dhdb_t *root = iter->root_arr[iter->level];
-		const char *token = _token_for_level(iter->tokens, iter->level);
-		if (*token == '*') {
-			iter->leaf = dhdb_first(root);
-		} else {
-			iter->leaf = dhdb_by(root, token);
-		}		
-		iter->level++;
-		iter->root_arr[iter->level] = iter->leaf;
-		iter->leaf = _search_until_leaf(iter);
+	struct pick_step *st = &iter->steps[f->step];
+	dhdb_t *n;
+
+	*step = f->step + 1;
+	if (f->self) {
+		f->self = false;
+		return f->node;
+	}
+	while ((n = f->next)) {
+		f->next = st->kind == PICK_NAME ? NULL : dhdb_next(n);
+		if (st->kind == PICK_DESCEND)
+			*step = f->step;
+		if (st->kind == PICK_RANGE && f->pos++ >= f->end)
+			return NULL;
+		if (_pick_match(n, st))
+			return n;
 	}
-	return iter->leaf;
+	return NULL;
 }
 
-static dhdb_t* _find_leaf (dhdb_path_iter_t *iter)
+/*
+ * Depth-first over the frames on the stack, each one applying a step
+ * to a node. With plain names and * only, matches that are containers
+ * are flattened to their leaves by repeating the last step, like the
+ * pick has always done.
+ */
+static dhdb_t* _path_pick (dhdb_path_iter_t *iter)
 {
-	return _pick_first_matching_leaf(iter);
+	struct pick_frame *f;
+	dhdb_t *n;
+	int step;
+
+	if (iter->num_steps == 0) {
+		n = iter->root;
+		iter->root = NULL;
+		return n;
+	}
+
+	while (iter->depth > 0) {
+		f = &iter->stack[iter->depth - 1];
+		if ((n = _pick_advance(iter, f, &step)) == NULL) {
+			iter->depth--;
+			continue;
+		}
+		if (step < iter->num_steps)
+			_pick_push(iter, n, step);
+		else if (!iter->flatten || !dhdb_is_container(n))
+			return n;
+		else
+			_pick_push(iter, n, iter->num_steps - 1);
+	}
+	return NULL;
 }
 
 static void _path_pick_dump_fd(dhdb_t *root, int fd, const char *path)
 {
-	path_token_t *tokens = _tokenize_path(path);
-	dhdb_t *leaf = 0;
-	int level = 0;
-
 	// TODO: fd support
-	//while (leaf = _find_leaf(&root, leaf, &level, tokens)) {
-	//	dhdb_dump(leaf);
-	//}
-	_free_tokenized_path(tokens);
 }
 
 void dhdb_path_pick_dump(dhdb_t *root, const char *fmt, ...)
 {	
-	va_list args; va_start(args, fmt);
-	return _path_pick_dump_fd(root, fileno(stdout), _va_path(fmt, args));
+	VA_PATH;
+	return _path_pick_dump_fd(root, fileno(stdout), _va_path(path_buf, fmt, args));
 }
 
-static dhdb_t* _path_pick (dhdb_path_iter_t *iter)
+static dhdb_path_iter_t* _pick_create (dhdb_t *s, const char *path)
 {
-	iter->leaf = _find_leaf(iter);
-	return iter->leaf;
+	dhdb_path_iter_t *iter = calloc(1, sizeof(struct path_iter));
+
+	assert(iter);
+	iter->num_steps = _compile_pick(path, &iter->steps);
+	if (iter->num_steps == -1)
+		iter->num_steps = 0;
+	else if (iter->num_steps == 0)
+		iter->root = s;
+	else
+		_pick_push(iter, s, 0);
+
+	iter->flatten = true;
+	for (int i = 0; i < iter->num_steps; i++)
+		if (iter->steps[i].kind != PICK_NAME && iter->steps[i].kind != PICK_ANY)
+			iter->flatten = false;
+	return iter;
 }
 
 dhdb_t* dhdb_path_pick_first (dhdb_t *s, dhdb_path_iter_t **iter, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	const char *path = _va_path(fmt, args);
-	*iter = malloc(sizeof(struct path_iter));
-	(*iter)->tokens = _tokenize_path(path);
-	(*iter)->leaf = NULL;
-	(*iter)->level = 0;
-	(*iter)->root_arr = (dhdb_t **) calloc(MAX_PICK_DEPTH, sizeof(dhdb_t *));
-	(*iter)->root_arr[0] = s;
-
+	VA_PATH;
+	*iter = _pick_create(s, _va_path(path_buf, fmt, args));
 	return _path_pick(*iter);
 }
 
+dhdb_t* dhdb_path_pick_first_only (dhdb_t *s, const char *fmt, ...)
+{
+	VA_PATH;
+	dhdb_path_iter_t *iter = _pick_create(s, _va_path(path_buf, fmt, args));
+	dhdb_t *n = _path_pick(iter);
+	dhdb_path_pick_free(&iter);
+	return n;
+}
+
 dhdb_t* dhdb_path_pick_next (dhdb_path_iter_t *iter)
 {
 	return _path_pick(iter);
@@ -289,8 +662,8 @@ dhdb_t* dhdb_path_pick_next (dhdb_path_iter_t *iter)
 
 dhdb_t* dhdb_path_pick_free (dhdb_path_iter_t **iter)
 {
-	_free_tokenized_path((*iter)->tokens);
-	free((*iter)->root_arr);
+	_free_pick((*iter)->steps, (*iter)->num_steps);
+	free((*iter)->stack);
 	free(*iter);
 	*iter = 0;
 	return NULL;
@@ -301,27 +674,62 @@ void dhdb_path_internal_set_separator(char separator)
 	_separator = separator;
 }
 
+void dhdb_path_internal_set_thread_separator(char separator)
+{
+	_thread_separator = separator;
+}
+
+char dhdb_path_internal_separator(void)
+{
+	return _sep();
+}
+
+char** dhdb_internal_pattern(const char *pattern, int *len)
+{
+	char **names = NULL, separator = _sep();
+	const char *p, *end;
+
+	*len = 0;
+	for (p = pattern; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, separator);
+		if (end == NULL)
+			end = p + strlen(p);
+		names = realloc(names, (*len + 1) * sizeof(char *));
+		assert(names);
+		names[(*len)++] =
+		    end - p == 1 && *p == '*' ? NULL : strndup(p, end - p);
+	}
+	return names;
+}
+
 const char* dhdb_path_name(dhdb_t *s)
 {
-	static char buf[MAX_PATH_NAME_LEN];
-	memset(&buf, 0, sizeof(buf));
-	int len = sizeof(buf) - 1;
-	dhdb_t *parent = s;
-	// Go up from the leaf up to the upmost root and while doing it,
-	// insert names to buf but write to the end of the buf, not beginning...
-	for (; parent; parent = dhdb_parent(parent)) {
-		const char *name = dhdb_name(parent);
-		if (!name) break;
-		int sz = strlen(name);
+	static __thread char buf[MAX_PATH_NAME_LEN];
+	return dhdb_path_name_r(s, buf, sizeof(buf));
+}
+
+const char* dhdb_path_name_r(dhdb_t *s, char *buf, int size)
+{
+	const char *name;
+	int len, sz;
+
+	assert(size > 0);
+	len = size - 1;
+	buf[len] = 0;
+	// Go up from the leaf to the root, writing each name in front of the
+	// previous ones from the end of buf. Names that no longer fit are
+	// left out, so a short buf keeps the names nearest to the leaf.
+	for (; s && (name = dhdb_name(s)); s = dhdb_parent(s)) {
+		sz = strlen(name);
+		if (sz + (len < size - 1) > len)
+			break;
+		if (len < size - 1)
+			buf[--len] = '.';
 		len -= sz;
-		if (len < 0)
-			len = 0;
-		strncpy(&buf[len], name, sz);
-		buf[len + sz] = '.';
-		len--;
+		memcpy(&buf[len], name, sz);
 	}
-	buf[sizeof(buf) - 1] = 0;
-	return &buf[len + 1];
+	memmove(buf, &buf[len], size - len);
+	return buf;
 }
 
 static dhdb_t* _set_path (dhdb_t *s, dhdb_t *v, const char *path)
@@ -349,30 +757,313 @@ static dhdb_t* _set_path (dhdb_t *s, dhdb_t *v, const char *path)
 
 dhdb_t* dhdb_path_set (dhdb_t *s, dhdb_t *v, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _set_path(s, v, _va_path(fmt, args));
+	VA_PATH;
+	return _set_path(s, v, _va_path(path_buf, fmt, args));
 }
 
 dhdb_t* dhdb_path_set_str (dhdb_t *s, const char *str, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _set_path(s, dhdb_create_str(str), _va_path(fmt, args));
+	VA_PATH;
+	return _set_path(s, dhdb_create_str(str), _va_path(path_buf, fmt, args));
 }
 
 dhdb_t* dhdb_path_set_num (dhdb_t *s, double num, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _set_path(s, dhdb_create_num(num), _va_path(fmt, args));
+	VA_PATH;
+	return _set_path(s, dhdb_create_num(num), _va_path(path_buf, fmt, args));
 }
 
 dhdb_t* dhdb_path_set_bool (dhdb_t *s, bool flag, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _set_path(s, dhdb_create_bool(flag), _va_path(fmt, args));
+	VA_PATH;
+	return _set_path(s, dhdb_create_bool(flag), _va_path(path_buf, fmt, args));
 }
 
 dhdb_t* dhdb_path_set_null (dhdb_t *s, const char *fmt, ...)
 {
-	va_list args; va_start(args, fmt);
-	return _set_path(s, dhdb_create_null(), _va_path(fmt, args));
+	VA_PATH;
+	return _set_path(s, dhdb_create_null(), _va_path(path_buf, fmt, args));
+}
+
+/* An open node of the builder and whether its children are in order */
+struct build_level
+{
+	dhdb_t		*node;
+	bool		ordered;	// Only builder added children, in increasing order
+};
+
+struct path_builder
+{
+	dhdb_t			*root;
+	char			separator;
+	struct build_level	*stack;
+	int			depth;
+	int			max_depth;
+	char			*token;
+	int			max_token;
+};
+
+dhdb_path_builder_t* dhdb_path_builder_create (dhdb_t *s)
+{
+	dhdb_path_builder_t *b = calloc(1, sizeof(dhdb_path_builder_t));
+
+	assert(b);
+	b->root = s;
+	b->separator = _sep();
+	b->max_depth = _token_alloc_block_size;
+	b->stack = malloc(b->max_depth * sizeof(struct build_level));
+	assert(b->stack);
+	b->stack[0].node = s;
+	b->stack[0].ordered = dhdb_len(s) == 0;
+	return b;
+}
+
+void dhdb_path_builder_free (dhdb_path_builder_t *b)
+{
+	if (b == NULL)
+		return;
+	free(b->stack);
+	free(b->token);
+	free(b);
+}
+
+/* Returns child token of the node at level, appending it if it is missing */
+static dhdb_t* _build_child (dhdb_path_builder_t *b, int level, dhdb_t *v, bool *created)
+{
+	struct build_level *l = &b->stack[level];
+	dhdb_t *last, *n;
+
+	*created = false;
+	if (l->ordered) {
+		last = dhdb_last(l->node);
+		if (last && strcasecmp(b->token, dhdb_name(last)) <= 0)
+			l->ordered = false;
+	}
+	if (!l->ordered && (n = dhdb_by(l->node, b->token)))
+		return n;
+
+	*created = true;
+	return dhdb_append_obj(l->node, b->token, v);
+}
+
+/*
+ * Keeps the nodes of the previous path open. Tokens matching an open
+ * node reuse it, the rest are looked up from their parent only when the
+ * parent was not built in order by the builder itself.
+ */
+dhdb_t* dhdb_path_builder_set (dhdb_path_builder_t *b, dhdb_t *v, const char *path)
+{
+	const char *p = path;
+	int depth = 0, len;
+	bool created = false;
+	dhdb_t *n;
+
+	while (*p && depth < b->depth) {
+		const char *name = dhdb_name(b->stack[depth + 1].node);
+		len = _token_len(p, b->separator);
+		if (strlen(name) != len || strncasecmp(p, name, len))
+			break;
+		depth++;
+		p += len;
+		if (*p)
+			p++;
+	}
+	b->depth = depth;
+
+	while (*p) {
+		len = _token_len(p, b->separator);
+		if (len >= b->max_token) {
+			b->max_token = len + 1;
+			b->token = realloc(b->token, b->max_token);
+			assert(b->token);
+		}
+		memcpy(b->token, p, len);
+		b->token[len] = 0;
+		p += len;
+		if (*p)
+			p++;
+
+		n = _build_child(b, depth, *p ? NULL : v, &created);
+		if (n == NULL) {
+			dhdb_free(v);
+			return NULL;
+		}
+		if (depth + 1 >= b->max_depth) {
+			b->max_depth *= 2;
+			b->stack = realloc(b->stack, b->max_depth * sizeof(struct build_level));
+			assert(b->stack);
+		}
+		depth++;
+		b->stack[depth].node = n;
+		b->stack[depth].ordered = created && dhdb_len(n) == 0;
+		b->depth = depth;
+	}
+
+	n = b->stack[depth].node;
+	if (!created) {
+		dhdb_set_from(n, v);
+		dhdb_free(v);
+	}
+	return n;
+}
+
+dhdb_t* dhdb_path_builder_set_str (dhdb_path_builder_t *b, const char *str, const char *path)
+{
+	return dhdb_path_builder_set(b, dhdb_create_str(str), path);
+}
+
+dhdb_t* dhdb_path_builder_set_num (dhdb_path_builder_t *b, double num, const char *path)
+{
+	return dhdb_path_builder_set(b, dhdb_create_num(num), path);
+}
+
+dhdb_t* dhdb_path_builder_set_bool (dhdb_path_builder_t *b, bool flag, const char *path)
+{
+	return dhdb_path_builder_set(b, dhdb_create_bool(flag), path);
+}
+
+dhdb_t* dhdb_path_builder_set_null (dhdb_path_builder_t *b, const char *path)
+{
+	return dhdb_path_builder_set(b, dhdb_create_null(), path);
+}
+
+/* A resolved path and the generations of the containers it went through */
+struct path_cache_entry
+{
+	char		*path;
+	int		path_cap;
+	uint32_t	hash;
+	int		len;		// Containers looked into, root first
+	int		cap;
+	dhdb_t		**nodes;
+	uint32_t	*gens;
+	dhdb_t		*found;
+};
+
+struct path_cache
+{
+	dhdb_t			*root;
+	char			separator;
+	uint32_t		mask;
+	struct path_cache_entry	*entries;
+};
+
+static uint32_t _path_hash (const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *path; path++)
+		h = (h ^ (uint8_t) *path) * 16777619u;
+	return h;
+}
+
+dhdb_path_cache_t* dhdb_path_cache_create (dhdb_t *s, int size)
+{
+	dhdb_path_cache_t *c = malloc(sizeof(dhdb_path_cache_t));
+	uint32_t n = 1;
+
+	while (n < size && n < (1u << 30))
+		n <<= 1;
+	assert(c);
+	c->root = s;
+	c->separator = _sep();
+	c->mask = n - 1;
+	c->entries = calloc(n, sizeof(struct path_cache_entry));
+	assert(c->entries);
+	return c;
+}
+
+void dhdb_path_cache_free (dhdb_path_cache_t *c)
+{
+	if (c == NULL)
+		return;
+	for (uint32_t i = 0; i <= c->mask; i++) {
+		free(c->entries[i].path);
+		free(c->entries[i].nodes);
+		free(c->entries[i].gens);
+	}
+	free(c->entries);
+	free(c);
+}
+
+static void _cache_add_node (struct path_cache_entry *e, dhdb_t *n)
+{
+	if (e->len == e->cap) {
+		e->cap = e->cap ? e->cap * 2 : _token_alloc_block_size;
+		e->nodes = realloc(e->nodes, e->cap * sizeof(dhdb_t *));
+		e->gens = realloc(e->gens, e->cap * sizeof(uint32_t));
+		assert(e->nodes && e->gens);
+	}
+	e->nodes[e->len] = n;
+	e->gens[e->len++] = dhdb_generation(n);
+}
+
+/*
+ * Resolves path like dhdb_path and records every container on the way.
+ * The result is valid for as long as none of them has changed.
+ */
+static void _cache_resolve (dhdb_path_cache_t *c, struct path_cache_entry *e, const char *path)
+{
+	int len = strlen(path);
+	dhdb_t *n = c->root;
+	char *token;
+
+	if (len >= e->path_cap) {
+		e->path_cap = len + 1;
+		e->path = realloc(e->path, e->path_cap);
+		assert(e->path);
+	}
+	memcpy(e->path, path, len + 1);
+	e->len = 0;
+
+	token = strdup(path);
+	assert(token);
+	for (const char *p = path; *p && n; ) {
+		int token_len = _token_len(p, c->separator);
+		memcpy(token, p, token_len);
+		token[token_len] = 0;
+		dhdb_t *next = dhdb_by(n, token);	// May materialize n
+		_cache_add_node(e, n);
+		n = next;
+		p += token_len;
+		if (*p)
+			p++;
+	}
+	free(token);
+	e->found = n;
+}
+
+dhdb_t* dhdb_path_cached (dhdb_path_cache_t *c, const char *path)
+{
+	uint32_t hash = _path_hash(path);
+	struct path_cache_entry *e = &c->entries[hash & c->mask];
+	int i;
+
+	if (e->path && e->hash == hash && !strcmp(e->path, path)) {
+		// Parents are checked first, so each node checked is still alive
+		for (i = 0; i < e->len; i++)
+			if (dhdb_generation(e->nodes[i]) != e->gens[i])
+				break;
+		if (i == e->len)
+			return e->found;
+	}
+
+	e->hash = hash;
+	_cache_resolve(c, e, path);
+	return e->found;
+}
+
+const char* dhdb_path_cached_str (dhdb_path_cache_t *c, const char *path)
+{
+	return dhdb_str(dhdb_path_cached(c, path));
+}
+
+double dhdb_path_cached_num (dhdb_path_cache_t *c, const char *path)
+{
+	return dhdb_num(dhdb_path_cached(c, path));
+}
+
+bool dhdb_path_cached_bool (dhdb_path_cache_t *c, const char *path)
+{
+	return dhdb_bool(dhdb_path_cached(c, path));
 }
@@ -24,6 +24,10 @@ typedef struct path_iter dhdb_path_iter_t;
 
 /* Configures the separator used by the dhdb path, default is '/' */
 void	dhdb_path_internal_set_separator	(char separator);
+/* Overrides the separator for the calling thread only, 0 removes the override */
+void	dhdb_path_internal_set_thread_separator	(char separator);
+/* Returns the separator in effect for the calling thread */
+char	dhdb_path_internal_separator		(void);
 
 /* Set element to a path, automatically creates required nodes if they are missing */
 dhdb_t*	dhdb_path_set		(dhdb_t *s, dhdb_t *v, const char *path, ...);
@@ -32,8 +36,42 @@ dhdb_t*	dhdb_path_set_num	(dhdb_t *s, double num, const char *path, ...);
 dhdb_t*	dhdb_path_set_bool	(dhdb_t *s, bool flag, const char *path, ...);
 dhdb_t*	dhdb_path_set_null	(dhdb_t *s, const char *path, ...);
 
-/* Returns path name of any node */
-const char*	dhdb_path_name	(dhdb_t *s);
+/*
+Cache of dhdb_path lookups from one root, for trees that change rarely
+- A hit is checked against the generations of the containers on the path
+- size is rounded up to a power of two, colliding paths replace each other
+- Paths are used as they are, not as printf formats
+- The root must outlive the cache
+*/
+typedef struct path_cache dhdb_path_cache_t;
+
+dhdb_path_cache_t*	dhdb_path_cache_create	(dhdb_t *s, int size);
+void			dhdb_path_cache_free	(dhdb_path_cache_t *c);
+dhdb_t*		dhdb_path_cached	(dhdb_path_cache_t *c, const char *path);
+const char*	dhdb_path_cached_str	(dhdb_path_cache_t *c, const char *path);
+double		dhdb_path_cached_num	(dhdb_path_cache_t *c, const char *path);
+bool		dhdb_path_cached_bool	(dhdb_path_cache_t *c, const char *path);
+
+/*
+Builder for loading many paths, such as a stream of flattened key/value pairs
+- Nodes of the previous path stay open, a path reuses the prefix it shares
+- Sorted input builds the tree in one pass without lookups from the root
+- Paths are used as they are, not as printf formats, values are taken over
+- Do not change the tree by other means while the builder is in use
+*/
+typedef struct path_builder dhdb_path_builder_t;
+
+dhdb_path_builder_t*	dhdb_path_builder_create	(dhdb_t *s);
+void			dhdb_path_builder_free		(dhdb_path_builder_t *b);
+dhdb_t*	dhdb_path_builder_set		(dhdb_path_builder_t *b, dhdb_t *v, const char *path);
+dhdb_t*	dhdb_path_builder_set_str	(dhdb_path_builder_t *b, const char *str, const char *path);
+dhdb_t*	dhdb_path_builder_set_num	(dhdb_path_builder_t *b, double num, const char *path);
+dhdb_t*	dhdb_path_builder_set_bool	(dhdb_path_builder_t *b, bool flag, const char *path);
+dhdb_t*	dhdb_path_builder_set_null	(dhdb_path_builder_t *b, const char *path);
+
+/* Returns path name of any node, in a buffer of the calling thread or in buf */
+const char*	dhdb_path_name		(dhdb_t *s);
+const char*	dhdb_path_name_r	(dhdb_t *s, char *buf, int size);	// Names that do not fit are left out from the root end
 
 /*
 Simple path API which returns dhdb_t* pointer for an exact match of the path
@@ -48,12 +86,25 @@ double		dhdb_path_num	(dhdb_t *s, const char *path, ...);
 bool		dhdb_path_bool	(dhdb_t *s, const char *path, ...);
 
 /*
-Advanced path API that flattens hierarchy and returns only leaf nodes
-- Provides its own iterator
-- Allows search with wildcards
+Looks up n paths at once, paths sharing a prefix walk it only once
+- out[i] is the match of paths[i] or NULL, returns the number of matches
+- Paths are used as they are, not as printf formats
+*/
+int		dhdb_path_get_many	(dhdb_t *s, const char **paths, dhdb_t **out, int n);
+
+/*
+Advanced path API for searching with patterns
+- Provides its own iterator, which walks the tree without collecting matches
+- * matches any child and ** any number of levels, including none
+- [a:b] selects array elements a to b - 1, [i] one element, negative
+  indices count from the end and a or b can be left out
+- [field op value] selects children whose field compares true, op is one
+  of = != < <= > >=, value a number, true, false, null or a string
+- Predicates right after a bracket narrow it down: items[price>10][sale=true]
+- Paths of only names and * return only leaf nodes, flattening containers
+- Returning numbers of a packed array unpacks it, like dhdb_at does
 - Slower than dhdb_path
 - Allows construction of path from varargs
-- TODO: Search of arrays with ranges
 */
 dhdb_t*	dhdb_path_pick_first_only	(dhdb_t *s, const char *path, ...);
 dhdb_t*	dhdb_path_pick_first		(dhdb_t *s, dhdb_path_iter_t **iter, const char *path, ...);
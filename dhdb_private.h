@@ -18,22 +18,124 @@
 #ifndef DHDB_PRIVATE_H
 #define DHDB_PRIVATE_H
 
+#include <stddef.h>
+
+#define DHDB_FLAG_LAZY		(1 << 0) // Container children are still unparsed in src
+#define DHDB_FLAG_RAW_NUM	(1 << 1) // src holds the unmodified source text of the number
+#define DHDB_FLAG_NUM_PENDING	(1 << 2) // num is not yet converted from src
+#define DHDB_FLAG_BORROWED_STR	(1 << 3) // str is not owned, copied before modification
+#define DHDB_FLAG_BORROWED_NAME	(1 << 4) // name is not owned
+#define DHDB_FLAG_IN_BLOCK	(1 << 5) // Node memory belongs to the block of a cloned root
+#define DHDB_FLAG_SHARED	(1 << 6) // Proxy that reads through to the shared node
+#define DHDB_FLAG_FROZEN	(1 << 7) // Proxy is read-only and never unshared
+#define DHDB_FLAG_WATCHED	(1 << 8) // Changes also bump the generation of watched parents
+#define DHDB_FLAG_PACKED	(1 << 9) // Array of numbers kept as doubles in str, without child nodes
+#define DHDB_FLAG_LAZY_ERROR	(1 << 10) // Lazy container failed to parse, see dhdb_json_lazy_error
+
+/* Kept in refs rather than flags, which concurrent readers may be reading */
+#define DHDB_REFS_RELEASED	(1u << 31) // Freed by its owner, kept alive by proxies
+
 struct dhdbValue
 {
 	uint8_t type;
+	uint8_t lazy_opts;	// Parse options while lazy, then the error if any
+	uint16_t flags;
+	uint32_t gen;		// Bumped when the node or its children change
 
 	char *str;
+	int str_len;
+	int str_cap;
 	double num;
 	int array_len;
-	char *name;
-
 	uint32_t index;
+	char *name;
 
 	struct dhdbValue *first_child;
 	struct dhdbValue *last_child;
 	struct dhdbValue *next;
 	struct dhdbValue *prev;
 	struct dhdbValue *parent;
+
+	const char *src;	// Source text, or where a lazy parse failed
+	int src_len;
+	uint32_t refs; // Proxies pointing here, changed atomically
+
+	struct dhdbValue *shared;
+	struct dhdbValue *block;	// Clone root owning the memory when IN_BLOCK
+	struct dhdbShape *shape;	// Shared member names of the object, or NULL
+};
+
+/*
+ * Key sequence shared by objects with the same members in the same
+ * order. Member names point to the keys, and slots map a key to its
+ * position for dhdb_by. Adding or removing a member gives the object
+ * names of its own again.
+ */
+struct dhdbShape
+{
+	uint32_t refs;
+	uint32_t id;		// Never reused, unlike the address
+	uint32_t hash;		// Of the key sequence, see dhdb_internal_shape_hash
+	int len;
+	int mask;
+	char **keys;
+	int *slots;		// Positions by case-insensitive key hash, -1 when free
 };
 
+/* Output buffer of the serializers, grows unless it is the caller's */
+struct dhdbOut
+{
+	char *buf;
+	int len;	// Bytes produced, more than fit when the buffer is fixed
+	int cap;
+	bool fixed;
+};
+
+void	dhdb_internal_out_add		(struct dhdbOut *o, const char *str, int len);
+void	dhdb_internal_out_str		(struct dhdbOut *o, const char *str);
+void	dhdb_internal_out_printf	(struct dhdbOut *o, const char *fmt, ...);
+
+/* Set by the module that creates lazy nodes, parses s->src into children of s */
+extern void (*dhdb_internal_materialize)(dhdb_t *s);
+
+/* Returns the node a copy-on-write proxy reads through to, or s itself */
+dhdb_t*	dhdb_internal_resolve		(dhdb_t *s);
+/* Numbers of a packed array s, or NULL when s is not packed */
+const double* dhdb_internal_packed	(dhdb_t *s, int *len);
+/* Makes the proxies of s read-only so that concurrent readers never modify s */
+void	dhdb_internal_freeze		(dhdb_t *s);
+
+/* Like dhdb_set_str and dhdb_set_obj, but str and field must outlive the node */
+void	dhdb_internal_set_str_borrowed	(dhdb_t *s, int len, const char *str);
+dhdb_t*	dhdb_internal_set_obj_borrowed	(dhdb_t *s, const char *field, dhdb_t *v);
+
+/* Shapes for objects, created with one reference for the caller */
+struct dhdbShape* dhdb_internal_shape_create	(dhdb_t *s);
+void	dhdb_internal_shape_release	(struct dhdbShape *sh);
+uint32_t dhdb_internal_shape_hash	(dhdb_t *s);
+bool	dhdb_internal_shape_match	(struct dhdbShape *sh, dhdb_t *s);
+/* Members of s must match sh, their names become the keys of sh */
+void	dhdb_internal_set_shape		(dhdb_t *s, struct dhdbShape *sh);
+
+/* Deep copy into one block, used by the parallel clone of dhdb_par */
+void	dhdb_internal_measure		(dhdb_t *s, bool root, bool deep, int *count,
+	    size_t *bytes);
+dhdb_t*	dhdb_internal_clone_run		(dhdb_t *s, int len, bool deep, dhdb_t *parent,
+	    dhdb_t **nodes, char **chars);
+uint32_t dhdb_internal_node_size	(dhdb_t *s);
+
+/*
+ * Names of a dhdb_path pattern like items/ * /price, NULL for each *, in
+ * an array of len. The caller frees the names and the array.
+ */
+char**	dhdb_internal_pattern		(const char *pattern, int *len);
+
+/* Pieces of dhdb_to_json for a container s, members are its children in order */
+void	dhdb_internal_json_open		(struct dhdbOut *o, dhdb_t *s, bool pretty);
+void	dhdb_internal_json_member	(struct dhdbOut *o, dhdb_t *n, bool pretty);
+void	dhdb_internal_json_close	(struct dhdbOut *o, dhdb_t *s, bool pretty);
+/* Adds the values in str to the array s, returns the error or NULL */
+const char* dhdb_internal_json_parse_values(dhdb_t *s, const char *str, int len,
+	    int opts, int *err_col);
+
 #endif
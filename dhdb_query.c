@@ -0,0 +1,598 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_query.h"
+#include "dhdb_path.h"
+#include "dhdb_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#define BATCH_SIZE		256
+#define MAX_QUERY_PATH		256	// Same as the varargs paths of dhdb_path
+
+/*
+ * With conditions records come from a dhdb_path_pick iterator over
+ * "[cond][cond]...", so filtering happens as they are read. A batch of
+ * records is then run through each stage a column at a time: fields are
+ * looked up for the whole batch, group keys resolved, and every
+ * aggregate updated in a loop of its own.
+ */
+struct field
+{
+	char *name;
+	dhdb_lookup_cache_t cache;	// Zeroed by each run
+};
+
+struct agg
+{
+	int fn;
+	struct field field;	// name is NULL for counting records
+	char *as;
+};
+
+struct order
+{
+	char *field;
+	bool desc;
+};
+
+struct acc
+{
+	double count;
+	double sum;
+	double min;
+	double max;
+};
+
+/* Result row, seq keeps sorting stable */
+struct row
+{
+	dhdb_query_t *q;
+	dhdb_t *row;
+	int seq;
+};
+
+struct group
+{
+	dhdb_t *key;		// Group field of the first record, or NULL
+	uint32_t hash;
+};
+
+struct dhdbQuery
+{
+	dhdb_t *root;
+	char *records;
+	char path[MAX_QUERY_PATH];
+	int path_len;
+
+	struct field *select;
+	int num_select;
+	struct field group_by;
+	struct agg *aggs;
+	int num_aggs;
+	struct order *order;
+	int num_order;
+	int limit;
+
+	/* State of a run */
+	struct group *groups;
+	int num_groups;
+	int cap_groups;
+	int *slots;		// Index of a group plus one, 0 for empty
+	uint32_t mask;
+	struct acc *accs;	// num_aggs for each group
+	struct row *rows;
+	int num_rows;
+	int cap_rows;
+	dhdb_t *scratch[BATCH_SIZE];	// Stand-ins for packed records
+};
+
+static dhdb_t* _field(dhdb_t *, struct field *);
+static bool _key_equal(dhdb_t *, dhdb_t *);
+static uint32_t _key_hash(dhdb_t *);
+static int _group(dhdb_query_t *, dhdb_t *);
+static void _grow_groups(dhdb_query_t *);
+static void _accumulate(dhdb_query_t *, dhdb_t **, int *, int);
+static void _project(dhdb_query_t *, dhdb_t **, int);
+static void _add_row(dhdb_query_t *, dhdb_t *);
+static dhdb_t* _result(dhdb_query_t *, struct acc *, dhdb_t *);
+static int _row_cmp(const void *, const void *);
+static int _value_cmp(dhdb_t *, dhdb_t *);
+static void _reset(dhdb_query_t *);
+
+dhdb_query_t*
+dhdb_query_create(dhdb_t *root, const char *records)
+{
+	dhdb_query_t *q;
+
+	assert(root);
+	assert(records);
+
+	q = calloc(1, sizeof(*q));
+	assert(q);
+	q->root = root;
+	q->records = strdup(records);
+	q->limit = -1;
+	return q;
+}
+
+void
+dhdb_query_free(dhdb_query_t *q)
+{
+	int i;
+
+	if (q == NULL)
+		return;
+
+	_reset(q);
+	for (i = 0; i < q->num_select; i++)
+		free(q->select[i].name);
+	for (i = 0; i < q->num_aggs; i++) {
+		free(q->aggs[i].field.name);
+		free(q->aggs[i].as);
+	}
+	for (i = 0; i < q->num_order; i++)
+		free(q->order[i].field);
+	for (i = 0; i < BATCH_SIZE; i++)
+		dhdb_free(q->scratch[i]);
+	free(q->select);
+	free(q->aggs);
+	free(q->order);
+	free(q->group_by.name);
+	free(q->records);
+	free(q);
+}
+
+bool
+dhdb_query_where(dhdb_query_t *q, const char *cond)
+{
+	int len;
+
+	len = snprintf(&q->path[q->path_len], sizeof(q->path) - q->path_len,
+	    "[%s]", cond);
+	if (len >= sizeof(q->path) - q->path_len) {
+		q->path[q->path_len] = '\0';
+		return false;
+	}
+	q->path_len += len;
+	return true;
+}
+
+void
+dhdb_query_select(dhdb_query_t *q, const char *field)
+{
+	q->select = realloc(q->select,
+	    (q->num_select + 1) * sizeof(struct field));
+	assert(q->select);
+	q->select[q->num_select++].name = strdup(field);
+}
+
+void
+dhdb_query_group_by(dhdb_query_t *q, const char *field)
+{
+	free(q->group_by.name);
+	q->group_by.name = strdup(field);
+}
+
+void
+dhdb_query_agg(dhdb_query_t *q, int fn, const char *field, const char *as)
+{
+	static const char *names[] = { "count", "sum", "min", "max", "avg" };
+	struct agg *a;
+
+	assert(fn >= DHDB_QUERY_COUNT && fn <= DHDB_QUERY_AVG);
+	assert(field || fn == DHDB_QUERY_COUNT);
+
+	q->aggs = realloc(q->aggs, (q->num_aggs + 1) * sizeof(struct agg));
+	assert(q->aggs);
+	a = &q->aggs[q->num_aggs++];
+	a->fn = fn;
+	a->field.name = field ? strdup(field) : NULL;
+	if (as)
+		a->as = strdup(as);
+	else if (field) {
+		a->as = malloc(strlen(names[fn]) + strlen(field) + 2);
+		assert(a->as);
+		sprintf(a->as, "%s_%s", names[fn], field);
+	} else
+		a->as = strdup(names[fn]);
+}
+
+void
+dhdb_query_order_by(dhdb_query_t *q, const char *field, bool desc)
+{
+	q->order = realloc(q->order, (q->num_order + 1) * sizeof(struct order));
+	assert(q->order);
+	q->order[q->num_order].field = strdup(field);
+	q->order[q->num_order++].desc = desc;
+}
+
+void
+dhdb_query_limit(dhdb_query_t *q, int limit)
+{
+	q->limit = limit;
+}
+
+dhdb_t*
+dhdb_query_run(dhdb_query_t *q)
+{
+	dhdb_path_iter_t *it = NULL;
+	dhdb_t *records, *rows, *n, *batch[BATCH_SIZE];
+	const double *nums;
+	int i, len, pos, num_len, groups[BATCH_SIZE];
+
+	records = dhdb_path(q->root, "%s", q->records);
+	if (records == NULL)
+		return NULL;
+
+	_reset(q);
+	if (q->num_aggs > 0 && q->group_by.name == NULL)
+		(void) _group(q, NULL);	// One group for all records
+
+	/*
+	 * Numbers of a packed array are read into scratch nodes, which
+	 * rows get copies of, so that the array stays packed.
+	 */
+	n = NULL;
+	pos = num_len = 0;
+	nums = q->path_len ? NULL : dhdb_internal_packed(records, &num_len);
+	if (q->path_len)
+		n = dhdb_path_pick_first(records, &it, "%s", q->path);
+	else if (nums == NULL)
+		n = dhdb_first(records);
+	while ((n || pos < num_len) && (q->limit < 0 || q->num_order ||
+	    q->num_aggs || q->group_by.name || q->num_rows < q->limit)) {
+		for (len = 0; n && len < BATCH_SIZE;
+		    n = it ? dhdb_path_pick_next(it) : dhdb_next(n))
+			batch[len++] = n;
+		for (; pos < num_len && len < BATCH_SIZE; pos++, len++) {
+			if (q->scratch[len] == NULL)
+				q->scratch[len] = dhdb_create();
+			dhdb_set_num(q->scratch[len], nums[pos]);
+			batch[len] = q->scratch[len];
+		}
+
+		if (q->num_aggs == 0 && q->group_by.name == NULL) {
+			_project(q, batch, len);
+			continue;
+		}
+		if (q->group_by.name) {
+			for (i = 0; i < len; i++)
+				groups[i] = _group(q, _field(batch[i], &q->group_by));
+		} else
+			memset(groups, 0, len * sizeof(int));
+		_accumulate(q, batch, groups, len);
+	}
+	if (it)
+		dhdb_path_pick_free(&it);
+
+	for (i = 0; i < q->num_groups; i++)
+		_add_row(q, _result(q, &q->accs[i * q->num_aggs],
+		    q->groups[i].key));
+	if (q->num_order && q->num_rows)
+		qsort(q->rows, q->num_rows, sizeof(struct row), _row_cmp);
+
+	rows = dhdb_set_array(dhdb_create());
+	for (i = 0; i < q->num_rows; i++) {
+		if (q->limit < 0 || i < q->limit)
+			dhdb_add(rows, q->rows[i].row);
+		else
+			dhdb_free(q->rows[i].row);
+	}
+	q->num_rows = 0;
+	return rows;
+}
+
+/* Records of the same shape have their fields in the same positions */
+static dhdb_t*
+_field(dhdb_t *rec, struct field *f)
+{
+	return dhdb_by_cached(rec, f->name, &f->cache);
+}
+
+/* Group keys compare by type and value, missing fields group together */
+static bool
+_key_equal(dhdb_t *a, dhdb_t *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	if (dhdb_type(a) != dhdb_type(b))
+		return false;
+
+	switch (dhdb_type(a)) {
+	case DHDB_VALUE_NUMBER:
+	case DHDB_VALUE_BOOL:
+		return dhdb_num(a) == dhdb_num(b);
+	case DHDB_VALUE_STRING:
+		return !strcmp(dhdb_str(a), dhdb_str(b));
+	case DHDB_VALUE_NULL:
+	case DHDB_VALUE_UNDEFINED:
+		return true;
+	default:
+		return dhdb_equal(a, b);
+	}
+}
+
+static uint32_t
+_key_hash(dhdb_t *s)
+{
+	uint64_t bits;
+	uint32_t h;
+	const char *str;
+	double num;
+
+	if (s == NULL)
+		return 0;
+
+	switch (dhdb_type(s)) {
+	case DHDB_VALUE_NUMBER:
+	case DHDB_VALUE_BOOL:
+		num = dhdb_num(s) == 0 ? 0 : dhdb_num(s);
+		memcpy(&bits, &num, sizeof(bits));
+		bits ^= bits >> 33;
+		bits *= 0xff51afd7ed558ccdULL;
+		bits ^= bits >> 33;
+		return (uint32_t) bits + dhdb_type(s);
+	case DHDB_VALUE_STRING:
+		h = 2166136261u;
+		for (str = dhdb_str(s); *str; str++)
+			h = (h ^ (uint8_t) *str) * 16777619u;
+		return h;
+	default:
+		return dhdb_type(s);
+	}
+}
+
+static int
+_group(dhdb_query_t *q, dhdb_t *key)
+{
+	struct acc *a;
+	uint32_t h, hash;
+	int i, g;
+
+	hash = _key_hash(key);
+	for (h = hash & q->mask; q->slots && (g = q->slots[h]); h = (h + 1) & q->mask)
+		if (q->groups[g - 1].hash == hash &&
+		    _key_equal(q->groups[g - 1].key, key))
+			return g - 1;
+
+	if (q->num_groups * 2 >= (int) q->mask) {
+		_grow_groups(q);
+		for (h = hash & q->mask; q->slots[h]; h = (h + 1) & q->mask)
+			;
+	}
+
+	g = q->num_groups++;
+	q->groups[g].key = key;
+	q->groups[g].hash = hash;
+	q->slots[h] = g + 1;
+
+	a = &q->accs[g * q->num_aggs];
+	for (i = 0; i < q->num_aggs; i++) {
+		a[i].count = 0;
+		a[i].sum = 0;
+		a[i].min = INFINITY;
+		a[i].max = -INFINITY;
+	}
+	return g;
+}
+
+static void
+_grow_groups(dhdb_query_t *q)
+{
+	uint32_t size, h;
+	int g;
+
+	size = q->mask ? (q->mask + 1) * 2 : 64;
+	free(q->slots);
+	q->slots = calloc(size, sizeof(int));
+	assert(q->slots);
+	q->mask = size - 1;
+	for (g = 0; g < q->num_groups; g++) {
+		for (h = q->groups[g].hash & q->mask; q->slots[h];
+		    h = (h + 1) & q->mask)
+			;
+		q->slots[h] = g + 1;
+	}
+
+	q->cap_groups = size / 2;
+	q->groups = realloc(q->groups, q->cap_groups * sizeof(struct group));
+	q->accs = realloc(q->accs,
+	    (q->cap_groups * q->num_aggs + 1) * sizeof(struct acc));
+	assert(q->groups && q->accs);
+}
+
+/* Each aggregate reads its column of the batch, then updates the groups */
+static void
+_accumulate(dhdb_query_t *q, dhdb_t **batch, int *groups, int len)
+{
+	double values[BATCH_SIZE];
+	struct agg *agg;
+	struct acc *a;
+	dhdb_t *n;
+	int i, j;
+
+	for (j = 0; j < q->num_aggs; j++) {
+		agg = &q->aggs[j];
+		for (i = 0; i < len; i++) {
+			if (agg->field.name == NULL) {
+				values[i] = 0;
+				continue;
+			}
+			n = _field(batch[i], &agg->field);
+			if (agg->fn == DHDB_QUERY_COUNT)
+				values[i] = n && dhdb_type(n) != DHDB_VALUE_NULL ? 0 : NAN;
+			else
+				values[i] = n && dhdb_type(n) == DHDB_VALUE_NUMBER ?
+				    dhdb_num(n) : NAN;
+		}
+
+		for (i = 0; i < len; i++) {
+			if (isnan(values[i]))
+				continue;
+			a = &q->accs[groups[i] * q->num_aggs + j];
+			a->count++;
+			a->sum += values[i];
+			if (values[i] < a->min)
+				a->min = values[i];
+			if (values[i] > a->max)
+				a->max = values[i];
+		}
+	}
+}
+
+static void
+_project(dhdb_query_t *q, dhdb_t **batch, int len)
+{
+	dhdb_t *row, *n;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		if (q->num_select == 0) {
+			_add_row(q, dhdb_create_from(batch[i]));
+			continue;
+		}
+		row = dhdb_set_object(dhdb_create());
+		for (j = 0; j < q->num_select; j++) {
+			n = _field(batch[i], &q->select[j]);
+			dhdb_append_obj(row, q->select[j].name,
+			    n ? dhdb_create_from(n) : dhdb_create_null());
+		}
+		_add_row(q, row);
+	}
+}
+
+static void
+_add_row(dhdb_query_t *q, dhdb_t *row)
+{
+	if (q->num_rows == q->cap_rows) {
+		q->cap_rows = q->cap_rows ? q->cap_rows * 2 : BATCH_SIZE;
+		q->rows = realloc(q->rows, q->cap_rows * sizeof(struct row));
+		assert(q->rows);
+	}
+	q->rows[q->num_rows].q = q;
+	q->rows[q->num_rows].row = row;
+	q->rows[q->num_rows].seq = q->num_rows;
+	q->num_rows++;
+}
+
+static dhdb_t*
+_result(dhdb_query_t *q, struct acc *a, dhdb_t *key)
+{
+	dhdb_t *row, *v;
+	int i;
+
+	row = dhdb_set_object(dhdb_create());
+	if (q->group_by.name)
+		dhdb_append_obj(row, q->group_by.name,
+		    key ? dhdb_create_from(key) : dhdb_create_null());
+
+	for (i = 0; i < q->num_aggs; i++) {
+		if (q->aggs[i].fn == DHDB_QUERY_COUNT)
+			v = dhdb_create_num(a[i].count);
+		else if (a[i].count == 0 && q->aggs[i].fn != DHDB_QUERY_SUM)
+			v = dhdb_create_null();
+		else if (q->aggs[i].fn == DHDB_QUERY_SUM)
+			v = dhdb_create_num(a[i].sum);
+		else if (q->aggs[i].fn == DHDB_QUERY_MIN)
+			v = dhdb_create_num(a[i].min);
+		else if (q->aggs[i].fn == DHDB_QUERY_MAX)
+			v = dhdb_create_num(a[i].max);
+		else
+			v = dhdb_create_num(a[i].sum / a[i].count);
+		dhdb_append_obj(row, q->aggs[i].as, v);
+	}
+	return row;
+}
+
+static int
+_row_cmp(const void *a, const void *b)
+{
+	const struct row *x = a, *y = b;
+	dhdb_query_t *q = x->q;
+	int i, r;
+
+	for (i = 0; i < q->num_order; i++) {
+		r = _value_cmp(dhdb_by(x->row, q->order[i].field),
+		    dhdb_by(y->row, q->order[i].field));
+		if (r)
+			return q->order[i].desc ? -r : r;
+	}
+	return x->seq - y->seq;
+}
+
+/* Missing values and nulls first, then by type and value */
+static int
+_value_cmp(dhdb_t *a, dhdb_t *b)
+{
+	uint8_t ta, tb;
+	double x, y;
+
+	ta = a ? dhdb_type(a) : DHDB_VALUE_UNDEFINED;
+	tb = b ? dhdb_type(b) : DHDB_VALUE_UNDEFINED;
+	if (ta == DHDB_VALUE_NULL)
+		ta = DHDB_VALUE_UNDEFINED;
+	if (tb == DHDB_VALUE_NULL)
+		tb = DHDB_VALUE_UNDEFINED;
+	if (ta != tb)
+		return ta < tb ? -1 : 1;
+
+	switch (ta) {
+	case DHDB_VALUE_NUMBER:
+	case DHDB_VALUE_BOOL:
+		x = dhdb_num(a);
+		y = dhdb_num(b);
+		return x < y ? -1 : x > y;
+	case DHDB_VALUE_STRING:
+		return strcmp(dhdb_str(a), dhdb_str(b));
+	default:
+		return 0;
+	}
+}
+
+static void
+_reset(dhdb_query_t *q)
+{
+	int i;
+
+	/* The caches may point into records freed since the last run */
+	for (i = 0; i < q->num_select; i++)
+		memset(&q->select[i].cache, 0, sizeof(dhdb_lookup_cache_t));
+	for (i = 0; i < q->num_aggs; i++)
+		memset(&q->aggs[i].field.cache, 0, sizeof(dhdb_lookup_cache_t));
+	memset(&q->group_by.cache, 0, sizeof(dhdb_lookup_cache_t));
+
+	free(q->groups);
+	free(q->slots);
+	free(q->accs);
+	q->groups = NULL;
+	q->slots = NULL;
+	q->accs = NULL;
+	q->num_groups = 0;
+	q->cap_groups = 0;
+	q->mask = 0;
+
+	for (; q->num_rows > 0; q->num_rows--)
+		dhdb_free(q->rows[q->num_rows - 1].row);
+	free(q->rows);
+	q->rows = NULL;
+	q->cap_rows = 0;
+}
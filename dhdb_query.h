@@ -0,0 +1,58 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_QUERY_H__
+#define __DHDB_QUERY_H__
+
+#include "dhdb.h"
+
+#define DHDB_QUERY_COUNT	0
+#define DHDB_QUERY_SUM		1
+#define DHDB_QUERY_MIN		2
+#define DHDB_QUERY_MAX		3
+#define DHDB_QUERY_AVG		4
+
+/*
+Queries over an array or object of records, built up call by call
+- Records are the children of the node at path records in dhdb_path
+  syntax, conditions are predicates of dhdb_path_pick, such as "price > 10"
+- Records are read in batches, each batch is filtered, grouped and
+  aggregated before the next is read
+- Without aggregates rows are copies of the records or of the selected
+  fields, with them one row per group with the group field and results
+- count counts records, or with a field the records where it is not
+  null, the others use numbers only and give null if there are none
+- Results are named as, or like count, sum_price and avg_price
+- Order by a field of the result rows, later calls break ties
+- Returns an array of result rows, NULL if records is not found
+*/
+typedef struct dhdbQuery dhdb_query_t;
+
+dhdb_query_t*	dhdb_query_create	(dhdb_t *root, const char *records);
+void		dhdb_query_free		(dhdb_query_t *q);
+
+bool		dhdb_query_where	(dhdb_query_t *q, const char *cond);	// false when too long, cond is left out
+void		dhdb_query_select	(dhdb_query_t *q, const char *field);
+void		dhdb_query_group_by	(dhdb_query_t *q, const char *field);
+void		dhdb_query_agg		(dhdb_query_t *q, int fn, const char *field,
+		    const char *as);	// field can be NULL for count
+void		dhdb_query_order_by	(dhdb_query_t *q, const char *field, bool desc);
+void		dhdb_query_limit	(dhdb_query_t *q, int limit);
+
+dhdb_t*		dhdb_query_run		(dhdb_query_t *q);
+
+#endif
@@ -0,0 +1,175 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_store.h"
+#include "dhdb_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Epoch based reclamation. Every publish bumps the global epoch and
+ * retires the previous root with the epoch it was current in. A reader
+ * announces the epoch it entered before loading the root, so a retired
+ * root can be freed once every active reader has entered a later epoch.
+ * Epoch 0 marks an idle reader slot.
+ */
+#define CACHE_LINE		64
+
+struct readerSlot
+{
+	uint64_t epoch;
+	char pad[CACHE_LINE - sizeof(uint64_t)];
+};
+
+struct retired
+{
+	dhdb_t *root;
+	uint64_t epoch;
+	struct retired *next;
+};
+
+struct dhdbStore
+{
+	dhdb_t *current;
+	uint64_t epoch;
+	uint32_t num_readers;
+	struct retired *retired;
+	struct readerSlot readers[DHDB_STORE_MAX_READERS];
+};
+
+static void _reclaim(dhdb_store_t *);
+
+dhdb_store_t*
+dhdb_store_create(dhdb_t *root)
+{
+	dhdb_store_t *st;
+
+	assert(root);
+
+	if (posix_memalign((void **) &st, CACHE_LINE, sizeof(*st)))
+		return NULL;
+	memset(st, 0, sizeof(*st));
+	st->current = root;
+	st->epoch = 1;
+	return st;
+}
+
+void
+dhdb_store_free(dhdb_store_t *st)
+{
+	struct retired *r, *next;
+
+	for (r = st->retired; r; r = next) {
+		next = r->next;
+		dhdb_free(r->root);
+		free(r);
+	}
+	dhdb_free(st->current);
+	free(st);
+}
+
+int
+dhdb_store_register(dhdb_store_t *st)
+{
+	uint32_t id;
+
+	id = __atomic_fetch_add(&st->num_readers, 1, __ATOMIC_RELAXED);
+	if (id >= DHDB_STORE_MAX_READERS)
+		return -1;
+	return id;
+}
+
+dhdb_t*
+dhdb_store_pin(dhdb_store_t *st, int reader)
+{
+	uint64_t epoch;
+
+	assert(reader >= 0 && reader < DHDB_STORE_MAX_READERS);
+
+	epoch = __atomic_load_n(&st->epoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&st->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&st->current, __ATOMIC_SEQ_CST);
+}
+
+void
+dhdb_store_unpin(dhdb_store_t *st, int reader)
+{
+	__atomic_store_n(&st->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+dhdb_t*
+dhdb_store_begin(dhdb_store_t *st)
+{
+	return dhdb_create_shared(st->current);
+}
+
+void
+dhdb_store_publish(dhdb_store_t *st, dhdb_t *v)
+{
+	struct retired *r;
+
+	assert(v);
+	assert(dhdb_parent(v) == NULL);
+
+	dhdb_internal_freeze(v);
+
+	r = malloc(sizeof(*r));
+	assert(r);
+	r->root = __atomic_exchange_n(&st->current, v, __ATOMIC_SEQ_CST);
+	r->epoch = __atomic_fetch_add(&st->epoch, 1, __ATOMIC_SEQ_CST);
+	r->next = st->retired;
+	st->retired = r;
+
+	_reclaim(st);
+}
+
+uint64_t
+dhdb_store_version(dhdb_store_t *st)
+{
+	return __atomic_load_n(&st->epoch, __ATOMIC_ACQUIRE);
+}
+
+/* Frees retired roots that no reader can still be reading */
+static void
+_reclaim(dhdb_store_t *st)
+{
+	struct retired **rp, *r;
+	uint64_t oldest, epoch;
+	uint32_t i, n;
+
+	oldest = UINT64_MAX;
+	n = __atomic_load_n(&st->num_readers, __ATOMIC_RELAXED);
+	if (n > DHDB_STORE_MAX_READERS)
+		n = DHDB_STORE_MAX_READERS;
+	for (i = 0; i < n; i++) {
+		epoch = __atomic_load_n(&st->readers[i].epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	rp = &st->retired;
+	while ((r = *rp)) {
+		if (r->epoch < oldest) {
+			*rp = r->next;
+			dhdb_free(r->root);
+			free(r);
+		} else
+			rp = &r->next;
+	}
+}
@@ -0,0 +1,49 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_STORE_H__
+#define __DHDB_STORE_H__
+
+#include "dhdb.h"
+
+/*
+Versioned store for one writer and many concurrent readers
+- Published versions are immutable, readers never take a lock
+- The writer edits a copy-on-write variant of the current version and
+  publishes it atomically, only the modified paths get copied
+- Old versions are freed once no reader has them pinned
+- Trees must not use lazy parsing, raw numbers or packed arrays, since
+  those modify nodes on read
+*/
+typedef struct dhdbStore dhdb_store_t;
+
+#define DHDB_STORE_MAX_READERS	64
+
+dhdb_store_t*	dhdb_store_create	(dhdb_t *root);	// Takes ownership of root
+void		dhdb_store_free		(dhdb_store_t *st);
+
+/* Readers, each thread registers once and reads between pin and unpin */
+int		dhdb_store_register	(dhdb_store_t *st);	// Reader id or -1 when full
+dhdb_t*		dhdb_store_pin		(dhdb_store_t *st, int reader);
+void		dhdb_store_unpin	(dhdb_store_t *st, int reader);
+
+/* Writer, publish or dhdb_free the tree returned by begin */
+dhdb_t*		dhdb_store_begin	(dhdb_store_t *st);
+void		dhdb_store_publish	(dhdb_store_t *st, dhdb_t *v);
+uint64_t	dhdb_store_version	(dhdb_store_t *st);
+
+#endif
@@ -0,0 +1,498 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_tape.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#ifndef __USE_BSD
+#define __USE_BSD
+#endif
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/*
+ * Tape layout, one uint64_t per entry, tag in the topmost byte:
+ *
+ *   object/array	[TYPE|index past END] [COUNT|members] ... [END]
+ *   object member	[KEY|string offset] <value>
+ *   number		[NUMBER] [raw double bits]
+ *   string		[STRING|string offset]
+ *   bool		[BOOL|0 or 1]
+ *   null		[NULL]
+ *
+ * Entry 0 is reserved so that position 0 can mean "not found". Positions
+ * of object members point to the KEY entry, the value follows it.
+ */
+#define TAPE_KEY		16
+#define TAPE_COUNT		17
+#define TAPE_END		18
+
+#define TAPE_PAYLOAD_MASK	0x00ffffffffffffffULL
+#define TAPE_TAG(e)		((uint8_t) ((e) >> 56))
+#define TAPE_PAYLOAD(e)		((e) & TAPE_PAYLOAD_MASK)
+#define TAPE_ENTRY(tag, p)	(((uint64_t) (tag) << 56) | ((uint64_t) (p)))
+
+#define TAPE_ALLOC_BLOCK	256
+#define TAPE_MAX_DEPTH		1024
+
+struct dhdbTape
+{
+	uint64_t *tape;
+	uint32_t len;
+	uint32_t cap;
+
+	char *strings;
+	uint32_t strings_len;
+	uint32_t strings_cap;
+};
+
+static const char *_parse_error[] = {
+	"Successful", "Expected ':'", "Unknown type",
+	"Expected digit or '.'", "Closing quote not found", "Expected string",
+	"Expected ',' or end of container", "Too deeply nested",
+	"Unexpected data after root value"
+};
+
+static uint32_t
+_emit(dhdb_tape_t *t, uint64_t entry)
+{
+	if (t->len == t->cap) {
+		t->cap *= 2;
+		t->tape = realloc(t->tape, t->cap * sizeof(uint64_t));
+		assert(t->tape);
+	}
+	t->tape[t->len] = entry;
+	return t->len++;
+}
+
+static uint32_t
+_emit_str(dhdb_tape_t *t, const char *str, int len)
+{
+	uint32_t offset;
+
+	while (t->strings_len + len + 1 > t->strings_cap) {
+		t->strings_cap *= 2;
+		t->strings = realloc(t->strings, t->strings_cap);
+		assert(t->strings);
+	}
+	offset = t->strings_len;
+	memcpy(&t->strings[offset], str, len);
+	t->strings[offset + len] = 0;
+	t->strings_len += len + 1;
+	return offset;
+}
+
+static int
+_skip_space(const char *str, int i)
+{
+	while (isspace(str[i]))
+		i++;
+	return i;
+}
+
+/* Returns index of the closing quote or -1 */
+static int
+_scan_str(const char *str, int i)
+{
+	for (; str[i]; i++) {
+		if (str[i] == '\\' && str[i + 1])
+			i++;
+		else if (str[i] == '\"')
+			return i;
+	}
+	return -1;
+}
+
+/* Parses a scalar starting at str[i], returns index past it or -1 */
+static int
+_parse_scalar(dhdb_tape_t *t, const char *str, int i, int *err_code)
+{
+	int end;
+	double num;
+	char *p;
+
+	if (str[i] == '\"') {
+		end = _scan_str(str, i + 1);
+		if (end < 0) {
+			*err_code = 4;
+			return -1;
+		}
+		_emit(t, TAPE_ENTRY(DHDB_VALUE_STRING,
+		    _emit_str(t, &str[i + 1], end - i - 1)));
+		return end + 1;
+	}
+	if (isdigit(str[i]) || str[i] == '-') {
+		num = strtod(&str[i], &p);
+		if (p == &str[i]) {
+			*err_code = 3;
+			return -1;
+		}
+		_emit(t, TAPE_ENTRY(DHDB_VALUE_NUMBER, 0));
+		_emit(t, 0);
+		memcpy(&t->tape[t->len - 1], &num, sizeof(num));
+		return p - str;
+	}
+	if (!strncmp(&str[i], "true", 4)) {
+		_emit(t, TAPE_ENTRY(DHDB_VALUE_BOOL, 1));
+		return i + 4;
+	}
+	if (!strncmp(&str[i], "false", 5)) {
+		_emit(t, TAPE_ENTRY(DHDB_VALUE_BOOL, 0));
+		return i + 5;
+	}
+	if (!strncmp(&str[i], "null", 4)) {
+		_emit(t, TAPE_ENTRY(DHDB_VALUE_NULL, 0));
+		return i + 4;
+	}
+	*err_code = 2;
+	return -1;
+}
+
+/*
+ * Iterative parser: containers are kept on an explicit stack and
+ * patched with their end position and member count when they close.
+ */
+static int
+_parse(dhdb_tape_t *t, const char *str, int *err_code)
+{
+	uint32_t stack[TAPE_MAX_DEPTH];
+	int depth = 0, i = 0, end;
+	uint8_t type;
+
+	i = _skip_space(str, i);
+	for (;;) {
+		/* Value */
+		if (str[i] == '{' || str[i] == '[') {
+			if (depth == TAPE_MAX_DEPTH) {
+				*err_code = 7;
+				return i;
+			}
+			type = (str[i] == '{') ? DHDB_VALUE_OBJECT :
+			    DHDB_VALUE_ARRAY;
+			stack[depth++] = _emit(t, TAPE_ENTRY(type, 0));
+			_emit(t, TAPE_ENTRY(TAPE_COUNT, 0));
+			i = _skip_space(str, i + 1);
+			if (str[i] != (type == DHDB_VALUE_OBJECT ? '}' : ']')) {
+				t->tape[stack[depth - 1] + 1]++;
+				if (type == DHDB_VALUE_OBJECT)
+					goto key;
+				continue;
+			}
+		} else {
+			end = _parse_scalar(t, str, i, err_code);
+			if (end < 0)
+				return i;
+			i = end;
+			goto after_value;
+		}
+
+		/* Closing of a container, possibly several in a row */
+		for (;;) {
+			_emit(t, TAPE_ENTRY(TAPE_END, 0));
+			depth--;
+			t->tape[stack[depth]] |= t->len;
+			i++;
+after_value:
+			i = _skip_space(str, i);
+			if (depth == 0) {
+				if (str[i]) {
+					*err_code = 8;
+					return i;
+				}
+				return 0;
+			}
+			type = TAPE_TAG(t->tape[stack[depth - 1]]);
+			if (str[i] == '}' && type == DHDB_VALUE_OBJECT)
+				continue;
+			if (str[i] == ']' && type == DHDB_VALUE_ARRAY)
+				continue;
+			if (str[i] != ',') {
+				*err_code = 6;
+				return i;
+			}
+			t->tape[stack[depth - 1] + 1]++;
+			i = _skip_space(str, i + 1);
+			if (type == DHDB_VALUE_ARRAY)
+				break;
+key:
+			if (str[i] != '\"') {
+				*err_code = 5;
+				return i;
+			}
+			end = _scan_str(str, i + 1);
+			if (end < 0) {
+				*err_code = 4;
+				return i;
+			}
+			_emit(t, TAPE_ENTRY(TAPE_KEY,
+			    _emit_str(t, &str[i + 1], end - i - 1)));
+			i = _skip_space(str, end + 1);
+			if (str[i] != ':') {
+				*err_code = 1;
+				return i;
+			}
+			i = _skip_space(str, i + 1);
+			break;
+		}
+	}
+}
+
+dhdb_tape_t*
+dhdb_tape_create_from_json(const char *str)
+{
+	dhdb_tape_t *t;
+	int err_code = 0, err_col;
+
+	assert(str);
+
+	t = calloc(1, sizeof(dhdb_tape_t));
+	assert(t);
+	t->cap = TAPE_ALLOC_BLOCK;
+	t->tape = malloc(t->cap * sizeof(uint64_t));
+	assert(t->tape);
+	t->strings_cap = TAPE_ALLOC_BLOCK;
+	t->strings = malloc(t->strings_cap);
+	assert(t->strings);
+	_emit(t, TAPE_ENTRY(TAPE_END, 0));
+
+	err_col = _parse(t, str, &err_code);
+	if (err_code) {
+		fprintf(stderr, "%s: Error '%s' at byte %d of %zu\n",
+		    __FUNCTION__, _parse_error[err_code], err_col,
+		    strlen(str));
+		dhdb_tape_free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void
+dhdb_tape_free(dhdb_tape_t *t)
+{
+	if (t == NULL)
+		return;
+
+	free(t->tape);
+	free(t->strings);
+	free(t);
+}
+
+uint32_t
+dhdb_tape_size(dhdb_tape_t *t)
+{
+	assert(t);
+	return sizeof(dhdb_tape_t) + t->len * sizeof(uint64_t) +
+	    t->strings_len;
+}
+
+/* Skips the KEY entry of an object member */
+static uint32_t
+_value(dhdb_tape_t *t, uint32_t pos)
+{
+	if (pos && TAPE_TAG(t->tape[pos]) == TAPE_KEY)
+		return pos + 1;
+	return pos;
+}
+
+uint32_t
+dhdb_tape_root(dhdb_tape_t *t)
+{
+	assert(t);
+	return t->len > 1 ? 1 : 0;
+}
+
+uint8_t
+dhdb_tape_type(dhdb_tape_t *t, uint32_t pos)
+{
+	if (pos == 0)
+		return DHDB_VALUE_UNDEFINED;
+
+	return TAPE_TAG(t->tape[_value(t, pos)]);
+}
+
+int
+dhdb_tape_len(dhdb_tape_t *t, uint32_t pos)
+{
+	uint8_t type;
+
+	pos = _value(t, pos);
+	type = dhdb_tape_type(t, pos);
+	if (type != DHDB_VALUE_OBJECT && type != DHDB_VALUE_ARRAY)
+		return 0;
+
+	return TAPE_PAYLOAD(t->tape[pos + 1]);
+}
+
+const char*
+dhdb_tape_name(dhdb_tape_t *t, uint32_t pos)
+{
+	if (pos == 0 || TAPE_TAG(t->tape[pos]) != TAPE_KEY)
+		return NULL;
+
+	return &t->strings[TAPE_PAYLOAD(t->tape[pos])];
+}
+
+uint32_t
+dhdb_tape_first(dhdb_tape_t *t, uint32_t pos)
+{
+	uint8_t type;
+
+	pos = _value(t, pos);
+	type = dhdb_tape_type(t, pos);
+	if (type != DHDB_VALUE_OBJECT && type != DHDB_VALUE_ARRAY)
+		return 0;
+	if (TAPE_TAG(t->tape[pos + 2]) == TAPE_END)
+		return 0;
+
+	return pos + 2;
+}
+
+uint32_t
+dhdb_tape_next(dhdb_tape_t *t, uint32_t pos)
+{
+	uint32_t next;
+
+	if (pos == 0)
+		return 0;
+
+	pos = _value(t, pos);
+	switch (TAPE_TAG(t->tape[pos])) {
+	case DHDB_VALUE_OBJECT:
+	case DHDB_VALUE_ARRAY:
+		next = TAPE_PAYLOAD(t->tape[pos]);
+		break;
+	case DHDB_VALUE_NUMBER:
+		next = pos + 2;
+		break;
+	default:
+		next = pos + 1;
+		break;
+	}
+
+	if (next >= t->len || TAPE_TAG(t->tape[next]) == TAPE_END)
+		return 0;
+
+	return next;
+}
+
+uint32_t
+dhdb_tape_by(dhdb_tape_t *t, uint32_t pos, const char *name)
+{
+	uint32_t n;
+
+	assert(name);
+
+	if (dhdb_tape_type(t, pos) != DHDB_VALUE_OBJECT)
+		return 0;
+
+	for (n = dhdb_tape_first(t, pos); n; n = dhdb_tape_next(t, n))
+		if (!strcasecmp(dhdb_tape_name(t, n), name))
+			return n;
+
+	return 0;
+}
+
+uint32_t
+dhdb_tape_at(dhdb_tape_t *t, uint32_t pos, int idx)
+{
+	uint32_t n;
+
+	assert(idx >= 0);
+
+	if (idx >= dhdb_tape_len(t, pos))
+		return 0;
+
+	for (n = dhdb_tape_first(t, pos); n && idx; idx--)
+		n = dhdb_tape_next(t, n);
+
+	return n;
+}
+
+double
+dhdb_tape_num(dhdb_tape_t *t, uint32_t pos)
+{
+	double num;
+
+	pos = _value(t, pos);
+	switch (dhdb_tape_type(t, pos)) {
+	case DHDB_VALUE_NUMBER:
+		memcpy(&num, &t->tape[pos + 1], sizeof(num));
+		return num;
+	case DHDB_VALUE_BOOL:
+		return TAPE_PAYLOAD(t->tape[pos]);
+	}
+
+	return 0;
+}
+
+const char*
+dhdb_tape_str(dhdb_tape_t *t, uint32_t pos)
+{
+	pos = _value(t, pos);
+	if (dhdb_tape_type(t, pos) != DHDB_VALUE_STRING)
+		return NULL;
+
+	return &t->strings[TAPE_PAYLOAD(t->tape[pos])];
+}
+
+bool
+dhdb_tape_bool(dhdb_tape_t *t, uint32_t pos)
+{
+	return (bool) dhdb_tape_num(t, pos);
+}
+
+dhdb_t*
+dhdb_tape_to_dhdb(dhdb_tape_t *t, uint32_t pos)
+{
+	dhdb_t *s;
+	uint32_t n;
+
+	if (pos == 0)
+		return NULL;
+
+	s = dhdb_create();
+	switch (dhdb_tape_type(t, pos)) {
+	case DHDB_VALUE_OBJECT:
+		for (n = dhdb_tape_first(t, pos); n; n = dhdb_tape_next(t, n))
+			dhdb_set_obj(s, dhdb_tape_name(t, n),
+			    dhdb_tape_to_dhdb(t, n));
+		break;
+	case DHDB_VALUE_ARRAY:
+		dhdb_set_array(s);
+		for (n = dhdb_tape_first(t, pos); n; n = dhdb_tape_next(t, n))
+			dhdb_add(s, dhdb_tape_to_dhdb(t, n));
+		break;
+	case DHDB_VALUE_NUMBER:
+		dhdb_set_num(s, dhdb_tape_num(t, pos));
+		break;
+	case DHDB_VALUE_STRING:
+		dhdb_set_str(s, dhdb_tape_str(t, pos));
+		break;
+	case DHDB_VALUE_BOOL:
+		dhdb_set_bool(s, dhdb_tape_bool(t, pos));
+		break;
+	case DHDB_VALUE_NULL:
+		dhdb_set_null(s);
+		break;
+	}
+
+	return s;
+}
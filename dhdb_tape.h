@@ -0,0 +1,52 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_TAPE_H__
+#define __DHDB_TAPE_H__
+
+#include "dhdb.h"
+
+/*
+Read-only JSON document stored as a flat tape
+- One contiguous array of tagged 64-bit entries plus one string buffer
+- Containers know where they end, so skipping a subtree is O(1)
+- Values are addressed by tape position, 0 means "not found"
+- Use dhdb_tape_to_dhdb to turn a subtree into an editable dhdb_t
+*/
+typedef struct dhdbTape dhdb_tape_t;
+
+dhdb_tape_t*	dhdb_tape_create_from_json	(const char *str);
+void		dhdb_tape_free			(dhdb_tape_t *t);
+uint32_t	dhdb_tape_size			(dhdb_tape_t *t);
+
+uint32_t	dhdb_tape_root	(dhdb_tape_t *t);
+uint8_t		dhdb_tape_type	(dhdb_tape_t *t, uint32_t pos);
+int		dhdb_tape_len	(dhdb_tape_t *t, uint32_t pos);
+const char*	dhdb_tape_name	(dhdb_tape_t *t, uint32_t pos);
+
+uint32_t	dhdb_tape_by	(dhdb_tape_t *t, uint32_t pos, const char *name);
+uint32_t	dhdb_tape_at	(dhdb_tape_t *t, uint32_t pos, int idx);
+uint32_t	dhdb_tape_first	(dhdb_tape_t *t, uint32_t pos);
+uint32_t	dhdb_tape_next	(dhdb_tape_t *t, uint32_t pos);
+
+double		dhdb_tape_num	(dhdb_tape_t *t, uint32_t pos);
+const char*	dhdb_tape_str	(dhdb_tape_t *t, uint32_t pos);
+bool		dhdb_tape_bool	(dhdb_tape_t *t, uint32_t pos);
+
+dhdb_t*		dhdb_tape_to_dhdb	(dhdb_tape_t *t, uint32_t pos);
+
+#endif
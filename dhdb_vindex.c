@@ -0,0 +1,397 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "dhdb_vindex.h"
+#include "dhdb_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Matches are kept in one array sorted by value, then in document order.
+ * Each distinct value has a hash table slot pointing to its first match.
+ * The index marks every node it looked into as watched, so changes to
+ * them bump the generation of the root and the next lookup rebuilds.
+ */
+struct key
+{
+	uint8_t type;
+	double num;
+	const char *str;
+	int str_len;
+};
+
+struct entry
+{
+	struct key key;
+	dhdb_t *node;		// Or the packed array holding the number
+	int index;		// Of the number in a packed node, else -1
+	int seq;		// Document order among equal values
+};
+
+struct slot
+{
+	int pos;
+	int count;		// 0 for an empty slot
+};
+
+struct dhdbVindex
+{
+	dhdb_t *root;
+	char **tokens;		// NULL for *
+	int num_tokens;
+	uint32_t gen;
+	bool built;
+
+	struct entry *entries;
+	int len;
+	int cap;
+	struct slot *slots;
+	uint32_t mask;
+};
+
+static void _sync(dhdb_vindex_t *);
+static void _build(dhdb_vindex_t *);
+static void _collect(dhdb_vindex_t *, dhdb_t *, int);
+static struct entry* _add(dhdb_vindex_t *, dhdb_t *, int);
+static dhdb_t* _node(struct entry *);
+static int _key_cmp(const struct key *, const struct key *);
+static int _entry_cmp(const void *, const void *);
+static uint32_t _hash(const struct key *);
+static int _bound(dhdb_vindex_t *, const struct key *, bool);
+static int _find(dhdb_vindex_t *, const struct key *, int *);
+
+dhdb_vindex_t*
+dhdb_vindex_create(dhdb_t *root, const char *pattern)
+{
+	dhdb_vindex_t *ix;
+
+	assert(root);
+	assert(pattern);
+
+	ix = calloc(1, sizeof(*ix));
+	assert(ix);
+	ix->root = root;
+	ix->tokens = dhdb_internal_pattern(pattern, &ix->num_tokens);
+	return ix;
+}
+
+/* Nodes stay watched, other indexes may be watching them too */
+void
+dhdb_vindex_free(dhdb_vindex_t *ix)
+{
+	int i;
+
+	if (ix == NULL)
+		return;
+
+	for (i = 0; i < ix->num_tokens; i++)
+		free(ix->tokens[i]);
+	free(ix->tokens);
+	free(ix->entries);
+	free(ix->slots);
+	free(ix);
+}
+
+int
+dhdb_vindex_len(dhdb_vindex_t *ix)
+{
+	_sync(ix);
+	return ix->len;
+}
+
+dhdb_t*
+dhdb_vindex_at(dhdb_vindex_t *ix, int pos)
+{
+	_sync(ix);
+	if (pos < 0 || pos >= ix->len)
+		return NULL;
+	return _node(&ix->entries[pos]);
+}
+
+int
+dhdb_vindex_num(dhdb_vindex_t *ix, double num, int *pos)
+{
+	struct key k = { DHDB_VALUE_NUMBER, num, NULL, 0 };
+
+	_sync(ix);
+	return _find(ix, &k, pos);
+}
+
+int
+dhdb_vindex_str(dhdb_vindex_t *ix, const char *str, int *pos)
+{
+	struct key k = { DHDB_VALUE_STRING, 0, str, strlen(str) };
+
+	_sync(ix);
+	return _find(ix, &k, pos);
+}
+
+int
+dhdb_vindex_range_num(dhdb_vindex_t *ix, double lo, double hi, int *pos)
+{
+	struct key a = { DHDB_VALUE_NUMBER, lo, NULL, 0 };
+	struct key b = { DHDB_VALUE_NUMBER, hi, NULL, 0 };
+	int first, last;
+
+	_sync(ix);
+	first = _bound(ix, &a, false);
+	last = _bound(ix, &b, true);
+	*pos = first;
+	return last > first ? last - first : 0;
+}
+
+int
+dhdb_vindex_range_str(dhdb_vindex_t *ix, const char *lo, const char *hi,
+    int *pos)
+{
+	struct key a = { DHDB_VALUE_STRING, 0, lo, strlen(lo) };
+	struct key b = { DHDB_VALUE_STRING, 0, hi, strlen(hi) };
+	int first, last;
+
+	_sync(ix);
+	first = _bound(ix, &a, false);
+	last = _bound(ix, &b, true);
+	*pos = first;
+	return last > first ? last - first : 0;
+}
+
+dhdb_t*
+dhdb_vindex_get_num(dhdb_vindex_t *ix, double num)
+{
+	int pos;
+
+	if (dhdb_vindex_num(ix, num, &pos) == 0)
+		return NULL;
+	return _node(&ix->entries[pos]);
+}
+
+dhdb_t*
+dhdb_vindex_get_str(dhdb_vindex_t *ix, const char *str)
+{
+	int pos;
+
+	if (dhdb_vindex_str(ix, str, &pos) == 0)
+		return NULL;
+	return _node(&ix->entries[pos]);
+}
+
+static void
+_sync(dhdb_vindex_t *ix)
+{
+	if (!ix->built || dhdb_generation(ix->root) != ix->gen)
+		_build(ix);
+}
+
+static void
+_build(dhdb_vindex_t *ix)
+{
+	uint32_t size, h;
+	int i, first;
+
+	ix->len = 0;
+	_collect(ix, ix->root, 0);
+	if (ix->len)
+		qsort(ix->entries, ix->len, sizeof(struct entry), _entry_cmp);
+
+	for (size = 16; size < ix->len * 2; size *= 2)
+		;
+	if (ix->slots == NULL || size != ix->mask + 1) {
+		free(ix->slots);
+		ix->slots = malloc(size * sizeof(struct slot));
+		assert(ix->slots);
+		ix->mask = size - 1;
+	}
+	memset(ix->slots, 0, size * sizeof(struct slot));
+
+	for (first = 0; first < ix->len; first = i) {
+		for (i = first + 1; i < ix->len; i++)
+			if (_key_cmp(&ix->entries[first].key,
+			    &ix->entries[i].key))
+				break;
+		h = _hash(&ix->entries[first].key) & ix->mask;
+		while (ix->slots[h].count)
+			h = (h + 1) & ix->mask;
+		ix->slots[h].pos = first;
+		ix->slots[h].count = i - first;
+	}
+
+	/* Collecting may have parsed lazy nodes, which is a change too */
+	ix->gen = dhdb_generation(ix->root);
+	ix->built = true;
+}
+
+/* Marks what is looked into, so that adding a missing match is noticed */
+static void
+_collect(dhdb_vindex_t *ix, dhdb_t *s, int step)
+{
+	struct entry *e;
+	const double *nums;
+	dhdb_t *n;
+	int i, len;
+
+	s->flags |= DHDB_FLAG_WATCHED;
+	if (step < ix->num_tokens) {
+		if (ix->tokens[step] != NULL) {
+			if ((n = dhdb_by(s, ix->tokens[step])))
+				_collect(ix, n, step + 1);
+		} else if ((nums = dhdb_internal_packed(s, &len))) {
+			for (i = 0; step + 1 == ix->num_tokens && i < len; i++)
+				if (nums[i] == nums[i])
+					_add(ix, s, i)->key.num = nums[i];
+		} else {
+			for (n = dhdb_first(s); n; n = dhdb_next(n))
+				_collect(ix, n, step + 1);
+		}
+		return;
+	}
+
+	if (s->type != DHDB_VALUE_NUMBER && s->type != DHDB_VALUE_STRING)
+		return;
+	if (s->type == DHDB_VALUE_NUMBER && dhdb_num(s) != dhdb_num(s))
+		return;
+
+	e = _add(ix, s, -1);
+	e->key.type = s->type;
+	e->key.num = s->type == DHDB_VALUE_NUMBER ? dhdb_num(s) : 0;
+	e->key.str = s->type == DHDB_VALUE_STRING ? dhdb_str(s) : NULL;
+	e->key.str_len = e->key.str ? dhdb_internal_resolve(s)->str_len : 0;
+}
+
+/* New entry with a number key */
+static struct entry*
+_add(dhdb_vindex_t *ix, dhdb_t *node, int index)
+{
+	struct entry *e;
+
+	if (ix->len == ix->cap) {
+		ix->cap = ix->cap ? ix->cap * 2 : 64;
+		ix->entries = realloc(ix->entries,
+		    ix->cap * sizeof(struct entry));
+		assert(ix->entries);
+	}
+	e = &ix->entries[ix->len];
+	memset(&e->key, 0, sizeof(e->key));
+	e->key.type = DHDB_VALUE_NUMBER;
+	e->node = node;
+	e->index = index;
+	e->seq = ix->len++;
+	return e;
+}
+
+/*
+ * Numbers of a packed array get their nodes only when asked for. That
+ * unpacks the array, which changes it, and the next lookup rebuilds.
+ */
+static dhdb_t*
+_node(struct entry *e)
+{
+	if (e->index < 0)
+		return e->node;
+	return dhdb_at(e->node, e->index);
+}
+
+static int
+_key_cmp(const struct key *a, const struct key *b)
+{
+	int r;
+
+	if (a->type != b->type)
+		return a->type < b->type ? -1 : 1;
+	if (a->type == DHDB_VALUE_NUMBER)
+		return a->num < b->num ? -1 : a->num > b->num;
+
+	r = memcmp(a->str, b->str,
+	    a->str_len < b->str_len ? a->str_len : b->str_len);
+	if (r)
+		return r;
+	return a->str_len < b->str_len ? -1 : a->str_len > b->str_len;
+}
+
+static int
+_entry_cmp(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+	int r;
+
+	r = _key_cmp(&x->key, &y->key);
+	if (r)
+		return r;
+	return x->seq - y->seq;
+}
+
+static uint32_t
+_hash(const struct key *k)
+{
+	uint64_t bits;
+	uint32_t h;
+	double num;
+	int i;
+
+	if (k->type == DHDB_VALUE_NUMBER) {
+		num = k->num == 0 ? 0 : k->num;	// -0 equals 0
+		memcpy(&bits, &num, sizeof(bits));
+		bits ^= bits >> 33;
+		bits *= 0xff51afd7ed558ccdULL;
+		bits ^= bits >> 33;
+		return (uint32_t) bits;
+	}
+
+	h = 2166136261u;
+	for (i = 0; i < k->str_len; i++)
+		h = (h ^ (uint8_t) k->str[i]) * 16777619u;
+	return h;
+}
+
+/* First position with a value above k, or at or above it without after */
+static int
+_bound(dhdb_vindex_t *ix, const struct key *k, bool after)
+{
+	int lo, hi, mid, r;
+
+	lo = 0;
+	hi = ix->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = _key_cmp(&ix->entries[mid].key, k);
+		if (r < 0 || (after && r == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int
+_find(dhdb_vindex_t *ix, const struct key *k, int *pos)
+{
+	uint32_t h;
+
+	if (k->type == DHDB_VALUE_NUMBER && k->num != k->num)
+		return 0;
+
+	h = _hash(k) & ix->mask;
+	while (ix->slots[h].count) {
+		if (!_key_cmp(&ix->entries[ix->slots[h].pos].key, k)) {
+			*pos = ix->slots[h].pos;
+			return ix->slots[h].count;
+		}
+		h = (h + 1) & ix->mask;
+	}
+	return 0;
+}
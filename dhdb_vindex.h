@@ -0,0 +1,56 @@
+/* 
+ * dhdb - Multi-format dynamic and hierarchical database for C
+ * Copyright (c) 2015 Tommi M. Leino <tleino@me.com>
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __DHDB_VINDEX_H__
+#define __DHDB_VINDEX_H__
+
+#include "dhdb.h"
+
+/*
+Index from values to the nodes holding them, such as the ids of users
+- The pattern is made of names and * separated with the separator of
+  dhdb_path, for example users.*.id
+- Numbers and strings are indexed, the other values are skipped
+- Matches are sorted by value and addressed by position, pos of the
+  first match is returned along with the number of matches
+- Equal values are found through a hash table, ranges by binary search
+- Changes under the indexed containers make the next lookup rebuild the
+  index, other changes in the tree are not noticed and cost nothing
+- Nodes that have been indexed keep passing their changes on to their
+  parents, which makes updating them a little slower, also after
+  dhdb_vindex_free since another index may share them
+- Numbers of packed arrays are indexed without unpacking, the array is
+  unpacked when dhdb_vindex_at or a get function returns one of them
+*/
+typedef struct dhdbVindex dhdb_vindex_t;
+
+dhdb_vindex_t*	dhdb_vindex_create	(dhdb_t *root, const char *pattern);
+void		dhdb_vindex_free	(dhdb_vindex_t *ix);
+int		dhdb_vindex_len		(dhdb_vindex_t *ix);
+dhdb_t*		dhdb_vindex_at		(dhdb_vindex_t *ix, int pos);
+
+int		dhdb_vindex_num		(dhdb_vindex_t *ix, double num, int *pos);
+int		dhdb_vindex_str		(dhdb_vindex_t *ix, const char *str, int *pos);
+/* Values from lo to hi, both included */
+int		dhdb_vindex_range_num	(dhdb_vindex_t *ix, double lo, double hi, int *pos);
+int		dhdb_vindex_range_str	(dhdb_vindex_t *ix, const char *lo, const char *hi, int *pos);
+
+/* First node with the value or NULL */
+dhdb_t*		dhdb_vindex_get_num	(dhdb_vindex_t *ix, double num);
+dhdb_t*		dhdb_vindex_get_str	(dhdb_vindex_t *ix, const char *str);
+
+#endif
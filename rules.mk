@@ -18,7 +18,7 @@ endef
 
 $(BUILD_PROGRAMS):
 	@echo $@
-	$(CC) $^ -o $@
+	$(CC) $^ -o $@ $(LDLIBS)
 	$(if $(findstring $(notdir $@),$(VALGRIND_AUTORUN)),$(VALGRIND) $@)
 
 -include $(wildcard $(BUILD_DIR)/*.d)
@@ -2,8 +2,10 @@
 #include "dhdb_dump.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
 
 #include <stdbool.h>
 
@@ -300,6 +302,363 @@ void test_value_ops()
 	dhdb_free(s);
 }
 
+void test_take()
+{
+	dhdb_t *s = _test("Taking ownership of strings");
+	char *str;
+
+	asprintf(&str, "value %d", 1);
+	dhdb_set_obj_str_take(s, "first", str);
+	asprintf(&str, "second");
+	dhdb_set_obj_take_name(s, str, dhdb_create_str_take(strdup("value 2")));
+	asprintf(&str, "second");
+	dhdb_set_obj_take_name(s, str, NULL);
+	assert(dhdb_len(s) == 2);
+	assert(!strcmp(dhdb_str_by(s, "first"), "value 1"));
+	assert(!strcmp(dhdb_str_by(s, "second"), "value 2"));
+	assert(!strcmp(dhdb_name(dhdb_by(s, "second")), "second"));
+
+	dhdb_t *a = dhdb_create();
+	dhdb_add_str_take(a, strdup("hello"));
+	dhdb_set_str_take_len(dhdb_at(a, 0), 5, strdup("world"));
+	dhdb_set_str_add(dhdb_at(a, 0), "!");
+	assert(!strcmp(dhdb_str_at(a, 0), "world!"));
+	dhdb_set_obj(s, "array", a);
+
+	dhdb_free(s);
+}
+
+void test_str_builder()
+{
+	dhdb_t *s = _test("Building strings by appending");
+	char big[10000];
+	int i;
+
+	dhdb_set_str(s, "");
+	for (i = 0; i < 1000; i++)
+		dhdb_set_str_add(s, "ab");
+	dhdb_set_str_add_len(s, 3, "xyzzy");
+	assert(strlen(dhdb_str(s)) == 2003);
+	assert(!strncmp(dhdb_str(s), "abab", 4));
+	assert(!strcmp(&dhdb_str(s)[1998], "abxyz"));
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	dhdb_set_str_va(s, "%s%d", big, 42);
+	assert(strlen(dhdb_str(s)) == sizeof(big) + 1);
+	dhdb_set_str_add_va(s, "-%s", dhdb_str(s));
+	assert(strlen(dhdb_str(s)) == 2 * (sizeof(big) + 1) + 1);
+	dhdb_set_str_va(s, "<%s>", "inner");
+	dhdb_set_str_va(s, "%s%s", dhdb_str(s), dhdb_str(s));
+	assert(!strcmp(dhdb_str(s), "<inner><inner>"));
+
+	dhdb_free(s);
+	s = dhdb_create_str_va("%s", big);
+	assert(strlen(dhdb_str(s)) == sizeof(big) - 1);
+	dhdb_free(s);
+}
+
+void test_clone()
+{
+	dhdb_t *s = _test("Deep clone");
+	dhdb_t *c, *n, *v;
+
+	dhdb_set_obj_str(s, "name", "config");
+	dhdb_set_obj_num(s, "version", 3);
+	n = dhdb_create();
+	dhdb_add_str(n, "a");
+	dhdb_add_num(n, 2);
+	dhdb_set_obj(s, "list", n);
+	dhdb_set_obj(s, "nested", dhdb_create());
+	dhdb_set_obj_str(dhdb_by(s, "nested"), "key", "value");
+
+	c = dhdb_create_from(s);
+	assert(dhdb_name(c) == NULL);
+	assert(dhdb_len(c) == dhdb_len(s));
+	assert(!strcmp(dhdb_str_by(c, "name"), "config"));
+	assert(dhdb_num_by(c, "version") == 3);
+	assert(dhdb_len(dhdb_by(c, "list")) == 2);
+	assert(!strcmp(dhdb_str_at(dhdb_by(c, "list"), 0), "a"));
+	assert(dhdb_str_by(c, "name") != dhdb_str_by(s, "name"));
+	assert(dhdb_parent(dhdb_by(c, "list")) == c);
+	assert(dhdb_last(c) == dhdb_by(c, "nested"));
+
+	/* The clone is independent and can be modified */
+	dhdb_set_str_add(dhdb_by(c, "name"), " copy");
+	dhdb_set_obj_str(dhdb_by(c, "nested"), "key2", "value2");
+	dhdb_free(dhdb_at(dhdb_by(c, "list"), 0));
+	dhdb_set_num(dhdb_by(c, "nested"), 1);
+	assert(!strcmp(dhdb_str_by(s, "name"), "config"));
+	assert(!strcmp(dhdb_str_by(c, "name"), "config copy"));
+	assert(dhdb_len(dhdb_by(s, "list")) == 2);
+	assert(dhdb_len(dhdb_by(c, "list")) == 1);
+	assert(dhdb_len(dhdb_by(s, "nested")) == 1);
+
+	/* Nodes taken out of the clone are still pinned through its root */
+	n = dhdb_detach(dhdb_by(c, "list"));
+	v = dhdb_create_shared(n);
+	dhdb_free(v);
+	dhdb_set_obj(s, "moved", n);
+	v = dhdb_create_shared(dhdb_by(s, "moved"));
+	dhdb_free(c);
+	assert(dhdb_len(v) == 1);
+	assert(dhdb_num_at(v, 0) == 2);
+	dhdb_detach(n);
+	dhdb_free(v);
+
+	/* Setting from a container copies its contents */
+	n = dhdb_create_str("old");
+	dhdb_set_from(n, dhdb_by(s, "nested"));
+	assert(dhdb_type(n) == DHDB_VALUE_OBJECT);
+	assert(!strcmp(dhdb_str_by(n, "key"), "value"));
+	dhdb_set_from(n, dhdb_by(s, "list"));
+	assert(dhdb_type(n) == DHDB_VALUE_ARRAY);
+	assert(dhdb_num_at(n, 1) == 2);
+	dhdb_set_obj(s, "copy", n);
+	dhdb_set_from(s, dhdb_by(s, "nested"));
+	assert(dhdb_len(s) == 1);
+	assert(!strcmp(dhdb_str_by(s, "key"), "value"));
+
+	c = dhdb_create_from(dhdb_by(s, "key"));
+	assert(!strcmp(dhdb_str(c), "value"));
+	dhdb_free(c);
+	dhdb_free(s);
+}
+
+void test_shared()
+{
+	dhdb_t *s = _test("Copy-on-write sharing");
+	dhdb_t *v1, *v2, *n;
+
+	dhdb_set_obj_str(s, "name", "base");
+	n = dhdb_create();
+	dhdb_set_obj_num(n, "port", 80);
+	dhdb_set_obj_str(n, "host", "localhost");
+	dhdb_set_obj(s, "server", n);
+	n = dhdb_create();
+	dhdb_add_num(n, 1);
+	dhdb_add_num(n, 2);
+	dhdb_set_obj(s, "list", n);
+
+	v1 = dhdb_create_shared(s);
+	v2 = dhdb_create_shared(v1);
+	assert(dhdb_type(v1) == DHDB_VALUE_OBJECT);
+	assert(dhdb_len(v1) == 3);
+	assert(!strcmp(dhdb_str_by(v1, "name"), "base"));
+	assert(dhdb_num_by(dhdb_by(v2, "server"), "port") == 80);
+
+	/* Writes copy the path and leave the base and other variants alone */
+	dhdb_set_num(dhdb_by(dhdb_by(v1, "server"), "port"), 8080);
+	dhdb_set_str_add(dhdb_by(v2, "name"), " v2");
+	dhdb_add_num(dhdb_by(v2, "list"), 3);
+	assert(dhdb_num_by(dhdb_by(s, "server"), "port") == 80);
+	assert(dhdb_num_by(dhdb_by(v1, "server"), "port") == 8080);
+	assert(dhdb_num_by(dhdb_by(v2, "server"), "port") == 80);
+	assert(!strcmp(dhdb_str_by(s, "name"), "base"));
+	assert(!strcmp(dhdb_str_by(v1, "name"), "base"));
+	assert(!strcmp(dhdb_str_by(v2, "name"), "base v2"));
+	assert(dhdb_len(dhdb_by(s, "list")) == 2);
+	assert(dhdb_len(dhdb_by(v2, "list")) == 3);
+	assert(!strcmp(dhdb_str_by(dhdb_by(v1, "server"), "host"), "localhost"));
+
+	/* The base is kept alive for as long as variants read from it */
+	dhdb_free(s);
+	assert(!strcmp(dhdb_str_by(dhdb_by(v2, "server"), "host"), "localhost"));
+	n = dhdb_create_from(v1);
+	dhdb_free(v1);
+	assert(dhdb_num_at(dhdb_by(v2, "list"), 2) == 3);
+	assert(dhdb_num_by(dhdb_by(n, "server"), "port") == 8080);
+	dhdb_set_array(dhdb_by(v2, "server"));
+	assert(dhdb_len(dhdb_by(v2, "server")) == 0);
+	dhdb_free(v2);
+
+	/* Sharing nodes of a cloned block */
+	v1 = dhdb_create_shared(dhdb_by(n, "server"));
+	dhdb_free(n);
+	assert(dhdb_num_by(v1, "port") == 8080);
+	dhdb_set_obj_num(v1, "timeout", 5);
+	assert(dhdb_len(v1) == 3);
+	dhdb_free(v1);
+}
+
+void test_equal()
+{
+	dhdb_t *s = _test("Deep comparison");
+	dhdb_t *c, *v, *n;
+
+	dhdb_set_obj_str(s, "name", "config");
+	dhdb_set_obj_num(s, "version", 3);
+	n = dhdb_create();
+	dhdb_add_str(n, "a");
+	dhdb_set_obj(s, "list", n);
+	n = dhdb_create();
+	dhdb_set_obj(n, "on", dhdb_create_bool(true));
+	dhdb_set_obj(s, "flags", n);
+
+	/* Members in another order and names in another case */
+	c = dhdb_create();
+	n = dhdb_create();
+	dhdb_set_obj(n, "ON", dhdb_create_bool(true));
+	dhdb_set_obj(c, "Flags", n);
+	n = dhdb_create();
+	dhdb_add_str(n, "a");
+	dhdb_set_obj(c, "list", n);
+	dhdb_set_obj_num(c, "version", 3);
+	dhdb_set_obj_str(c, "name", "config");
+	assert(dhdb_equal(s, c));
+	assert(dhdb_equal(c, s));
+	assert(dhdb_equal(s, s));
+	assert(!dhdb_equal(s, NULL));
+
+	v = dhdb_create_shared(s);
+	assert(dhdb_equal(v, c));
+	dhdb_add_str(dhdb_by(c, "list"), "b");
+	assert(!dhdb_equal(s, c));
+	assert(!dhdb_equal(v, c));
+	dhdb_add_str(dhdb_by(v, "list"), "b");
+	assert(dhdb_equal(v, c));
+	dhdb_free(v);
+
+	dhdb_free(dhdb_at(dhdb_by(c, "list"), 1));
+	assert(dhdb_equal(s, c));
+	dhdb_set_obj_str(c, "version", "3");
+	assert(!dhdb_equal(s, c));
+	dhdb_set_obj_num(c, "version", 3);
+	dhdb_set_obj(c, "extra", dhdb_create_null());
+	assert(!dhdb_equal(s, c));
+	dhdb_set_obj(s, "Extra", dhdb_create_null());
+	assert(dhdb_equal(s, c));
+	dhdb_set_bool(dhdb_by(dhdb_by(c, "flags"), "on"), false);
+	assert(!dhdb_equal(s, c));
+	dhdb_free(c);
+	dhdb_free(s);
+}
+
+void test_packed()
+{
+	dhdb_t *s = _test("Packed number arrays");
+	double nums[1000];
+	dhdb_t *c, *v, *n;
+	uint32_t size;
+	int i;
+
+	for (i = 0; i < 1000; i++)
+		nums[i] = i - 500;
+	dhdb_add_num_array(s, nums, 1000);
+	assert(dhdb_type(s) == DHDB_VALUE_ARRAY);
+	assert(dhdb_len(s) == 1000);
+	assert(dhdb_num_at(s, 0) == -500);
+	assert(dhdb_num_at(s, 999) == 499);
+	assert(dhdb_array_sum(s) == -500);
+	assert(dhdb_array_min(s) == -500);
+	assert(dhdb_array_max(s) == 499);
+	assert(dhdb_array_mean(s) == -0.5);
+	dhdb_add_num(s, 1000);
+	dhdb_add_num_array(s, nums, 2);
+	assert(dhdb_len(s) == 1003);
+	assert(dhdb_array_max(s) == 1000);
+	assert(dhdb_num_at(s, 1002) == -499);
+
+	/* Indexes out of range read nothing and leave the numbers packed */
+	size = dhdb_size(s);
+	assert(dhdb_num_at(s, -3) == 0);
+	assert(dhdb_num_at(s, 1003) == 0);
+	assert(dhdb_size(s) == size);
+
+	/* Same numbers as nodes */
+	n = dhdb_create();
+	for (i = 0; i < 1000; i++)
+		dhdb_add_num(n, nums[i]);
+	dhdb_add_num(n, 1000);
+	assert(dhdb_size(s) < dhdb_size(n));
+	assert(!dhdb_equal(s, n));
+	dhdb_add_num(n, -500);
+	dhdb_add_num(n, -499);
+	assert(dhdb_equal(s, n));
+	assert(dhdb_equal(n, s));
+	assert(dhdb_array_sum(n) == dhdb_array_sum(s));
+	assert(dhdb_array_mean(n) == dhdb_array_mean(s));
+	dhdb_add_str(n, "x");
+	assert(dhdb_array_max(n) == 1000);
+	dhdb_free(n);
+
+	/* Clones and proxies keep the numbers packed */
+	c = dhdb_create_from(s);
+	assert(dhdb_equal(c, s));
+	assert(dhdb_size(c) == dhdb_size(s));
+	dhdb_add_num(c, 2);
+	assert(dhdb_len(c) == 1004 && dhdb_len(s) == 1003);
+	v = dhdb_create_shared(s);
+	assert(dhdb_array_sum(v) == dhdb_array_sum(s));
+	dhdb_add_num(v, 2);
+	assert(dhdb_equal(v, c));
+	assert(dhdb_len(s) == 1003);
+	dhdb_free(v);
+	dhdb_free(c);
+
+	/* Access to nodes turns the numbers into nodes */
+	assert(dhdb_num(dhdb_at(s, 1)) == -499);
+	assert(dhdb_type(dhdb_first(s)) == DHDB_VALUE_NUMBER);
+	assert(dhdb_len(s) == 1003);
+	assert(dhdb_array_sum(s) == 500 - 500 - 499);
+	dhdb_set_num(s, 3);
+	assert(dhdb_len(s) == 0);
+	dhdb_add_num_array(s, nums, 2);
+	dhdb_add_str(s, "x");
+	assert(dhdb_len(s) == 3);
+	assert(!strcmp(dhdb_str_at(s, 2), "x"));
+	assert(dhdb_array_sum(s) == -999);
+
+	/* Arrays without numbers */
+	dhdb_set_array(s);
+	assert(dhdb_array_sum(s) == 0);
+	assert(isnan(dhdb_array_min(s)));
+	assert(isnan(dhdb_array_mean(s)));
+	dhdb_add_num_array(s, nums, 0);
+	assert(dhdb_len(s) == 0);
+	dhdb_free(s);
+}
+
+void test_by_cached()
+{
+	dhdb_t *s = _test("Cached member lookups");
+	dhdb_lookup_cache_t ic = { 0 };
+	const char *key = "none", *name = "name";
+	dhdb_t *n, *v;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		n = dhdb_create();
+		dhdb_set_obj_num(n, "id", i);
+		dhdb_set_obj_str(n, "name", "x");
+		dhdb_set_obj_num(n, "timestamp", i * 10);
+		dhdb_add(s, n);
+	}
+	n = dhdb_at(s, 50);
+	dhdb_free(dhdb_by(n, "id"));
+	dhdb_set_obj_num(n, "id", 50);
+
+	for (i = 0, n = dhdb_first(s); n; i++, n = dhdb_next(n))
+		assert(dhdb_num(dhdb_by_cached(n, "TimeStamp", &ic)) == i * 10);
+	assert(ic.hits == 97 && ic.misses == 3);
+	assert(dhdb_by_cached(n = dhdb_first(s), key, &ic) == NULL);
+	assert(dhdb_by_cached(n, key, &ic) == NULL);
+	assert(ic.hits == 98 && ic.misses == 4);
+
+	/* The same object again is a hit until it changes */
+	v = dhdb_by_cached(n, name, &ic);
+	assert(dhdb_by_cached(n, name, &ic) == v);
+	assert(ic.hits == 99 && ic.misses == 5);
+	dhdb_free(v);
+	assert(dhdb_by_cached(n, name, &ic) == NULL);
+	dhdb_set_obj_str(n, "name", "y");
+	assert(!strcmp(dhdb_str(dhdb_by_cached(n, name, &ic)), "y"));
+	dhdb_free(s);
+	s = dhdb_create_num(1);
+	assert(dhdb_by_cached(s, "id", &ic) == NULL);
+	dhdb_free(s);
+}
+
 int main(int argc, char **argv)
 {
 	_progName = argv[0];
@@ -319,6 +678,13 @@ int main(int argc, char **argv)
 	test_insert();
 	test_detach();
 	test_value_ops();
+	test_take();
+	test_str_builder();
+	test_clone();
+	test_shared();
+	test_equal();
+	test_packed();
+	test_by_cached();
 	
 	return 0;
 }
@@ -0,0 +1,175 @@
+#include "dhdb_conc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_THREADS	8
+#define NUM_KEYS	1000
+
+char *_progName;
+
+static dhdb_conc_t *_conc;
+
+static void _inc(dhdb_t *v, void *arg)
+{
+	dhdb_set_num_inc(v);
+}
+
+static void* _worker(void *arg)
+{
+	int id = *(int *) arg;
+	char key[64];
+	dhdb_t *v;
+
+	for (int i = 0; i < NUM_KEYS; i++) {
+		snprintf(key, sizeof(key), "session-%d-%d", id, i);
+		v = dhdb_create();
+		dhdb_set_obj_num(v, "user", id);
+		dhdb_set_obj_str(v, "state", "new");
+		dhdb_conc_set_obj(_conc, key, v);
+		dhdb_conc_update(_conc, "counter", _inc, NULL);
+
+		v = dhdb_conc_by(_conc, key);
+		assert(dhdb_num_by(v, "user") == id);
+		dhdb_free(v);
+		if (i % 2)
+			assert(dhdb_conc_remove(_conc, key));
+	}
+	return NULL;
+}
+
+static void _test_concurrent()
+{
+	pthread_t threads[NUM_THREADS];
+	int ids[NUM_THREADS];
+	dhdb_t *v;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Concurrent writers");
+	_conc = dhdb_conc_create(0);
+	for (int i = 0; i < NUM_THREADS; i++) {
+		ids[i] = i;
+		pthread_create(&threads[i], NULL, _worker, &ids[i]);
+	}
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	assert(dhdb_conc_len(_conc) == NUM_THREADS * NUM_KEYS / 2 + 1);
+	v = dhdb_conc_by(_conc, "counter");
+	assert(dhdb_num(v) == NUM_THREADS * NUM_KEYS);
+	dhdb_free(v);
+	assert(dhdb_conc_has(_conc, "SESSION-3-10"));
+	assert(!dhdb_conc_has(_conc, "session-3-11"));
+	dhdb_conc_free(_conc);
+}
+
+static void _test_replace()
+{
+	dhdb_conc_t *c;
+	dhdb_t *v;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Replacing members and export");
+	c = dhdb_conc_create(3);
+	v = dhdb_conc_to_dhdb(c);
+	assert(dhdb_type(v) == DHDB_VALUE_OBJECT && dhdb_len(v) == 0);
+	dhdb_free(v);
+
+	dhdb_conc_set_obj(c, "a", dhdb_create_num(1));
+	dhdb_conc_set_obj(c, "A", dhdb_create_num(2));
+	dhdb_conc_set_obj(c, "b", dhdb_create_str("x"));
+	assert(dhdb_conc_len(c) == 2);
+	assert(!dhdb_conc_remove(c, "c"));
+	assert(dhdb_conc_by(c, "c") == NULL);
+
+	v = dhdb_conc_to_dhdb(c);
+	assert(dhdb_len(v) == 2);
+	assert(dhdb_num_by(v, "a") == 2);
+	assert(!strcmp(dhdb_str_by(v, "b"), "x"));
+	dhdb_free(v);
+	dhdb_conc_free(c);
+}
+
+#define NUM_EVENTS	10000
+#define BATCH_SIZE	100
+
+static dhdb_conc_array_t *_events;
+static int _producing;
+
+/* Even producers add one by one, odd ones in batches */
+static void* _producer(void *arg)
+{
+	int id = *(int *) arg;
+	dhdb_t *v, *batch;
+
+	batch = dhdb_set_array(dhdb_create());
+	for (int i = 0; i < NUM_EVENTS; i++) {
+		v = dhdb_create();
+		dhdb_set_obj_num(v, "producer", id);
+		dhdb_set_obj_num(v, "seq", i);
+		if (id % 2 == 0)
+			dhdb_conc_add(_events, v);
+		else {
+			dhdb_add(batch, v);
+			if (dhdb_len(batch) == BATCH_SIZE)
+				dhdb_conc_add_batch(_events, batch);
+		}
+	}
+	dhdb_conc_add_batch(_events, batch);
+	dhdb_free(batch);
+	__atomic_fetch_sub(&_producing, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void _test_append()
+{
+	pthread_t threads[NUM_THREADS];
+	int ids[NUM_THREADS], last[NUM_THREADS];
+	dhdb_t *array, *n;
+	int drained = 0;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Concurrent appending");
+	array = dhdb_create();
+	dhdb_add_str(array, "existing");
+	_events = dhdb_conc_array_create(array);
+	_producing = NUM_THREADS;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		ids[i] = i;
+		last[i] = -1;
+		pthread_create(&threads[i], NULL, _producer, &ids[i]);
+	}
+
+	while (__atomic_load_n(&_producing, __ATOMIC_ACQUIRE))
+		drained += dhdb_conc_drain(_events);
+	for (int i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	drained += dhdb_conc_drain(_events);
+	assert(dhdb_conc_drain(_events) == 0);
+
+	assert(drained == NUM_THREADS * NUM_EVENTS);
+	assert(dhdb_len(array) == drained + 1);
+	assert(!strcmp(dhdb_str_at(array, 0), "existing"));
+
+	/* Each producer's values arrive in the order they were added */
+	for (n = dhdb_next(dhdb_first(array)); n; n = dhdb_next(n)) {
+		int id = dhdb_num_by(n, "producer");
+		assert(dhdb_parent(n) == array);
+		assert(dhdb_num_by(n, "seq") == last[id] + 1);
+		last[id]++;
+	}
+
+	dhdb_conc_add(_events, dhdb_create_num(1));
+	dhdb_conc_array_free(_events);
+	assert(dhdb_len(array) == drained + 2);
+	dhdb_free(array);
+}
+
+int main(int argc, char **argv)
+{
+	_progName = argv[0];
+	_test_concurrent();
+	_test_replace();
+	_test_append();
+	return 0;
+}
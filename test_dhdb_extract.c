@@ -0,0 +1,123 @@
+#include "dhdb_extract.h"
+#include "dhdb_json.h"
+#include "dhdb_path.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+static const char *_json =
+    "{\"items\": ["
+    "{\"name\": \"a\", \"price\": 1.5, \"sale\": true},"
+    "{\"name\": \"b\", \"price\": \"n/a\"},"
+    "{\"price\": 3, \"name\": \"c\", \"sale\": false},"
+    "{\"sale\": 1},"
+    "{\"name\": null, \"price\": 5}"
+    "],"
+    "\"orders\": [{\"lines\": [{\"qty\": 1}, {\"qty\": 2}]}, {\"lines\": []}, {\"lines\": [{\"qty\": 3}]}]}";
+
+static void _test_items(dhdb_t *s, int opts)
+{
+	double num[8];
+	const char *str[8];
+	bool flag[8];
+
+	assert(dhdb_extract_num_opt(s, "items/*/price", num, 8, opts) == 5);
+	assert(num[0] == 1.5 && isnan(num[1]) && num[2] == 3 && isnan(num[3]) && num[4] == 5);
+
+	assert(dhdb_extract_str_opt(s, "items/*/name", str, 8, opts) == 5);
+	assert(!strcmp(str[0], "a") && !strcmp(str[1], "b") && !strcmp(str[2], "c"));
+	assert(str[3] == NULL && str[4] == NULL);
+
+	assert(dhdb_extract_bool_opt(s, "items/*/sale", flag, 8, opts) == 5);
+	assert(flag[0] && !flag[1] && !flag[2] && !flag[3] && !flag[4]);
+}
+
+static void test_extract()
+{
+	dhdb_t *s = dhdb_create_from_json(_json);
+	double num[8];
+
+	printf("TEST EXTRACT COLUMNS\n");
+	_test_items(s, 0);
+	_test_items(s, DHDB_EXTRACT_SHAPES);
+
+	/* Rows of nested arrays, and only counting */
+	assert(dhdb_extract_num(s, "orders/*/lines/*/qty", num, 8) == 3);
+	assert(num[0] == 1 && num[1] == 2 && num[2] == 3);
+	assert(dhdb_extract_num(s, "orders/*/lines/*/qty", NULL, 0) == 3);
+	assert(dhdb_extract_num(s, "orders/*/lines", num, 8) == 3);
+	assert(isnan(num[0]));
+
+	/* Missing containers give no rows, names without * one row */
+	assert(dhdb_extract_num(s, "missing/*/x", num, 8) == 0);
+	assert(dhdb_extract_num(s, "items/*/price", num, 2) == 5);
+	assert(dhdb_extract_num(s, "nothing", num, 8) == 1 && isnan(num[0]));
+	dhdb_free(s);
+}
+
+static void test_large()
+{
+	dhdb_t *s = dhdb_create(), *items = dhdb_create();
+	size_t n = 100000;
+	double *a = malloc(n * sizeof(double)), *b = malloc(n * sizeof(double));
+
+	printf("TEST EXTRACT LARGE COLUMN\n");
+	for (size_t i = 0; i < n; i++) {
+		dhdb_t *o = dhdb_create();
+		if (i % 2)
+			dhdb_set_obj_str(o, "id", "x");
+		dhdb_set_obj_num(o, "value", i);
+		if (i % 2 == 0)
+			dhdb_set_obj_str(o, "id", "y");
+		dhdb_add(items, o);
+	}
+	dhdb_set_obj(s, "items", items);
+
+	dhdb_path_internal_set_thread_separator('.');
+	assert(dhdb_extract_num(s, "items.*.value", a, n) == n);
+	assert(dhdb_extract_num_opt(s, "items.*.value", b, n, DHDB_EXTRACT_SHAPES) == n);
+	dhdb_path_internal_set_thread_separator(0);
+	for (size_t i = 0; i < n; i++)
+		assert(a[i] == i && b[i] == i);
+
+	free(a);
+	free(b);
+	dhdb_free(s);
+}
+
+static void test_packed()
+{
+	dhdb_t *s = dhdb_create(), *v = dhdb_create();
+	const char *str[4];
+	double num[4];
+	uint32_t size;
+
+	printf("TEST EXTRACT PACKED\n");
+	dhdb_add_num_array(v, (double[]) { 1, 2, 3 }, 3);
+	dhdb_set_obj(s, "values", v);
+	size = dhdb_size(s);
+
+	assert(dhdb_extract_num(s, "values/*", num, 4) == 3);
+	assert(num[0] == 1 && num[1] == 2 && num[2] == 3);
+	assert(dhdb_extract_num(s, "values/*", num, 2) == 3);
+	assert(dhdb_extract_str(s, "values/*", str, 4) == 3);
+	assert(str[0] == NULL && str[2] == NULL);
+	assert(dhdb_extract_num(s, "values/*/x", num, 4) == 3);
+	assert(isnan(num[0]) && isnan(num[2]));
+	assert(dhdb_extract_num(s, "values/*/*", num, 4) == 0);
+	assert(dhdb_extract_num_opt(s, "values/x", num, 4, DHDB_EXTRACT_SHAPES) == 1);
+	assert(dhdb_size(s) == size);
+	dhdb_free(s);
+}
+
+int main(int argc, char **argv)
+{
+	test_extract();
+	test_large();
+	test_packed();
+
+	return 0;
+}
@@ -36,6 +36,10 @@ int main(int argc, char **argv)
 	assert(!strcmp(dhdb_str_by(dhdb_by(s, "section_a"), "field2"), "value2"));
 	assert(!strcmp(dhdb_str_by(dhdb_by(s, "section_b"), "field3"), "value3"));
 	assert(!strcmp(dhdb_str_by(dhdb_by(s, "section_b"), "field4"), "value4"));
+
+	char buf[8];
+	assert(dhdb_to_ini_r(s, buf, sizeof(buf)) == strlen(dhdb_to_ini(s)));
+	assert(!strncmp(buf, dhdb_to_ini(s), sizeof(buf) - 1));
 	dhdb_free(s);
 
 	return 0;
@@ -2,6 +2,7 @@
 #include "dhdb_dump.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
@@ -101,6 +102,16 @@ static void _test_parse(bool want_export_import)
 	assert(dhdb_num_at(dhdb_at(s, 3), 1) == -3);
 	dhdb_free(s);
 
+	// Values next to closing brackets
+	s = _test("Values next to brackets", "[[1],[true,null],{\"a\":-2},3]", want_export_import);
+	assert(dhdb_len(s) == 4);
+	assert(dhdb_num_at(dhdb_at(s, 0), 0) == 1);
+	assert(dhdb_bool_at(dhdb_at(s, 1), 0) == true);
+	assert(dhdb_type(dhdb_at(dhdb_at(s, 1), 1)) == DHDB_VALUE_NULL);
+	assert(dhdb_num_by(dhdb_at(s, 2), "a") == -2);
+	assert(dhdb_num_at(s, 3) == 3);
+	dhdb_free(s);
+
 	// Mixed object
 	s = _test("Mixed object", "{ \"f1\" : \"val1\", \"f2\" : 3, \"f3\" : -3.5 }", want_export_import);
 	assert(dhdb_type(s) == DHDB_VALUE_OBJECT);
@@ -166,9 +177,286 @@ static void _test_parse(bool want_export_import)
 	dhdb_free(s);
 }
 
+static void _test_lazy()
+{
+	const char *json = "{ \"f1\" : [ 2, [ 1, 3 ], { \"x\" : \"y\" } ], \"f2\" : { \"foo\" : false, \"bar\" : { } }, \"f3\" : -3 }";
+	dhdb_t *s, *eager;
+	char *str;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Lazy parsing");
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_LAZY);
+	assert(dhdb_type(s) == DHDB_VALUE_OBJECT);
+	assert(dhdb_len(s) == 3);
+	assert(dhdb_num_by(s, "f3") == -3);
+	assert(dhdb_type(dhdb_by(s, "f1")) == DHDB_VALUE_ARRAY);
+	assert(dhdb_type(dhdb_by(s, "f2")) == DHDB_VALUE_OBJECT);
+	assert(dhdb_num_at(dhdb_at(dhdb_by(s, "f1"), 1), 1) == 3);
+	assert(!strcmp(dhdb_str_by(dhdb_at(dhdb_by(s, "f1"), 2), "x"), "y"));
+	assert(dhdb_len(dhdb_by(dhdb_by(s, "f2"), "bar")) == 0);
+	dhdb_set_obj_num(dhdb_by(s, "f2"), "baz", 1);
+	assert(dhdb_len(dhdb_by(s, "f2")) == 3);
+	dhdb_free(s);
+
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_LAZY);
+	eager = dhdb_create_from_json(json);
+	str = strdup(dhdb_to_json(s));
+	assert(!strcmp(str, dhdb_to_json(eager)));
+	free(str);
+	dhdb_free(eager);
+	dhdb_free(s);
+
+	/* Errors inside a lazy container are found on first access */
+	json = "{\"a\": {\"b\": , \"c\": 1}, \"d\": [1, 2]}";
+	const char *at = NULL;
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_LAZY);
+	assert(s);
+	assert(dhdb_json_lazy_error(s, &at) == NULL);
+	assert(dhdb_json_lazy_error(dhdb_by(s, "d"), &at) == NULL);
+	assert(dhdb_len(dhdb_by(s, "d")) == 2);
+	assert(dhdb_json_lazy_error(dhdb_by(s, "a"), &at) != NULL);
+	assert(at == strchr(json, ','));
+	assert(dhdb_type(dhdb_by(s, "a")) == DHDB_VALUE_OBJECT);
+	assert(dhdb_len(dhdb_by(s, "a")) == 0);
+	assert(dhdb_json_lazy_error(dhdb_by(s, "a"), NULL) != NULL);
+	assert(dhdb_create_from_json(json) == NULL);
+	dhdb_free(s);
+}
+
+static void _test_raw_numbers()
+{
+	const char *json = "{ \"big\" : 12345678901234567890123, \"exact\" : [ 0.10000000000000000000001, 1e3 ] }";
+	dhdb_t *s, *eager;
+	char *str;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Raw numbers");
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_RAW_NUMBERS | DHDB_JSON_LAZY);
+	assert(strstr(dhdb_to_json(s), "12345678901234567890123"));
+	assert(strstr(dhdb_to_json(s), "[ 0.10000000000000000000001,1e3 ]"));
+	assert(dhdb_num_at(dhdb_by(s, "exact"), 1) == 1000);
+	assert(dhdb_num_text(dhdb_at(dhdb_by(s, "exact"), 1), NULL));
+	dhdb_set_num_inc(dhdb_at(dhdb_by(s, "exact"), 1));
+	assert(dhdb_num_text(dhdb_at(dhdb_by(s, "exact"), 1), NULL) == NULL);
+	assert(strstr(dhdb_to_json(s), "[ 0.10000000000000000000001,1001 ]"));
+	dhdb_free(s);
+
+	/* Only text in the JSON number grammar is written back as it is */
+	json = "[-0, 1.5e+3, 0.25, -12E-2, 1-2, --, 1e, 01, 2., 3]";
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_RAW_NUMBERS);
+	eager = dhdb_create_from_json(json);
+	assert(dhdb_num_text(dhdb_at(s, 3), NULL));
+	assert(dhdb_num_text(dhdb_at(s, 4), NULL) == NULL);
+	assert(dhdb_num_text(dhdb_at(s, 7), NULL) == NULL);
+	assert(!strncmp(dhdb_to_json(s), "[ -0,1.5e+3,0.25,-12E-2,", 24));
+	str = strdup(dhdb_to_json(s) + 24);
+	assert(!strcmp(str, dhdb_to_json(eager) + strlen(dhdb_to_json(eager)) - strlen(str)));
+	free(str);
+	dhdb_free(eager);
+	dhdb_free(s);
+}
+
+static void _test_insitu()
+{
+	char *buf = strdup("{ \"f1\" : \"val1\", \"f2\" : [ \"a\", { \"b\" : \"c\" } ], \"f3\" : 3 }");
+	dhdb_t *s, *n;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "In-situ parsing with borrowed strings");
+	s = dhdb_create_from_json_insitu(buf, DHDB_JSON_LAZY);
+	assert(!strcmp(dhdb_str_by(s, "f1"), "val1"));
+	assert(dhdb_str_by(s, "f1") > buf && dhdb_str_by(s, "f1") < buf + strlen("{ \"f1\" : \"val1"));
+	assert(!strcmp(dhdb_str_at(dhdb_by(s, "f2"), 0), "a"));
+	assert(!strcmp(dhdb_str_by(dhdb_at(dhdb_by(s, "f2"), 1), "b"), "c"));
+	dhdb_set_str_add(dhdb_by(s, "f1"), " and more");
+	assert(!strcmp(dhdb_str_by(s, "f1"), "val1 and more"));
+	n = dhdb_detach(dhdb_by(s, "f3"));
+	assert(dhdb_name(n) == NULL);
+	dhdb_free(n);
+	dhdb_set_array(dhdb_by(s, "f2"));
+	dhdb_free(s);
+	free(buf);
+}
+
+static void _test_clone()
+{
+	char *buf = strdup("{ \"f1\" : [ 1, { \"x\" : \"y\" } ], \"f2\" : 12345678901234567890123, \"f3\" : \"z\" }");
+	dhdb_t *s, *c;
+	char *str;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Cloning lazy in-situ trees");
+	s = dhdb_create_from_json_insitu(buf, DHDB_JSON_LAZY | DHDB_JSON_RAW_NUMBERS);
+	c = dhdb_create_from(s);
+	str = strdup(dhdb_to_json(s));
+	dhdb_free(s);
+	memset(buf, ' ', strlen(buf));
+	free(buf);
+
+	assert(!strcmp(dhdb_to_json(c), str));
+	assert(!strcmp(dhdb_str_by(dhdb_at(dhdb_by(c, "f1"), 1), "x"), "y"));
+	assert(!strcmp(dhdb_num_text(dhdb_by(c, "f2"), NULL), "12345678901234567890123"));
+	free(str);
+	dhdb_free(c);
+}
+
+static void _test_packed()
+{
+	const char *json = "{ \"a\" : [ 1, 2.5, -3e2 ], \"b\" : [ 1, \"x\", 2 ], \"c\" : [\n 4,\n 5\n], \"d\" : [ ], \"e\" : [ [ 1, 2 ], 3 ] }";
+	dhdb_t *s, *eager;
+	char *str;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Packed number arrays");
+	eager = dhdb_create_from_json(json);
+	str = strdup(dhdb_to_json(eager));
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_PACKED);
+	assert(dhdb_size(s) < dhdb_size(eager));
+	assert(dhdb_equal(s, eager));
+	assert(!strcmp(dhdb_to_json(s), str));
+	assert(dhdb_array_sum(dhdb_by(s, "a")) == -296.5);
+	assert(dhdb_array_min(dhdb_by(s, "c")) == 4);
+	assert(dhdb_array_sum(dhdb_by(s, "b")) == 3);
+	assert(!strcmp(dhdb_str_at(dhdb_by(s, "b"), 1), "x"));
+	assert(dhdb_num_at(dhdb_at(dhdb_by(s, "e"), 0), 1) == 2);
+	dhdb_free(s);
+
+	s = dhdb_create_from_json_opt(json, DHDB_JSON_PACKED | DHDB_JSON_LAZY);
+	assert(dhdb_array_mean(dhdb_by(s, "c")) == 4.5);
+	assert(!strcmp(dhdb_to_json(s), str));
+	free(str);
+	str = strdup(dhdb_to_json_pretty(eager));
+	assert(!strcmp(dhdb_to_json_pretty(s), str));
+	dhdb_free(s);
+
+	s = dhdb_create_from_json_opt("[ 1, 2.a, 3 ]", DHDB_JSON_PACKED);
+	assert(s == NULL);
+	free(str);
+	dhdb_free(eager);
+}
+
+static void _test_shapes()
+{
+	const char *json = "{ \"users\" : [ "
+	    "{ \"id\" : 1, \"name\" : \"a\", \"home\" : { \"x\" : 1, \"y\" : 2 } }, "
+	    "{ \"id\" : 2, \"name\" : \"b\", \"home\" : { \"x\" : 3, \"y\" : 4 } }, "
+	    "{ \"id\" : 3, \"nick\" : \"c\" }, "
+	    "{ \"id\" : 4, \"name\" : \"d\", \"home\" : { \"x\" : 5, \"y\" : 6 } }, "
+	    "{ \"id\" : 5 } ] }";
+	dhdb_t *s, *u, *v, *eager;
+	char *str;
+	int opts[] = { DHDB_JSON_SHAPES, DHDB_JSON_SHAPES | DHDB_JSON_LAZY };
+	dhdb_lookup_cache_t ic;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Objects sharing their shape");
+	eager = dhdb_create_from_json(json);
+	str = strdup(dhdb_to_json(eager));
+	for (int i = 0; i < 2; i++) {
+		s = dhdb_create_from_json_opt(json, opts[i]);
+		u = dhdb_by(s, "users");
+		assert(dhdb_equal(s, eager));
+		assert(!strcmp(dhdb_to_json(s), str));
+		assert(dhdb_name(dhdb_by(dhdb_at(u, 0), "name")) ==
+		    dhdb_name(dhdb_by(dhdb_at(u, 3), "NAME")));
+		assert(dhdb_name(dhdb_by(dhdb_at(u, 0), "id")) !=
+		    dhdb_name(dhdb_by(dhdb_at(u, 2), "id")));
+		assert(dhdb_num_by(dhdb_by(dhdb_at(u, 3), "home"), "y") == 6);
+		assert(dhdb_by(dhdb_at(u, 3), "nick") == NULL);
+		assert(!strcmp(dhdb_str_by(dhdb_at(u, 2), "nick"), "c"));
+		ic = (dhdb_lookup_cache_t) { 0 };
+		for (v = dhdb_first(u); v; v = dhdb_next(v))
+			assert(dhdb_num(dhdb_by_cached(v, "id", &ic)) == dhdb_num_by(v, "id"));
+		assert(ic.hits == 4 && ic.misses == 1);
+
+		/* Changing the members of one leaves the others be */
+		dhdb_set_obj_num(dhdb_at(u, 0), "age", 30);
+		dhdb_free(dhdb_by(dhdb_at(u, 1), "home"));
+		dhdb_set_obj_str(dhdb_at(u, 3), "name", "e");
+		v = dhdb_create_shared(dhdb_at(u, 3));
+		dhdb_free(dhdb_detach(dhdb_by(v, "id")));
+		assert(dhdb_len(v) == 2 && dhdb_len(dhdb_at(u, 3)) == 3);
+		dhdb_free(v);
+		v = dhdb_create_from(dhdb_at(u, 3));
+		dhdb_free(dhdb_at(u, 3));
+		assert(!strcmp(dhdb_str_by(v, "name"), "e"));
+		assert(dhdb_num_by(dhdb_at(u, 0), "age") == 30);
+		assert(dhdb_by(dhdb_at(u, 1), "home") == NULL);
+		assert(!strcmp(dhdb_str_by(dhdb_at(u, 1), "name"), "b"));
+		dhdb_set_array(dhdb_at(u, 0));
+		dhdb_free(s);
+		assert(dhdb_num_by(dhdb_by(v, "home"), "x") == 5);
+		dhdb_free(v);
+	}
+	free(str);
+	dhdb_free(eager);
+}
+
+static void _test_output_buffers()
+{
+	dhdb_t *s;
+	char buf[16], *big;
+	int len;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Output to caller buffers");
+	s = dhdb_create_from_json("{ \"f1\" : [ 1, 2 ], \"f2\" : \"value\" }");
+	len = dhdb_to_json_r(s, buf, sizeof(buf));
+	assert(len == strlen(dhdb_to_json(s)));
+	assert(strlen(buf) == sizeof(buf) - 1);
+	assert(!strncmp(buf, dhdb_to_json(s), sizeof(buf) - 1));
+	assert(dhdb_to_json_pretty_r(s, NULL, 0) == strlen(dhdb_to_json_pretty(s)));
+
+	big = malloc(100000);
+	memset(big, 'x', 99999);
+	big[99999] = 0;
+	dhdb_set_obj_str(s, "big", big);
+	assert(strlen(dhdb_to_json(s)) > 100000);
+	assert(strstr(dhdb_to_json(s), big));
+	free(big);
+	dhdb_free(s);
+}
+
+static void _test_ndjson()
+{
+	dhdb_ndjson_t *it;
+	dhdb_t *s;
+	FILE *fp;
+	int i;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Reading NDJSON records");
+	fp = tmpfile();
+	fputs("{ \"id\" : 0 }\n\n  \n{ \"id\" : 1, \"tags\" : [ 1, 2 ] }\r\n"
+	    "{ \"id\" : 2 }", fp);
+	rewind(fp);
+	it = dhdb_ndjson_create(fp);
+	for (i = 0; (s = dhdb_ndjson_next(it)); i++) {
+		assert(dhdb_num_by(s, "id") == i);
+		dhdb_free(s);
+	}
+	assert(i == 3);
+	assert(!dhdb_ndjson_error(it));
+	assert(dhdb_ndjson_next(it) == NULL);
+	dhdb_ndjson_free(it);
+
+	rewind(fp);
+	fputs("{ \"id\" : 0 }\n{ \"id\" 1 }\n{ \"id\" : 2 }\n", fp);
+	rewind(fp);
+	it = dhdb_ndjson_create(fp);
+	s = dhdb_ndjson_next(it);
+	assert(dhdb_num_by(s, "id") == 0);
+	dhdb_free(s);
+	assert(dhdb_ndjson_next(it) == NULL);
+	assert(dhdb_ndjson_error(it));
+	assert(dhdb_ndjson_next(it) == NULL);
+	dhdb_ndjson_free(it);
+	fclose(fp);
+}
+
 int main(int argc, char **argv)
 {
 	_progName = argv[0];
 	_test_parse(true);
+	_test_lazy();
+	_test_raw_numbers();
+	_test_insitu();
+	_test_clone();
+	_test_packed();
+	_test_shapes();
+	_test_output_buffers();
+	_test_ndjson();
 	return 0;
 }
@@ -0,0 +1,180 @@
+#include "dhdb_json_par.h"
+#include "dhdb_json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_ITEMS	20000
+
+char *_progName;
+
+/* Reads back what was written to fd and empties it for the next write */
+static char* _contents(int fd, long len)
+{
+	char *buf;
+
+	buf = malloc(len + 1);
+	assert(buf);
+	assert(pread(fd, buf, len, 0) == len);
+	buf[len] = 0;
+	assert(ftruncate(fd, 0) == 0);
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	return buf;
+}
+
+static void _check(dhdb_pool_t *p, dhdb_t *s)
+{
+	FILE *fp;
+	char *buf;
+	long len;
+
+	fp = tmpfile();
+	assert(fp);
+	len = dhdb_par_to_json_fd(p, s, fileno(fp));
+	buf = _contents(fileno(fp), len);
+	assert(len == strlen(dhdb_to_json(s)));
+	assert(!strcmp(buf, dhdb_to_json(s)));
+	free(buf);
+
+	len = dhdb_par_to_json_pretty_fd(p, s, fileno(fp));
+	buf = _contents(fileno(fp), len);
+	assert(!strcmp(buf, dhdb_to_json_pretty(s)));
+	free(buf);
+	fclose(fp);
+}
+
+static void _test_export()
+{
+	dhdb_pool_t *p;
+	dhdb_t *s, *v, *n;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Parallel export");
+	p = dhdb_pool_create(4);
+	s = dhdb_create();
+	for (int i = 0; i < NUM_ITEMS; i++) {
+		v = dhdb_create();
+		dhdb_set_obj_num(v, "id", i);
+		dhdb_set_obj_num(v, "ratio", i / 3.0);
+		dhdb_set_obj_str(v, "name", "item");
+		n = dhdb_create();
+		for (int j = 0; j < i % 4; j++)
+			dhdb_add_num(n, j);
+		dhdb_set_obj(v, "tags", n);
+		dhdb_add(s, v);
+	}
+	_check(p, s);
+
+	/* Object root, a few members, scalars and empty containers */
+	v = dhdb_create();
+	dhdb_set_obj(v, "items", s);
+	dhdb_set_obj_str(v, "title", "export");
+	_check(p, v);
+	_check(p, dhdb_by(v, "title"));
+	dhdb_free(v);
+
+	v = dhdb_create_from_json("[ 1, { \"a\" : [ ] }, \"x\" ]");
+	_check(p, v);
+	_check(p, dhdb_at(v, 1));
+	_check(p, dhdb_by(dhdb_at(v, 1), "a"));
+	dhdb_free(v);
+
+	assert(dhdb_par_to_json_fd(p, s = dhdb_create_num(1), -1) == -1);
+	dhdb_free(s);
+	dhdb_pool_free(p);
+}
+
+static void _test_import()
+{
+	dhdb_pool_t *p;
+	dhdb_t *s, *v, *n, *ndjson;
+	char *json;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Parallel import");
+	p = dhdb_pool_create(4);
+	s = dhdb_create();
+	for (int i = 0; i < NUM_ITEMS; i++) {
+		v = dhdb_create();
+		dhdb_set_obj_num(v, "id", i);
+		dhdb_set_obj_str(v, "name", i % 2 ? "a, [b]" : "{c}");
+		n = dhdb_set_array(dhdb_create());
+		for (int j = 0; j < i % 4; j++)
+			dhdb_add_num(n, j);
+		dhdb_set_obj(v, "tags", n);
+		dhdb_add(s, v);
+	}
+	json = strdup(dhdb_to_json(s));
+
+	v = dhdb_par_create_from_json(p, json, 0);
+	assert(v && dhdb_len(v) == NUM_ITEMS);
+	assert(dhdb_equal(s, v));
+	assert(!strcmp(dhdb_to_json(v), json));
+	for (int i = 0; i < NUM_ITEMS; i += NUM_ITEMS / 10) {
+		n = dhdb_at(v, i);
+		assert(dhdb_index(n) == i && dhdb_parent(n) == v);
+		assert(dhdb_num_by(n, "id") == i);
+	}
+	dhdb_add_num(v, 1);
+	assert(dhdb_index(dhdb_last(v)) == NUM_ITEMS);
+	dhdb_free(v);
+
+	v = dhdb_par_create_from_json(p, json, DHDB_JSON_LAZY | DHDB_JSON_RAW_NUMBERS);
+	assert(dhdb_equal(s, v));
+	dhdb_free(v);
+
+	/* One record per line, with blank lines between */
+	ndjson = dhdb_create_str("");
+	for (n = dhdb_first(s); n; n = dhdb_next(n)) {
+		dhdb_set_str_add(ndjson, dhdb_to_json(n));
+		if (dhdb_index(n) % 100 == 0)
+			dhdb_set_str_add(ndjson, "\n");
+	}
+	v = dhdb_par_create_from_ndjson(p, dhdb_str(ndjson), 0);
+	assert(dhdb_len(v) == NUM_ITEMS);
+	assert(dhdb_equal(s, v));
+	dhdb_free(v);
+	dhdb_free(ndjson);
+
+	/* A root of only numbers is packed as by the serial parser */
+	v = dhdb_par_create_from_json(p, "[ 1, 2.5, -3 ]", DHDB_JSON_PACKED);
+	n = dhdb_create_from_json_opt("[ 1, 2.5, -3 ]", DHDB_JSON_PACKED);
+	assert(dhdb_size(v) == dhdb_size(n) && dhdb_equal(v, n));
+	assert(dhdb_num_at(v, 1) == 2.5);
+	dhdb_free(n);
+	dhdb_free(v);
+	v = dhdb_par_create_from_json(p, "[ 1, [ 2, 3 ] ]", DHDB_JSON_PACKED);
+	n = dhdb_create_from_json_opt("[ 1, [ 2, 3 ] ]", DHDB_JSON_PACKED);
+	assert(dhdb_size(v) == dhdb_size(n) && dhdb_equal(v, n));
+	dhdb_free(n);
+	dhdb_free(v);
+
+	/* Other roots, empty arrays and errors */
+	v = dhdb_par_create_from_json(p, " { \"a\" : [ 1 ] }", 0);
+	assert(dhdb_num_at(dhdb_by(v, "a"), 0) == 1);
+	dhdb_free(v);
+	v = dhdb_par_create_from_json(p, "[ ]", 0);
+	assert(dhdb_type(v) == DHDB_VALUE_ARRAY && dhdb_len(v) == 0);
+	dhdb_free(v);
+	v = dhdb_par_create_from_ndjson(p, "", 0);
+	assert(dhdb_type(v) == DHDB_VALUE_ARRAY && dhdb_len(v) == 0);
+	dhdb_free(v);
+	json[strlen(json) - 2] = ' ';
+	assert(dhdb_par_create_from_json(p, json, 0) == NULL);
+	assert(dhdb_par_create_from_json(p, "[ 1, \"x, 2 ]", 0) == NULL);
+	assert(dhdb_par_create_from_json(p, "[ 1, x ]", 0) == NULL);
+	assert(dhdb_par_create_from_ndjson(p, "1\n{ \"a\" 2 }\n", 0) == NULL);
+
+	free(json);
+	dhdb_free(s);
+	dhdb_pool_free(p);
+}
+
+int main(int argc, char **argv)
+{
+	_progName = argv[0];
+	_test_export();
+	_test_import();
+	return 0;
+}
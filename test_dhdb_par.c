@@ -0,0 +1,135 @@
+#include "dhdb_par.h"
+#include "dhdb_json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#define NUM_ITEMS	5000
+
+char *_progName;
+
+/* A large array, a small object with deep and wide members, and a clone block */
+static dhdb_t* _tree()
+{
+	dhdb_t *s, *items, *v, *n;
+
+	s = dhdb_create();
+	items = dhdb_create();
+	for (int i = 0; i < NUM_ITEMS; i++) {
+		v = dhdb_create();
+		dhdb_set_obj_num(v, "id", i);
+		dhdb_set_obj_str(v, "name", "item");
+		n = dhdb_create();
+		for (int j = 0; j < i % 7; j++)
+			dhdb_add_num(n, j);
+		dhdb_set_obj(v, "tags", n);
+		dhdb_add(items, v);
+	}
+	dhdb_set_obj(s, "items", items);
+
+	v = s;
+	for (int i = 0; i < 100; i++) {
+		n = dhdb_create();
+		dhdb_set_obj_num(n, "level", i);
+		dhdb_set_obj(v, "deeper", n);
+		v = n;
+	}
+	dhdb_set_obj_str(s, "title", "par");
+
+	v = dhdb_create();
+	for (int i = 0; i < 100; i++)
+		dhdb_add_str(v, "cloned");
+	n = dhdb_create();
+	dhdb_set_obj(n, "list", dhdb_create_from(v));
+	dhdb_set_obj(n, "json", dhdb_create_from_json_opt(
+	    "{ \"a\" : [ 1, 2, { \"b\" : 3 } ], \"c\" : 1.50 }",
+	    DHDB_JSON_LAZY | DHDB_JSON_RAW_NUMBERS));
+	dhdb_free(v);
+	v = dhdb_create();
+	for (int i = 0; i < 1000; i++)
+		dhdb_add_num_array(v, (double[]) { i, i * 0.5 }, 2);
+	dhdb_set_obj(n, "samples", v);
+	dhdb_set_obj(s, "other", n);
+	return s;
+}
+
+static void _test_ops(int threads)
+{
+	dhdb_pool_t *p;
+	dhdb_t *s, *c, *v;
+	char desc[64];
+
+	snprintf(desc, sizeof(desc), "Parallel operations with %d threads", threads);
+	printf("\033[1m%s: %s\033[0m\n", _progName, desc);
+	p = dhdb_pool_create(threads);
+	assert(threads == 0 || dhdb_pool_threads(p) == threads);
+	s = _tree();
+
+	assert(dhdb_par_size(p, s) == dhdb_size(s));
+	c = dhdb_par_clone(p, s);
+	assert(dhdb_name(c) == NULL);
+	assert(dhdb_par_size(p, c) == dhdb_size(c));
+	assert(dhdb_equal(s, c));
+	assert(dhdb_par_equal(p, s, c));
+	assert(!strcmp(dhdb_to_json(s), dhdb_to_json(c)));
+
+	/* Differences deep in a run and in the spine */
+	v = dhdb_by(dhdb_at(dhdb_by(c, "items"), NUM_ITEMS - 1), "tags");
+	dhdb_set_num_inc(dhdb_at(v, 0));
+	assert(!dhdb_par_equal(p, s, c));
+	dhdb_set_num_dec(dhdb_at(v, 0));
+	assert(dhdb_par_equal(p, c, s));
+	dhdb_set_obj_str(c, "title", "other");
+	assert(!dhdb_par_equal(p, s, c));
+	dhdb_set_obj_str(c, "title", "par");
+	v = dhdb_by(dhdb_by(c, "other"), "samples");
+	assert(dhdb_array_sum(v) == dhdb_array_sum(dhdb_by(dhdb_by(s, "other"), "samples")));
+	dhdb_add_num(v, 0);
+	assert(!dhdb_par_equal(p, s, c));
+	dhdb_add_num(dhdb_by(c, "items"), 1);
+	assert(!dhdb_par_equal(p, s, c));
+	assert(!dhdb_par_equal(p, s, dhdb_by(c, "title")));
+
+	/* Freeing a subtree unlinks it from its parent */
+	dhdb_par_free(p, dhdb_by(c, "items"));
+	assert(dhdb_len(c) == 3);
+	assert(dhdb_by(c, "items") == NULL);
+	dhdb_par_free(p, c);
+
+	c = dhdb_par_clone(p, dhdb_by(s, "items"));
+	assert(dhdb_len(c) == NUM_ITEMS);
+	assert(dhdb_par_equal(p, c, dhdb_by(s, "items")));
+	dhdb_par_free(p, c);
+
+	v = dhdb_create_num(1);
+	c = dhdb_par_clone(p, v);
+	assert(dhdb_par_equal(p, v, c));
+	assert(dhdb_par_size(p, c) == dhdb_size(v));
+	dhdb_par_free(p, c);
+	dhdb_par_free(p, v);
+
+	/* Proxies and their values are released in different runs */
+	c = dhdb_create();
+	v = dhdb_create();
+	dhdb_set_obj(c, "values", v);
+	dhdb_set_obj(c, "proxies", dhdb_create());
+	for (int i = 0; i < NUM_ITEMS; i++) {
+		dhdb_add_num(v, i);
+		dhdb_add(dhdb_by(c, "proxies"), dhdb_create_shared(dhdb_last(v)));
+	}
+	dhdb_par_free(p, c);
+
+	dhdb_par_free(p, s);
+	dhdb_pool_free(p);
+}
+
+int main(int argc, char **argv)
+{
+	_progName = argv[0];
+	_test_ops(1);
+	_test_ops(3);
+	_test_ops(0);
+	return 0;
+}
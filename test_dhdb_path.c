@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <string.h>
 #include <fnmatch.h>
+#include <pthread.h>
 
 static void _test_pick(dhdb_t *s, const char *path, int expected_elems)
 {
@@ -67,16 +68,314 @@ static void test_multi()
 	_test_pick(s, "*", 4);
 	_test_pick(s, "foobar.*", 4);
 	
-	// TODO: expansion from left side and handling non-wildcard in middle
-	//_test_pick(s, "*.laalaa.*", 3);
-	//_test_pick(s, "*.fuu2", 2);
+	_test_pick(s, "**.laalaa.*", 2);
+	_test_pick(s, "**.fuu2", 2);
+	_test_pick(s, "**", 10);
 	
 	dhdb_free(s);
 }
 
+/* Counts the matches of path, checking that each has the expected name */
+static int _count_pick(dhdb_t *s, const char *name, const char *path)
+{
+	dhdb_path_iter_t *pi;
+	dhdb_t *e;
+	int elems = 0;
+
+	for (e = dhdb_path_pick_first(s, &pi, path); e; e = dhdb_path_pick_next(pi)) {
+		if (name)
+			assert(!strcmp(dhdb_name(e), name));
+		elems++;
+	}
+	dhdb_path_pick_free(&pi);
+	return elems;
+}
+
+static void test_pick_queries()
+{
+	dhdb_t *s = dhdb_create();
+	dhdb_t *items = dhdb_create();
+	const char *names[] = { "a", "b", "c", "d" };
+	double prices[] = { 5, 15, 25.5, 10 };
+
+	printf("TEST PICK RANGES AND PREDICATES\n");
+	dhdb_path_internal_set_separator('.');
+	for (int i = 0; i < 4; i++) {
+		dhdb_t *v = dhdb_create();
+		dhdb_set_obj_str(v, "name", names[i]);
+		dhdb_set_obj_num(v, "price", prices[i]);
+		if (i == 2)
+			dhdb_set_obj(v, "sale", dhdb_create_bool(true));
+		dhdb_add(items, v);
+	}
+	dhdb_set_obj(s, "items", items);
+
+	assert(_count_pick(s, NULL, "items[1:]") == 3);
+	assert(_count_pick(s, "name", "items[0:2].name") == 2);
+	assert(_count_pick(s, "price", "items[:].price") == 4);
+	assert(!strcmp(dhdb_str(dhdb_path_pick_first_only(s, "items[-1].name")), "d"));
+	assert(!strcmp(dhdb_str(dhdb_path_pick_first_only(s, "items[-2:-1].name")), "c"));
+	assert(!strcmp(dhdb_str(dhdb_path_pick_first_only(s, "items[ 1 ].name")), "b"));
+	assert(_count_pick(s, NULL, "items[9]") == 0);
+
+	assert(_count_pick(s, "name", "items[price>10].name") == 2);
+	assert(_count_pick(s, "name", "items.[price>=10].name") == 3);
+	assert(_count_pick(s, "name", "items[price>15.5].name") == 1);
+	assert(_count_pick(s, "name", "items[price != 15].name") == 3);
+	assert(_count_pick(s, NULL, "items[price<=10][name=d]") == 1);
+	assert(dhdb_path_pick_first_only(s, "items[price<5]") == NULL);
+	assert(dhdb_num(dhdb_path_pick_first_only(s, "items[name='b'].price")) == 15);
+	assert(dhdb_num(dhdb_path_pick_first_only(s, "items[name==c].price")) == 25.5);
+	assert(!strcmp(dhdb_str(dhdb_path_pick_first_only(s, "items[sale=true].name")), "c"));
+	assert(_count_pick(s, NULL, "items[sale=false]") == 0);
+
+	assert(_count_pick(s, "price", "**.price") == 4);
+	assert(_count_pick(s, "price", "**[price>10].price") == 2);
+	assert(_count_pick(s, NULL, "items.*") == 9);
+	assert(_count_pick(s, NULL, "items[0]x") == 0);
+	assert(_count_pick(s, NULL, "items[1") == 0);
+	assert(_count_pick(s, NULL, "items[x:y]") == 0);
+	assert(_count_pick(s, NULL, "") == 1);
+
+	/* Packed numbers are unpacked only when they can match */
+	dhdb_t *v = dhdb_create();
+	dhdb_add_num_array(v, (double[]) { 1, 2, 3 }, 3);
+	dhdb_set_obj(s, "samples", v);
+	uint32_t size = dhdb_size(s);
+	assert(_count_pick(s, NULL, "samples[x>1]") == 0);
+	assert(_count_pick(s, NULL, "samples[0:2][x>1]") == 0);
+	assert(_count_pick(s, "price", "**.price") == 4);
+	assert(_count_pick(s, NULL, "**[price>10]") == 2);
+	assert(dhdb_size(s) == size);
+	assert(_count_pick(s, NULL, "samples[1:]") == 2);
+	assert(dhdb_size(s) > size);
+	dhdb_free(dhdb_detach(v));
+
+	/* Deeper than any fixed limit */
+	dhdb_t *n = s;
+	for (int i = 0; i < 1000; i++)
+		n = dhdb_path_set_num(n, i, "level");
+	assert(_count_pick(s, "level", "**.level") == 1000);
+	assert(_count_pick(dhdb_by(s, "level"), "level", "*") == 1);
+	assert(dhdb_num(dhdb_path_pick_first_only(s, "**[level=999].level")) == 999);
+	dhdb_free(s);
+}
+
+static void test_shared_variants()
+{
+	dhdb_t *base = dhdb_create();
+	dhdb_t *v[4];
+
+	printf("TEST PATH SET ON SHARED VARIANTS\n");
+	dhdb_path_set_num(base, 1, "a.b.c");
+	dhdb_path_set_num(base, 2, "a.b.d");
+	dhdb_path_set_str(base, "x", "e.f");
+
+	for (int i = 0; i < 4; i++) {
+		v[i] = dhdb_create_shared(base);
+		dhdb_path_set_num(v[i], i * 10, "a.b.c");
+	}
+	dhdb_path_set_str(v[3], "y", "e.g");
+
+	assert(dhdb_path_num(base, "a.b.c") == 1);
+	for (int i = 0; i < 4; i++) {
+		assert(dhdb_path_num(v[i], "a.b.c") == i * 10);
+		assert(dhdb_path_num(v[i], "a.b.d") == 2);
+		assert(!strcmp(dhdb_path_str(v[i], "e.f"), "x"));
+	}
+	assert(dhdb_path(base, "e.g") == NULL);
+	assert(!strcmp(dhdb_path_str(v[3], "e.g"), "y"));
+
+	dhdb_free(base);
+	for (int i = 0; i < 4; i++)
+		dhdb_free(v[i]);
+}
+
+static void test_get_many()
+{
+	const char *paths[] = {
+		"srv.http.port", "srv.http.host", "srv.db.name", "srv.http", "srv",
+		"srv.http.port", "srv.nope.x", "srv.nope.y", "", "srv.db.user.x",
+		"srv.db.user", "other", "srv.http.host.deeper", "srv.db"
+	};
+	int n = sizeof(paths) / sizeof(paths[0]), found = 0;
+	dhdb_t *s = dhdb_create(), *out[sizeof(paths) / sizeof(paths[0])];
+
+	printf("TEST PATH GET MANY\n");
+	dhdb_path_set_num(s, 8080, "srv.http.port");
+	dhdb_path_set_str(s, "localhost", "srv.http.host");
+	dhdb_path_set_str(s, "app", "srv.db.name");
+	dhdb_path_set_str(s, "admin", "srv.db.user");
+
+	assert(dhdb_path_get_many(s, paths, out, n) == 9);
+	for (int i = 0; i < n; i++) {
+		assert(out[i] == (*paths[i] ? dhdb_path(s, paths[i]) : s));
+		if (out[i])
+			found++;
+	}
+	assert(found == 9);
+	assert(dhdb_num(out[0]) == 8080);
+	assert(!strcmp(dhdb_str(out[1]), "localhost"));
+	assert(out[6] == NULL && out[7] == NULL && out[9] == NULL);
+	assert(dhdb_path_get_many(s, paths, out, 0) == 0);
+	dhdb_free(s);
+}
+
+static void _test_builder(const char **paths, int n)
+{
+	dhdb_t *s = dhdb_create(), *expected = dhdb_create();
+	dhdb_path_builder_t *b = dhdb_path_builder_create(s);
+
+	for (int i = 0; i < n; i++) {
+		assert(dhdb_path_builder_set_num(b, i, paths[i]) == dhdb_path(s, "%s", paths[i]));
+		dhdb_path_set_num(expected, i, "%s", paths[i]);
+	}
+	assert(dhdb_size(s) == dhdb_size(expected));
+	assert(dhdb_equal(s, expected));
+	dhdb_path_builder_free(b);
+	dhdb_free(s);
+	dhdb_free(expected);
+}
+
+static void test_builder()
+{
+	const char *sorted[] = { "a.b.c", "a.b.d", "a.e", "b", "c.d.e.f", "c.d.g" };
+	const char *unsorted[] = { "c.d", "a.x", "c.e", "a.y", "C.d", "a.X.z", "a.b", "a.b-c", "a.b.x" };
+	char path[64];
+
+	printf("TEST PATH BUILDER\n");
+	_test_builder(sorted, sizeof(sorted) / sizeof(sorted[0]));
+	_test_builder(unsorted, sizeof(unsorted) / sizeof(unsorted[0]));
+
+	/* Existing tree, values are replaced and leaves can become objects */
+	dhdb_t *s = dhdb_create();
+	dhdb_path_set_str(s, "old", "k.v");
+	dhdb_path_builder_t *b = dhdb_path_builder_create(s);
+	dhdb_path_builder_set_str(b, "new", "k.v");
+	dhdb_path_builder_set_bool(b, true, "k.w");
+	dhdb_path_builder_set_null(b, "k.w.x");
+	assert(dhdb_len(dhdb_by(s, "k")) == 2);
+	assert(!strcmp(dhdb_path_str(s, "k.v"), "new"));
+	assert(dhdb_type(dhdb_path(s, "k.w.x")) == DHDB_VALUE_NULL);
+	dhdb_path_builder_free(b);
+	dhdb_free(s);
+
+	/* A long sorted stream */
+	s = dhdb_create();
+	b = dhdb_path_builder_create(s);
+	for (int i = 0; i < 10000; i++) {
+		snprintf(path, sizeof(path), "r%02d.s%03d.v", i / 1000, i % 1000);
+		dhdb_path_builder_set_num(b, i, path);
+	}
+	dhdb_path_builder_free(b);
+	assert(dhdb_len(s) == 10);
+	assert(dhdb_len(dhdb_by(s, "r09")) == 1000);
+	assert(dhdb_path_num(s, "r07.s123.v") == 7123);
+	dhdb_free(s);
+}
+
+static void test_path_cache()
+{
+	dhdb_t *s = dhdb_create(), *n;
+	dhdb_path_cache_t *c = dhdb_path_cache_create(s, 16);
+
+	printf("TEST PATH CACHE\n");
+	dhdb_path_set_num(s, 1, "a.b.c");
+	dhdb_path_set_str(s, "x", "a.d");
+	n = dhdb_path(s, "a.b.c");
+	assert(dhdb_path_cached(c, "a.b.c") == n);
+	assert(dhdb_path_cached(c, "a.b.c") == n);
+	assert(dhdb_path_cached(c, "a.e") == NULL);
+
+	/* Values change in place, structure changes invalidate */
+	uint32_t gen = dhdb_generation(dhdb_by(s, "a"));
+	dhdb_set_num(n, 2);
+	assert(dhdb_generation(dhdb_by(s, "a")) == gen);
+	assert(dhdb_path_cached_num(c, "a.b.c") == 2);
+	dhdb_path_set_num(s, 3, "a.e");
+	assert(dhdb_generation(dhdb_by(s, "a")) != gen);
+	assert(dhdb_path_cached_num(c, "a.e") == 3);
+	dhdb_free(dhdb_path(s, "a.b"));
+	assert(dhdb_path_cached(c, "a.b.c") == NULL);
+	dhdb_path_set_num(s, 4, "a.b.c");
+	assert(dhdb_path_cached_num(c, "a.b.c") == 4);
+	dhdb_set_str(dhdb_by(s, "a"), "no longer an object");
+	assert(dhdb_path_cached(c, "a.b.c") == NULL);
+	assert(dhdb_path_cached(c, "a") == dhdb_by(s, "a"));
+	assert(!strcmp(dhdb_path_cached_str(c, "a"), "no longer an object"));
+	dhdb_path_cache_free(c);
+
+	/* Colliding paths replace each other */
+	c = dhdb_path_cache_create(s, 1);
+	dhdb_path_set_bool(s, true, "f.g");
+	for (int i = 0; i < 4; i++) {
+		assert(dhdb_path_cached_bool(c, "f.g"));
+		assert(dhdb_path_cached(c, "f") == dhdb_by(s, "f"));
+	}
+	dhdb_path_cache_free(c);
+	dhdb_free(s);
+}
+
+static void test_path_name_r()
+{
+	dhdb_t *s = dhdb_create(), *n;
+	char buf[8], big[64];
+
+	printf("TEST PATH NAME INTO A SMALL BUFFER\n");
+	n = dhdb_path_set_num(s, 1, "averylongname.anotherlongname");
+	assert(!strcmp(dhdb_path_name_r(n, buf, sizeof(buf)), ""));
+	assert(!strcmp(dhdb_path_name_r(n, big, sizeof(big)), "averylongname.anotherlongname"));
+	assert(!strcmp(dhdb_path_name_r(n, big, 16), "anotherlongname"));
+	assert(!strcmp(dhdb_path_name_r(n, big, 29), "anotherlongname"));
+	assert(!strcmp(dhdb_path_name_r(n, big, 30), "averylongname.anotherlongname"));
+	n = dhdb_path_set_num(s, 2, "a.b.c");
+	assert(!strcmp(dhdb_path_name_r(n, buf, sizeof(buf)), "a.b.c"));
+	assert(!strcmp(dhdb_path_name_r(n, buf, 5), "b.c"));
+	assert(!strcmp(dhdb_path_name_r(n, buf, 1), ""));
+	dhdb_free(s);
+}
+
+static void* _path_worker(void *arg)
+{
+	char sep = *(char *) arg, path[64], name[64];
+	dhdb_t *s = dhdb_create();
+
+	dhdb_path_internal_set_thread_separator(sep);
+	for (int i = 0; i < 1000; i++) {
+		snprintf(path, sizeof(path), "a%cb%d%cc", sep, i % 10, sep);
+		dhdb_path_set_num(s, i, "%s", path);
+		assert(dhdb_path_num(s, "%s", path) == i);
+		snprintf(path, sizeof(path), "a.b%d.c", i % 10);
+		assert(!strcmp(dhdb_path_name_r(dhdb_path(s, "a%cb%d%cc", sep, i % 10, sep), name, sizeof(name)), path));
+		snprintf(path, sizeof(path), "a.b%d", i % 10);
+		assert(!strcmp(dhdb_path_name(dhdb_path(s, "a%cb%d", sep, i % 10)), path));
+	}
+	dhdb_free(s);
+	return NULL;
+}
+
+static void test_threads()
+{
+	static char seps[] = { '/', '.', ':', '|' };
+	pthread_t threads[sizeof(seps)];
+
+	printf("TEST PATH API FROM THREADS\n");
+	for (int i = 0; i < sizeof(seps); i++)
+		pthread_create(&threads[i], NULL, _path_worker, &seps[i]);
+	for (int i = 0; i < sizeof(seps); i++)
+		pthread_join(threads[i], NULL);
+}
+
 int main(int argc, char **argv)
 {
 	test_multi();
+	test_pick_queries();
+	test_shared_variants();
+	test_get_many();
+	test_builder();
+	test_path_cache();
+	test_path_name_r();
+	test_threads();
 
 	return 0;
 }
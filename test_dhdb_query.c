@@ -0,0 +1,241 @@
+#include "dhdb_query.h"
+#include "dhdb_json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#define NUM_ORDERS	10000
+
+static const char *_regions[] = { "EU", "US", "APAC" };
+
+static dhdb_t* _orders()
+{
+	dhdb_t *s = dhdb_create(), *orders = dhdb_create(), *o;
+
+	for (int i = 0; i < NUM_ORDERS; i++) {
+		o = dhdb_create();
+		dhdb_set_obj_num(o, "id", i);
+		dhdb_set_obj_str(o, "region", _regions[i % 3]);
+		if (i % 10)
+			dhdb_set_obj_num(o, "price", i % 100 + 0.5);
+		else
+			dhdb_set_obj(o, "price", dhdb_create_null());
+		dhdb_set_obj_str(o, "status", i % 4 ? "ok" : "cancelled");
+		dhdb_add(orders, o);
+	}
+	dhdb_set_obj(s, "orders", orders);
+	return s;
+}
+
+static void test_filter_project()
+{
+	dhdb_t *s = _orders(), *r, *n;
+	dhdb_query_t *q;
+
+	printf("TEST QUERY FILTER AND PROJECT\n");
+	q = dhdb_query_create(s, "orders");
+	dhdb_query_where(q, "price > 99");
+	dhdb_query_where(q, "region = 'EU'");
+	dhdb_query_select(q, "id");
+	dhdb_query_select(q, "missing");
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 34);	// i = 99 + 300 * k
+	for (n = dhdb_first(r); n; n = dhdb_next(n)) {
+		assert((int) dhdb_num_by(n, "id") % 100 == 99);
+		assert((int) dhdb_num_by(n, "id") % 3 == 0);
+		assert(dhdb_type(dhdb_by(n, "missing")) == DHDB_VALUE_NULL);
+		assert(dhdb_len(n) == 2);
+	}
+	dhdb_free(r);
+
+	/* Runs again from scratch, a limit without order stops early */
+	dhdb_query_limit(q, 2);
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 2);
+	assert(dhdb_num_by(dhdb_at(r, 1), "id") == 399);
+	dhdb_free(r);
+
+	/* A condition that does not fit is left out */
+	char cond[300];
+	memset(cond, 'x', sizeof(cond) - 1);
+	cond[sizeof(cond) - 1] = '\0';
+	assert(!dhdb_query_where(q, cond));
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 2);
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	/* Whole records, ordered */
+	q = dhdb_query_create(s, "orders");
+	dhdb_query_where(q, "status = cancelled");
+	dhdb_query_order_by(q, "price", true);
+	dhdb_query_order_by(q, "id", false);
+	dhdb_query_limit(q, 3);
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 3);
+	assert(dhdb_num_by(dhdb_at(r, 0), "price") == 96.5);
+	assert(dhdb_num_by(dhdb_at(r, 0), "id") == 96);
+	assert(dhdb_num_by(dhdb_at(r, 1), "id") == 196);
+	assert(!strcmp(dhdb_str_by(dhdb_at(r, 2), "region"), _regions[296 % 3]));
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	q = dhdb_query_create(s, "nothing");
+	assert(dhdb_query_run(q) == NULL);
+	dhdb_query_free(q);
+	dhdb_free(s);
+}
+
+static void test_aggregate()
+{
+	dhdb_t *s = _orders(), *r, *n;
+	dhdb_query_t *q;
+	double sum[3] = { 0 }, min[3], max[3], count[3] = { 0 }, priced[3] = { 0 };
+
+	printf("TEST QUERY AGGREGATE\n");
+	for (int i = 0; i < 3; i++) {
+		min[i] = INFINITY;
+		max[i] = -INFINITY;
+	}
+	for (int i = 0; i < NUM_ORDERS; i++) {
+		if (i % 4 == 0)
+			continue;
+		count[i % 3]++;
+		if (i % 10 == 0)
+			continue;
+		priced[i % 3]++;
+		sum[i % 3] += i % 100 + 0.5;
+		if (i % 100 + 0.5 < min[i % 3])
+			min[i % 3] = i % 100 + 0.5;
+		if (i % 100 + 0.5 > max[i % 3])
+			max[i % 3] = i % 100 + 0.5;
+	}
+
+	q = dhdb_query_create(s, "orders");
+	dhdb_query_where(q, "status != cancelled");
+	dhdb_query_group_by(q, "region");
+	dhdb_query_agg(q, DHDB_QUERY_COUNT, NULL, NULL);
+	dhdb_query_agg(q, DHDB_QUERY_COUNT, "price", "priced");
+	dhdb_query_agg(q, DHDB_QUERY_SUM, "price", NULL);
+	dhdb_query_agg(q, DHDB_QUERY_MIN, "price", NULL);
+	dhdb_query_agg(q, DHDB_QUERY_MAX, "price", NULL);
+	dhdb_query_agg(q, DHDB_QUERY_AVG, "price", NULL);
+	dhdb_query_order_by(q, "sum_price", true);
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 3);
+	for (n = dhdb_first(r); n; n = dhdb_next(n)) {
+		int g = !strcmp(dhdb_str_by(n, "region"), "EU") ? 0 :
+		    !strcmp(dhdb_str_by(n, "region"), "US") ? 1 : 2;
+		assert(dhdb_num_by(n, "count") == count[g]);
+		assert(dhdb_num_by(n, "priced") == priced[g]);
+		assert(dhdb_num_by(n, "sum_price") == sum[g]);
+		assert(dhdb_num_by(n, "min_price") == min[g]);
+		assert(dhdb_num_by(n, "max_price") == max[g]);
+		assert(dhdb_num_by(n, "avg_price") == sum[g] / priced[g]);
+		if (dhdb_next(n))
+			assert(dhdb_num_by(n, "sum_price") >= dhdb_num_by(dhdb_next(n), "sum_price"));
+	}
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	/* Aggregates without groups give one row, also for no records */
+	q = dhdb_query_create(s, "orders");
+	dhdb_query_where(q, "price > 1000");
+	dhdb_query_agg(q, DHDB_QUERY_COUNT, NULL, NULL);
+	dhdb_query_agg(q, DHDB_QUERY_SUM, "price", NULL);
+	dhdb_query_agg(q, DHDB_QUERY_MAX, "price", NULL);
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 1);
+	assert(dhdb_num_by(dhdb_first(r), "count") == 0);
+	assert(dhdb_num_by(dhdb_first(r), "sum_price") == 0);
+	assert(dhdb_type(dhdb_by(dhdb_first(r), "max_price")) == DHDB_VALUE_NULL);
+	dhdb_free(r);
+	dhdb_query_free(q);
+	dhdb_free(s);
+}
+
+static void test_object_records()
+{
+	const char *json = "{\"users\": {\"ann\": {\"age\": 31, \"team\": 1}, "
+	    "\"bob\": {\"age\": 25, \"team\": 2}, \"cid\": {\"age\": 40, \"team\": 1}, "
+	    "\"dan\": {\"team\": true}}}";
+	dhdb_t *s = dhdb_create_from_json(json), *r;
+	dhdb_query_t *q;
+
+	printf("TEST QUERY OVER OBJECT MEMBERS\n");
+	q = dhdb_query_create(s, "users");
+	dhdb_query_group_by(q, "team");
+	dhdb_query_agg(q, DHDB_QUERY_AVG, "age", "age");
+	dhdb_query_order_by(q, "team", false);
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 3);
+	assert(dhdb_num_by(dhdb_at(r, 0), "team") == 1);
+	assert(dhdb_num_by(dhdb_at(r, 0), "age") == 35.5);
+	assert(dhdb_num_by(dhdb_at(r, 1), "age") == 25);
+	assert(dhdb_type(dhdb_by(dhdb_at(r, 2), "team")) == DHDB_VALUE_BOOL);
+	assert(dhdb_type(dhdb_by(dhdb_at(r, 2), "age")) == DHDB_VALUE_NULL);
+	dhdb_free(r);
+	dhdb_query_free(q);
+	dhdb_free(s);
+}
+
+static void test_packed()
+{
+	dhdb_t *s = dhdb_create(), *v = dhdb_create(), *r;
+	dhdb_query_t *q;
+	double nums[300];
+	uint32_t size;
+
+	printf("TEST QUERY OVER PACKED NUMBERS\n");
+	for (int i = 0; i < 300; i++)
+		nums[i] = i;
+	dhdb_add_num_array(v, nums, 300);
+	dhdb_set_obj(s, "values", v);
+	size = dhdb_size(s);
+
+	/* Numbers are records without fields */
+	q = dhdb_query_create(s, "values");
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 300);
+	assert(dhdb_num_at(r, 299) == 299);
+	dhdb_free(r);
+	dhdb_query_agg(q, DHDB_QUERY_COUNT, NULL, NULL);
+	dhdb_query_agg(q, DHDB_QUERY_MAX, "x", NULL);
+	r = dhdb_query_run(q);
+	assert(dhdb_num_by(dhdb_first(r), "count") == 300);
+	assert(dhdb_type(dhdb_by(dhdb_first(r), "max_x")) == DHDB_VALUE_NULL);
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	q = dhdb_query_create(s, "values");
+	dhdb_query_where(q, "x > 1");
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 0);
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	/* Packed records have no fields either */
+	q = dhdb_query_create(s, "");
+	dhdb_query_select(q, "x");
+	r = dhdb_query_run(q);
+	assert(dhdb_len(r) == 1);
+	assert(dhdb_type(dhdb_by(dhdb_first(r), "x")) == DHDB_VALUE_NULL);
+	dhdb_free(r);
+	dhdb_query_free(q);
+
+	assert(dhdb_size(s) == size);
+	dhdb_free(s);
+}
+
+int main(int argc, char **argv)
+{
+	test_filter_project();
+	test_aggregate();
+	test_object_records();
+	test_packed();
+
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include "dhdb_store.h"
+#include "dhdb_path.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_READERS	4
+#define NUM_VERSIONS	2000
+
+char *_progName;
+
+static dhdb_store_t *_store;
+static int _done;
+
+/* The writer keeps counter/a and counter/b equal in every version */
+static void* _reader(void *arg)
+{
+	int id, reads = 0;
+	double a, b, last = 0;
+	dhdb_t *root;
+
+	id = dhdb_store_register(_store);
+	assert(id >= 0);
+
+	while (!__atomic_load_n(&_done, __ATOMIC_ACQUIRE)) {
+		root = dhdb_store_pin(_store, id);
+		a = dhdb_num_by(dhdb_by(root, "counter"), "a");
+		b = dhdb_num_by(dhdb_by(root, "counter"), "b");
+		assert(a == b);
+		assert(a >= last);
+		assert(!strcmp(dhdb_str_by(dhdb_by(root, "static"), "name"), "config"));
+		assert(dhdb_len(dhdb_by(root, "static")) == 2);
+		last = a;
+		dhdb_store_unpin(_store, id);
+		reads++;
+	}
+	return NULL;
+}
+
+static void _test_versions()
+{
+	pthread_t threads[NUM_READERS];
+	dhdb_t *root, *v;
+	int i;
+
+	printf("\033[1m%s: %s\033[0m\n", _progName, "Versions with concurrent readers");
+
+	root = dhdb_create();
+	dhdb_path_set_num(root, 0, "counter/a");
+	dhdb_path_set_num(root, 0, "counter/b");
+	dhdb_path_set_str(root, "config", "static/name");
+	dhdb_path_set_num(root, 1, "static/level");
+	_store = dhdb_store_create(root);
+
+	for (i = 0; i < NUM_READERS; i++)
+		pthread_create(&threads[i], NULL, _reader, NULL);
+
+	for (i = 1; i <= NUM_VERSIONS; i++) {
+		v = dhdb_store_begin(_store);
+		dhdb_path_set_num(v, i, "counter/a");
+		dhdb_path_set_num(v, i, "counter/b");
+		dhdb_store_publish(_store, v);
+	}
+
+	/* A discarded edit leaves the current version alone */
+	v = dhdb_store_begin(_store);
+	dhdb_path_set_num(v, -1, "counter/a");
+	dhdb_free(v);
+
+	__atomic_store_n(&_done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < NUM_READERS; i++)
+		pthread_join(threads[i], NULL);
+
+	i = dhdb_store_register(_store);
+	root = dhdb_store_pin(_store, i);
+	assert(dhdb_path_num(root, "counter/a") == NUM_VERSIONS);
+	assert(dhdb_path_num(root, "counter/b") == NUM_VERSIONS);
+	dhdb_store_unpin(_store, i);
+	assert(dhdb_store_version(_store) == NUM_VERSIONS + 1);
+
+	dhdb_store_free(_store);
+}
+
+int main(int argc, char **argv)
+{
+	_progName = argv[0];
+	_test_versions();
+	return 0;
+}
@@ -0,0 +1,91 @@
+#include "dhdb_tape.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+char *_progName;
+
+static dhdb_tape_t* _test(const char *name, const char *json)
+{
+	printf("\033[1m%s: %s\033[0m\n", _progName, name);
+	return dhdb_tape_create_from_json(json);
+}
+
+static void _test_tape()
+{
+	dhdb_tape_t *t;
+	uint32_t root, n;
+	dhdb_t *s;
+
+	t = _test("Scalar", "-3.5");
+	assert(dhdb_tape_type(t, dhdb_tape_root(t)) == DHDB_VALUE_NUMBER);
+	assert(dhdb_tape_num(t, dhdb_tape_root(t)) == -3.5);
+	assert(dhdb_tape_next(t, dhdb_tape_root(t)) == 0);
+	dhdb_tape_free(t);
+
+	t = _test("Mixed array", "[ 1, -5.1, \"hello world\", false, true, null, [ ], { } ]");
+	root = dhdb_tape_root(t);
+	assert(dhdb_tape_type(t, root) == DHDB_VALUE_ARRAY);
+	assert(dhdb_tape_len(t, root) == 8);
+	assert(dhdb_tape_num(t, dhdb_tape_at(t, root, 0)) == 1);
+	assert(dhdb_tape_num(t, dhdb_tape_at(t, root, 1)) == -5.1);
+	assert(!strcmp(dhdb_tape_str(t, dhdb_tape_at(t, root, 2)), "hello world"));
+	assert(dhdb_tape_bool(t, dhdb_tape_at(t, root, 3)) == false);
+	assert(dhdb_tape_bool(t, dhdb_tape_at(t, root, 4)) == true);
+	assert(dhdb_tape_type(t, dhdb_tape_at(t, root, 5)) == DHDB_VALUE_NULL);
+	assert(dhdb_tape_len(t, dhdb_tape_at(t, root, 6)) == 0);
+	assert(dhdb_tape_first(t, dhdb_tape_at(t, root, 6)) == 0);
+	assert(dhdb_tape_type(t, dhdb_tape_at(t, root, 7)) == DHDB_VALUE_OBJECT);
+	assert(dhdb_tape_at(t, root, 8) == 0);
+	dhdb_tape_free(t);
+
+	t = _test("Skipping subtrees", "{ \"f1\" : [ 2, [ 1, 3 ], { \"x\" : 1 } ], \"F2\" : { \"foo\" : \"bar\" }, \"f3\" : -3 }");
+	root = dhdb_tape_root(t);
+	assert(dhdb_tape_len(t, root) == 3);
+	n = dhdb_tape_first(t, root);
+	assert(!strcmp(dhdb_tape_name(t, n), "f1"));
+	assert(dhdb_tape_len(t, n) == 3);
+	n = dhdb_tape_next(t, n);
+	assert(!strcmp(dhdb_tape_name(t, n), "F2"));
+	n = dhdb_tape_next(t, n);
+	assert(dhdb_tape_num(t, n) == -3);
+	assert(dhdb_tape_next(t, n) == 0);
+	assert(!strcmp(dhdb_tape_str(t, dhdb_tape_by(t, dhdb_tape_by(t, root, "f2"), "FOO")), "bar"));
+	assert(dhdb_tape_num(t, dhdb_tape_by(t, dhdb_tape_at(t, dhdb_tape_by(t, root, "f1"), 2), "x")) == 1);
+	assert(dhdb_tape_by(t, root, "missing") == 0);
+
+	s = dhdb_tape_to_dhdb(t, root);
+	assert(dhdb_type(s) == DHDB_VALUE_OBJECT);
+	assert(dhdb_num_at(dhdb_at(dhdb_by(s, "f1"), 1), 1) == 3);
+	assert(!strcmp(dhdb_str_by(dhdb_by(s, "f2"), "foo"), "bar"));
+	dhdb_free(s);
+	dhdb_tape_free(t);
+
+	// Error
+	t = _test("Error handling 1", "{ \"f1\" : [ af, foop ] }");
+	assert(t == NULL);
+
+	t = _test("Error handling 2", "{ \"f1\" : [ 1, 2 }");
+	assert(t == NULL);
+
+	t = _test("Error handling 3", "{ f1 : [ 1, 2 ] }");
+	assert(t == NULL);
+
+	t = _test("Error handling 4", "{ \"f1\" [ 1, 2 ] }");
+	assert(t == NULL);
+
+	t = _test("Error handling 5", "[1,2] garbage");
+	assert(t == NULL);
+
+	t = _test("Trailing whitespace", "[1,2] \n");
+	assert(t != NULL);
+	dhdb_tape_free(t);
+}
+
+int main(int argc, char **argv)
+{
+	_progName = argv[0];
+	_test_tape();
+	return 0;
+}
@@ -0,0 +1,187 @@
+#include "dhdb_vindex.h"
+#include "dhdb_path.h"
+#include "dhdb_json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#define NUM_USERS	1000
+
+static dhdb_t* _user(int id)
+{
+	dhdb_t *u = dhdb_create();
+
+	dhdb_set_obj_num(u, "id", id);
+	dhdb_set_obj_num(u, "group", id % 10);
+	dhdb_set_obj(u, "name", dhdb_create_str_va("user%04d", id));
+	return u;
+}
+
+static void test_lookups()
+{
+	dhdb_t *s = dhdb_create(), *users = dhdb_create();
+	dhdb_vindex_t *ids, *groups, *names;
+	int pos, count;
+
+	printf("TEST VINDEX LOOKUPS\n");
+	for (int i = 0; i < NUM_USERS; i++)
+		dhdb_add(users, _user(i));
+	dhdb_set_obj(s, "users", users);
+
+	ids = dhdb_vindex_create(s, "users/*/id");
+	groups = dhdb_vindex_create(s, "users/*/group");
+	names = dhdb_vindex_create(s, "users/*/name");
+	assert(dhdb_vindex_len(ids) == NUM_USERS);
+
+	assert(!strcmp(dhdb_str_by(dhdb_parent(dhdb_vindex_get_num(ids, 42)), "name"), "user0042"));
+	assert(dhdb_vindex_get_num(ids, NUM_USERS) == NULL);
+	assert(dhdb_vindex_get_num(ids, 0.5) == NULL);
+	assert(dhdb_vindex_get_str(ids, "42") == NULL);
+
+	count = dhdb_vindex_num(groups, 3, &pos);
+	assert(count == NUM_USERS / 10);
+	for (int i = 0; i < count; i++)
+		assert(dhdb_num_by(dhdb_parent(dhdb_vindex_at(groups, pos + i)), "id") == i * 10 + 3);
+
+	count = dhdb_vindex_range_num(ids, 10, 19, &pos);
+	assert(count == 10);
+	for (int i = 0; i < count; i++)
+		assert(dhdb_num(dhdb_vindex_at(ids, pos + i)) == 10 + i);
+	assert(dhdb_vindex_range_num(ids, -5, -1, &pos) == 0);
+	assert(dhdb_vindex_range_num(ids, 5, 1, &pos) == 0);
+	assert(dhdb_vindex_range_num(ids, -1e9, 1e9, &pos) == NUM_USERS && pos == 0);
+
+	assert(dhdb_parent(dhdb_vindex_get_str(names, "user0999")) == dhdb_at(users, 999));
+	count = dhdb_vindex_range_str(names, "user0100", "user0199", &pos);
+	assert(count == 100);
+	assert(!strcmp(dhdb_str(dhdb_vindex_at(names, pos)), "user0100"));
+	assert(dhdb_vindex_str(names, "user", &pos) == 0);
+
+	dhdb_vindex_free(ids);
+	dhdb_vindex_free(groups);
+	dhdb_vindex_free(names);
+	dhdb_free(s);
+}
+
+static void test_updates()
+{
+	dhdb_t *s = dhdb_create(), *users, *u;
+	dhdb_vindex_t *ix;
+	uint32_t gen;
+	int pos;
+
+	printf("TEST VINDEX UPDATES\n");
+	ix = dhdb_vindex_create(s, "users/*/id");
+	assert(dhdb_vindex_len(ix) == 0);
+
+	/* Containers that were missing when the index was built */
+	users = dhdb_create();
+	dhdb_set_obj(s, "users", dhdb_set_array(users));
+	assert(dhdb_vindex_len(ix) == 0);
+	for (int i = 0; i < 10; i++)
+		dhdb_add(users, _user(i));
+	assert(dhdb_vindex_len(ix) == 10);
+	u = dhdb_create();
+	dhdb_set_obj_str(u, "name", "no id yet");
+	dhdb_add(users, u);
+	assert(dhdb_vindex_len(ix) == 10);
+	dhdb_set_obj_num(u, "id", 100);
+	assert(dhdb_vindex_get_num(ix, 100) == dhdb_by(u, "id"));
+
+	/* Changed, removed and retyped values */
+	dhdb_set_num(dhdb_by(dhdb_at(users, 3), "id"), 33);
+	assert(dhdb_vindex_get_num(ix, 3) == NULL);
+	assert(dhdb_vindex_get_num(ix, 33) != NULL);
+	dhdb_free(dhdb_at(users, 4));
+	assert(dhdb_vindex_get_num(ix, 4) == NULL);
+	assert(dhdb_vindex_len(ix) == 10);
+	dhdb_set_str(dhdb_by(dhdb_at(users, 0), "id"), "zero");
+	assert(dhdb_vindex_get_num(ix, 0) == NULL);
+	assert(dhdb_vindex_get_str(ix, "zero") != NULL);
+	dhdb_set_bool(dhdb_by(dhdb_at(users, 0), "id"), true);
+	assert(dhdb_vindex_get_str(ix, "zero") == NULL);
+	assert(dhdb_vindex_len(ix) == 9);
+	dhdb_set_str_add(dhdb_by(u, "name"), "!");
+	assert(dhdb_vindex_range_num(ix, 100, 100, &pos) == 1);
+
+	/* Changes outside of the indexed values leave the root alone */
+	gen = dhdb_generation(s);
+	dhdb_set_obj_str(s, "other", "x");
+	assert(dhdb_generation(s) != gen);
+	gen = dhdb_generation(s);
+	dhdb_set_num(dhdb_path(s, "other"), 1);
+	dhdb_set_str(dhdb_by(dhdb_at(users, 1), "name"), "renamed");
+	assert(dhdb_generation(s) == gen);
+
+	/* The whole indexed container replaced */
+	users = dhdb_create();
+	dhdb_add(users, _user(500));
+	dhdb_set_from(dhdb_by(s, "users"), users);
+	dhdb_free(users);
+	assert(dhdb_vindex_len(ix) == 1);
+	assert(dhdb_num(dhdb_vindex_at(ix, 0)) == 500);
+
+	dhdb_vindex_free(ix);
+	dhdb_free(s);
+}
+
+static void test_lazy()
+{
+	const char *json = "{\"items\": [{\"sku\": \"b\", \"n\": 2}, {\"sku\": \"a\", \"n\": 1}, {\"sku\": \"b\", \"n\": 3}]}";
+	dhdb_t *s = dhdb_create_from_json_opt(json, DHDB_JSON_LAZY | DHDB_JSON_RAW_NUMBERS);
+	int pos;
+
+	printf("TEST VINDEX ON LAZY DOCUMENT\n");
+	dhdb_path_internal_set_thread_separator('.');
+	dhdb_vindex_t *ix = dhdb_vindex_create(s, "items.*.sku");
+	dhdb_path_internal_set_thread_separator(0);
+	assert(dhdb_vindex_str(ix, "b", &pos) == 2);
+	assert(dhdb_num_by(dhdb_parent(dhdb_vindex_at(ix, pos)), "n") == 2);
+	assert(dhdb_num_by(dhdb_parent(dhdb_vindex_at(ix, pos + 1)), "n") == 3);
+	assert(dhdb_vindex_str(ix, "a", &pos) == 1);
+	dhdb_vindex_free(ix);
+	dhdb_free(s);
+}
+
+static void test_packed()
+{
+	dhdb_t *s = dhdb_create(), *v = dhdb_create(), *n;
+	dhdb_vindex_t *ix;
+	uint32_t size;
+	int pos;
+
+	printf("TEST VINDEX ON PACKED NUMBERS\n");
+	dhdb_add_num_array(v, (double[]) { 5, 1, 0.0 / 0.0, 5, 3 }, 5);
+	dhdb_set_obj(s, "values", v);
+	size = dhdb_size(s);
+
+	/* Lookups read the numbers in place */
+	ix = dhdb_vindex_create(s, "values/*");
+	assert(dhdb_vindex_len(ix) == 4);
+	assert(dhdb_vindex_num(ix, 5, &pos) == 2 && pos == 2);
+	assert(dhdb_vindex_range_num(ix, 1, 3, &pos) == 2 && pos == 0);
+	assert(dhdb_size(s) == size);
+
+	/* Asking for a node unpacks, changes after that are noticed */
+	n = dhdb_vindex_get_num(ix, 3);
+	assert(n == dhdb_at(v, 4) && dhdb_num(n) == 3);
+	assert(dhdb_size(s) > size);
+	dhdb_set_num(n, 4);
+	assert(dhdb_vindex_get_num(ix, 3) == NULL);
+	assert(dhdb_vindex_get_num(ix, 4) == n);
+	assert(dhdb_vindex_len(ix) == 4);
+	dhdb_vindex_free(ix);
+	dhdb_free(s);
+}
+
+int main(int argc, char **argv)
+{
+	test_lookups();
+	test_updates();
+	test_lazy();
+	test_packed();
+
+	return 0;
+}